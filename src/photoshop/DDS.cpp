@@ -42,14 +42,32 @@
 #include "DDS_version.h"
 #include "DDS_UI.h"
 
+#include "crnlib.h"
 #include "crn_core.h"
 #include "crn_mipmapped_texture.h"
+#include "crn_image_utils.h"
+#include "crn_timer.h"
+#include "crn_threading.h"
+#include "crn_atomics.h"
+#include "crn_cfile_stream.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 
 #ifdef __PIMac__
 #include <mach/mach.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <malloc/malloc.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#else
+#include <malloc.h>
 #endif
 
 // global needed by a bunch of Photoshop SDK routines
@@ -92,6 +110,18 @@ static void InitGlobals(Ptr globalPtr)
 	gOptions.mipmap				= FALSE;
 	gOptions.filter				= DDS_FILTER_MITCHELL;
 	gOptions.cubemap			= FALSE;
+	gOptions.dither				= FALSE;
+	
+	globals->abort_poll_time	= 0.0;
+	globals->abort_max_latency	= 0.0;
+	globals->abort_flag			= 0;
+	globals->progress			= -1;
+	
+	globals->stats_session		= DDS_SESSION_NONE;
+	memset(globals->stats, 0, sizeof(globals->stats));
+	globals->memory_peak		= 0;
+	
+	globals->call_thread		= 0;
 }
 
 
@@ -168,798 +198,7824 @@ static void myDisposeHandle(GPtr globals, Handle h)
 }
 
 
-class ps_data_stream : public crnlib::data_stream
-{
-public:
-	ps_data_stream(intptr_t dataFork, attribs_t attribs);
-	virtual ~ps_data_stream() {};
+// Tracing
+//   If DDS_TRACE names a file, spans from every thread are collected and
+//   written there as Chrome trace-event JSON (chrome://tracing) at the end
+//   of each read or save.  The file holds everything since the host started.
 
-	virtual crnlib::uint read(void* pBuf, crnlib::uint len);
-	virtual crnlib::uint write(const void* pBuf, crnlib::uint len);
-	virtual bool flush() { return true; };
-	virtual crnlib::uint64 get_size();
-	virtual crnlib::uint64 get_remaining();
-	virtual crnlib::uint64 get_ofs();
-	virtual bool seek(crnlib::int64 ofs, bool relative);
+#define TRACE_MAX_EVENTS		(1 << 20)
 
-private:
-	intptr_t _dataFork;
-};
+typedef struct {
+	const char		*name;		// always a string literal
+	double			start;		// seconds
+	double			duration;
+	unsigned int	thread;
+	int				face;
+	int				level;
+	int64			bytes;
+} TraceEvent;
 
+static crnlib::mutex sTraceMutex;
+static crnlib::vector<TraceEvent> sTraceEvents;
+static unsigned int sTraceDropped = 0;
 
-ps_data_stream::ps_data_stream(intptr_t dataFork, attribs_t attribs) :
-	crnlib::data_stream("Photoshop stream", attribs),
-	_dataFork(dataFork)
+
+static const char * TracePath()
 {
-	if( is_writable() )
+	static const char *path = NULL;
+	static bool checked = false;
+	
+	if(!checked)
 	{
-		assert( get_ofs() == 0 );
+		path = getenv("DDS_TRACE");
+		
+		if(path != NULL && *path == '\0')
+			path = NULL;
+		
+		checked = true;
 	}
-	else
-		seek(0, false);
+	
+	return path;
 }
 
 
-crnlib::uint
-ps_data_stream::read(void* pBuf, crnlib::uint len)
+static unsigned int CurrentThreadID()
 {
 #ifdef __PIMac__
-	ByteCount count = len;
-	
-	OSErr result = FSReadFork(_dataFork, fsAtMark, 0, count, pBuf, &count);
-	
-	return count;
+	return pthread_mach_thread_np(pthread_self());
 #else
-	DWORD count = len, bytes_read = 0;
-	
-	BOOL result = ReadFile((HANDLE)_dataFork, pBuf, count, &bytes_read, NULL);
-
-	return bytes_read;
+	return GetCurrentThreadId();
 #endif
 }
 
 
-crnlib::uint
-ps_data_stream::write(const void* pBuf, crnlib::uint len)
+class TraceSpan
 {
-#ifdef __PIMac__
-	ByteCount count = len;
+public:
+	TraceSpan(const char *name, int face = -1, int level = -1);
+	~TraceSpan();
+	
+	void set_bytes(int64 bytes) { _bytes = bytes; }
 
-	OSErr result = FSWriteFork(_dataFork, fsAtMark, 0, count, (const void *)pBuf, &count);
+private:
+	const char *_name;
+	const int _face;
+	const int _level;
+	int64 _bytes;
+	double _start;
+};
+
+
+TraceSpan::TraceSpan(const char *name, int face, int level) :
+	_name(name),
+	_face(face),
+	_level(level),
+	_bytes(-1),
+	_start(TracePath() != NULL ? crnlib::timer::get_secs() : -1.0)
+{
+
+}
+
+
+TraceSpan::~TraceSpan()
+{
+	if(_start < 0.0)
+		return;
 	
-	return count;
-#else
-	DWORD count = len, out = 0;
+	TraceEvent event;
 	
-	BOOL result = WriteFile((HANDLE)_dataFork, pBuf, count, &out, NULL);
+	event.name = _name;
+	event.start = _start;
+	event.duration = crnlib::timer::get_secs() - _start;
+	event.thread = CurrentThreadID();
+	event.face = _face;
+	event.level = _level;
+	event.bytes = _bytes;
 	
-	return out;
-#endif
+	crnlib::scoped_mutex lock(sTraceMutex);
+	
+	if(sTraceEvents.size() < TRACE_MAX_EVENTS)
+		sTraceEvents.push_back(event);
+	else
+		sTraceDropped++;
 }
 
 
-crnlib::uint64
-ps_data_stream::get_size()
+static void WriteTrace()
 {
-#ifdef __PIMac__
-	SInt64 fork_size = 0;
+	const char *path = TracePath();
 	
-	OSErr result = FSGetForkSize(_dataFork, &fork_size);
+	if(path == NULL)
+		return;
+	
+	crnlib::scoped_mutex lock(sTraceMutex);
+	
+	FILE *f = fopen(path, "w");
+	
+	if(f == NULL)
+		return;
+	
+	fprintf(f, "{\"traceEvents\":[\n");
+	
+	for(crnlib::uint i=0; i < sTraceEvents.size(); i++)
+	{
+		const TraceEvent &event = sTraceEvents[i];
 		
-	return fork_size;
-#else
-	return GetFileSize((HANDLE)_dataFork, NULL);
-#endif
+		fprintf(f, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.1f,\"dur\":%.1f,\"args\":{",
+					event.name, event.thread, event.start * 1000000.0, event.duration * 1000000.0);
+		
+		const char *sep = "";
+		
+		if(event.face >= 0)
+		{
+			fprintf(f, "\"face\":%d", event.face);
+			sep = ",";
+		}
+		
+		if(event.level >= 0)
+		{
+			fprintf(f, "%s\"level\":%d", sep, event.level);
+			sep = ",";
+		}
+		
+		if(event.bytes >= 0)
+			fprintf(f, "%s\"bytes\":%.0f", sep, (double)event.bytes);
+		
+		fprintf(f, "}}%s\n", (i + 1 < sTraceEvents.size() ? "," : ""));
+	}
+	
+	fprintf(f, "],\"otherData\":{\"dropped\":%u}}\n", sTraceDropped);
+	
+	fclose(f);
 }
 
 
-crnlib::uint64
-ps_data_stream::get_remaining()
+// Cooperative cancel
+//   crnlib only calls back during DXT packing, so everything else has to
+//   check in between units of work.  Host TestAbort() is only called every
+//   ABORT_POLL_INTERVAL seconds, so it's fine to call this in tight loops.
+//   The longest gap between two polls is the worst-case cancel latency.
+//   Only the calling thread may talk to the host, so crnlib's helper threads
+//   leave their progress in globals->progress and watch globals->abort_flag,
+//   and the calling thread passes both along whenever it polls.  Both are
+//   in Globals so concurrent calls don't see each other's.
+
+#define ABORT_POLL_INTERVAL		0.05
+
+static void StartAbortChecks(GPtr globals)
 {
-	if( is_writable() )
+	globals->abort_poll_time = crnlib::timer::get_secs();
+	globals->abort_max_latency = 0.0;
+	
+	crnlib::atomic_exchange32(&globals->abort_flag, 0);
+	crnlib::atomic_exchange32(&globals->progress, -1);
+}
+
+static bool CheckAbort(GPtr globals)
+{
+	if(gResult != noErr)
+		return true;
+	
+	// crnlib's helper threads can get here, but the host only wants to hear from its own
+	if(CurrentThreadID() != globals->call_thread)
+		return (globals->abort_flag != 0);
+	
+	const double now = crnlib::timer::get_secs();
+	const double elapsed = now - globals->abort_poll_time;
+	
+	if(elapsed >= ABORT_POLL_INTERVAL)
 	{
-		return crnlib::DATA_STREAM_SIZE_UNKNOWN;
+		if(elapsed > globals->abort_max_latency)
+			globals->abort_max_latency = elapsed;
+	
+		const long percent = crnlib::atomic_exchange32(&globals->progress, -1);
+		
+		if(percent >= 0)
+		{
+			TraceSpan span("UpdateProgress");
+			
+			PIUpdateProgress(percent, 100);
+		}
+	
+		TraceSpan span("TestAbort");
+	
+		gResult = TestAbort();
+		
+		if(gResult != noErr)
+			crnlib::atomic_exchange32(&globals->abort_flag, 1);
+		
+		globals->abort_poll_time = now;
 	}
-	else
-		return (get_size() - get_ofs());
+	
+	return (gResult != noErr);
 }
 
-
-crnlib::uint64
-ps_data_stream::get_ofs()
+static void FinishAbortChecks(GPtr globals)
 {
-#ifdef __PIMac__
-	SInt64 lpos;
-
-	OSErr result = FSGetForkPosition(_dataFork, &lpos);
+	const double elapsed = crnlib::timer::get_secs() - globals->abort_poll_time;
 	
-	return lpos;
-#else
-	LARGE_INTEGER lpos, zero;
+	if(elapsed > globals->abort_max_latency)
+		globals->abort_max_latency = elapsed;
+}
 
-	zero.QuadPart = 0;
 
-	BOOL result = SetFilePointerEx((HANDLE)_dataFork, zero, &lpos, FILE_CURRENT);
+// Memory accounting
+//   crnlib's allocator is pointed here, so this sees the image_u8 we fetch
+//   into, every mip level, the packed DXT data and our own crnlib::vectors.
+//   Sizes are what the system allocator actually handed out.
 
-	return lpos.QuadPart;
+typedef struct {
+	int64	current;
+	int64	stage_peak;		// since the last StartMemoryStage()
+	int64	session_peak;	// since the last StartMemorySession()
+	int64	allocations;	// running count
+	int64	pooled;			// held in the pool, not in use
+} MemoryCounters;
+
+static crnlib::mutex sMemoryMutex;
+static MemoryCounters sMemory = { 0, 0, 0, 0, 0 };
+
+
+static size_t AllocatedSize(void *p)
+{
+#ifdef __PIMac__
+	return malloc_size(p);
+#else
+	return _msize(p);
 #endif
 }
 
 
-bool
-ps_data_stream::seek(crnlib::int64 ofs, bool relative)
+static void CountMemory(int64 old_size, int64 new_size, bool new_block)
 {
-#ifdef __PIMac__
-	const UInt16 positionMode = (relative ? fsFromMark : fsFromStart);
+	crnlib::scoped_mutex lock(sMemoryMutex);
 	
-	OSErr result = FSSetForkPosition(_dataFork, positionMode, ofs);
-
-	return result;
-#else
-	LARGE_INTEGER lpos;
+	sMemory.current += new_size - old_size;
+	
+	if(new_block)
+		sMemory.allocations++;
+	
+	if(sMemory.current > sMemory.stage_peak)
+		sMemory.stage_peak = sMemory.current;
+	
+	if(sMemory.current > sMemory.session_peak)
+		sMemory.session_peak = sMemory.current;
+}
 
-	lpos.QuadPart = ofs;
 
-	const DWORD method = ( relative ? FILE_CURRENT : FILE_BEGIN );
+// Working memory pool
+//   Texture-sized blocks (the fetched image, mip levels, packed DXT data,
+//   resampler buffers) don't go back to the system when crnlib frees them.
+//   They stay here for the next level or the next save to reuse, so we
+//   don't keep paying for fresh pages and allocator churn.  Blocks are made
+//   only when crnlib asks for them, rounded up to a whole POOL_MIN_BLOCK,
+//   and free ones wait on a list for their size.  A pointer table finds
+//   a block from its address.  MemoryPoolSession trims the pool back when
+//   a read or save ends.  Call these with sMemoryMutex held.
+
+#define POOL_MIN_BLOCK		(256 * 1024)
+#define POOL_MAX_BLOCKS		256
+#define POOL_SIZE_LISTS		64
+#define POOL_INDEX_BITS		9		// twice POOL_MAX_BLOCKS slots, so probes stay short
+#define POOL_INDEX_SLOTS	(1 << POOL_INDEX_BITS)
+#define POOL_KEEP_BYTES		((size_t)64 * 1024 * 1024)
+
+// links are a block index + 1, 0 for none, so the tables start out empty
+typedef struct {
+	void	*ptr;
+	size_t	size;
+	int		next;		// next free block on its list, or next unused entry
+	bool	in_use;
+} PoolBlock;
 
-#if _MSC_VER < 1300
-	DWORD pos = SetFilePointer((HANDLE)_dataFork, lpos.u.LowPart, &lpos.u.HighPart, method);
+static PoolBlock sPool[POOL_MAX_BLOCKS];
+static int sPoolBlocks = 0;			// entries ever used
+static int sPoolUnused = 0;			// entries given back by PoolRemove()
+static int sPoolFree[POOL_SIZE_LISTS];
+static int sPoolIndex[POOL_INDEX_SLOTS];
 
-	BOOL result = (pos != 0xFFFFFFFF || NO_ERROR == GetLastError());
-#else
-	BOOL result = SetFilePointerEx((HANDLE)_dataFork, lpos, NULL, method);
-#endif
 
-	return result;
-#endif
+static inline int PoolSlot(const void *p)
+{
+	return (int)((((crnlib::uint64)(size_t)p >> 12) * 0x9E3779B97F4A7C15ULL) >> (64 - POOL_INDEX_BITS));
 }
 
-#pragma mark-
+static inline int PoolNextSlot(int s)
+{
+	return (s + 1) & (POOL_INDEX_SLOTS - 1);
+}
 
 
-static void DoFilterFile(GPtr globals)
+static int PoolFind(const void *p)
 {
-	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable);
+	for(int s = PoolSlot(p); sPoolIndex[s] != 0; s = PoolNextSlot(s))
+	{
+		if(sPool[sPoolIndex[s] - 1].ptr == p)
+			return sPoolIndex[s] - 1;
+	}
+	
+	return -1;
+}
 
-	crnlib::data_stream_serializer serializer(&ps_stream);
 
-	// copied from mipmapped_texture::read_dds_internal()
-	uint8 hdr[4];
-	if(!serializer.read(hdr, sizeof(hdr)))
-		gResult = formatCannotRead;
-	else if(memcmp(hdr, "DDS ", 4) != 0)
-		gResult = formatCannotRead;
+static void PoolIndexAdd(int i)
+{
+	int s = PoolSlot(sPool[i].ptr);
+	
+	while(sPoolIndex[s] != 0)
+		s = PoolNextSlot(s);
+	
+	sPoolIndex[s] = i + 1;
 }
 
 
-// Additional parameter functions
-//   These transfer settings to and from gStuff->revertInfo
-
-static void TwiddleOptions(DDS_inData *options)
+static void PoolIndexRemove(int i)
 {
-#ifndef __PIMacPPC__
-	// none
-#endif
+	int gap = PoolSlot(sPool[i].ptr);
+	
+	while(sPoolIndex[gap] != i + 1)
+		gap = PoolNextSlot(gap);
+	
+	// shift later entries back so their probes don't stop at the gap
+	for(int s = PoolNextSlot(gap); sPoolIndex[s] != 0; s = PoolNextSlot(s))
+	{
+		const int home = PoolSlot(sPool[sPoolIndex[s] - 1].ptr);
+		
+		if( ((s - home) & (POOL_INDEX_SLOTS - 1)) >= ((s - gap) & (POOL_INDEX_SLOTS - 1)) )
+		{
+			sPoolIndex[gap] = sPoolIndex[s];
+			gap = s;
+		}
+	}
+	
+	sPoolIndex[gap] = 0;
 }
 
-static void TwiddleOptions(DDS_outData *options)
+
+static inline int PoolList(size_t size)
 {
-#ifndef __PIMacPPC__
-	// none
-#endif
+	return (int)((size / POOL_MIN_BLOCK) % POOL_SIZE_LISTS);
 }
 
-template <typename T>
-static bool ReadParams(GPtr globals, T *options)
+
+// a free block of exactly this size off its list, or -1
+static int PoolPop(size_t size)
 {
-	bool found_revert = FALSE;
+	int *link = &sPoolFree[PoolList(size)];
 	
-	if( gStuff->revertInfo != NULL )
+	while(*link != 0)
 	{
-		if( myGetHandleSize(globals, gStuff->revertInfo) == sizeof(T) )
+		const int i = *link - 1;
+		
+		if(sPool[i].size == size)
 		{
-			T *flat_options = (T *)myLockHandle(globals, gStuff->revertInfo);
-			
-			// flatten and copy
-			TwiddleOptions(flat_options);
-			
-			memcpy((char*)options, (char*)flat_options, sizeof(T) );
+			*link = sPool[i].next;
 			
-			TwiddleOptions(flat_options);
-			
-			myUnlockHandle(globals, gStuff->revertInfo);
-			
-			found_revert = TRUE;
+			return i;
 		}
+		
+		link = &sPool[i].next;
 	}
 	
-	return found_revert;
+	return -1;
 }
 
-template <typename T>
-static void WriteParams(GPtr globals, T *options)
+
+// a new block, already in use
+static int PoolAdd(size_t size)
 {
-	T *flat_options = NULL;
+	int i = -1;
 	
-	if(gStuff->hostNewHdl != NULL) // we have the handle function
+	if(sPoolUnused != 0)
 	{
-		if(gStuff->revertInfo == NULL)
-		{
-			gStuff->revertInfo = myNewHandle(globals, sizeof(T) );
-		}
-		else
-		{
-			if(myGetHandleSize(globals, gStuff->revertInfo) != sizeof(T)  )
-				mySetHandleSize(globals, gStuff->revertInfo, sizeof(T) );
-		}
-		
-		flat_options = (T *)myLockHandle(globals, gStuff->revertInfo);
-		
-		// flatten and copy
-		TwiddleOptions(flat_options);
-		
-		memcpy((char*)flat_options, (char*)options, sizeof(T) );	
+		i = sPoolUnused - 1;
 		
-		TwiddleOptions(flat_options);
-			
+		sPoolUnused = sPool[i].next;
+	}
+	else if(sPoolBlocks < POOL_MAX_BLOCKS)
+		i = sPoolBlocks++;
+	else
+		return -1;
+	
+	void *p = malloc(size);
+	
+	if(p == NULL)
+	{
+		sPool[i].next = sPoolUnused;
+		sPoolUnused = i + 1;
 		
-		myUnlockHandle(globals, gStuff->revertInfo);
+		return -1;
 	}
+	
+	sPool[i].ptr = p;
+	sPool[i].size = size;
+	sPool[i].next = 0;
+	sPool[i].in_use = true;
+	
+	PoolIndexAdd(i);
+	
+	return i;
 }
 
 
-static void HandleError(GPtr globals, const crnlib::mipmapped_texture &dds_file)
+// free a block that's already off its list
+static void PoolRemove(int i)
 {
-	const crnlib::dynamic_string &err = dds_file.get_last_error();
-
-	const int size = crnlib::math::minimum<int>(255, err.get_len());
+	assert(!sPool[i].in_use);
+	
+	PoolIndexRemove(i);
+	
+	free(sPool[i].ptr);
+	
+	sMemory.pooled -= sPool[i].size;
+	
+	sPool[i].ptr = NULL;
+	sPool[i].next = sPoolUnused;
+	sPoolUnused = i + 1;
+}
 
-	Str255 p_str;
-	p_str[0] = size;
-	strncpy((char *)&p_str[1], err.c_str(), size);
 
-	PIReportError(p_str);
-	gResult = errReportString;
+// returns index of a block, now in use, or -1 if we're out of table space
+static int PoolTake(size_t size)
+{
+	const size_t block_size = (size + POOL_MIN_BLOCK - 1) / POOL_MIN_BLOCK * POOL_MIN_BLOCK;
+	
+	int i = PoolPop(block_size);
+	
+	if(i >= 0)
+	{
+		sPool[i].in_use = true;
+		
+		sMemory.pooled -= sPool[i].size;
+	}
+	else
+		i = PoolAdd(block_size);
+	
+	return i;
 }
 
 
-static void HandleError(GPtr globals, const char *errStr)
+static void PoolGive(int i)
 {
-	const int size = crnlib::math::minimum<int>(255, strlen(errStr));
+	assert(sPool[i].in_use);
+	
+	const int list = PoolList(sPool[i].size);
+	
+	sPool[i].in_use = false;
+	sPool[i].next = sPoolFree[list];
+	sPoolFree[list] = i + 1;
+	
+	sMemory.pooled += sPool[i].size;
+}
 
-	Str255 p_str;
-	p_str[0] = size;
-	strncpy((char *)&p_str[1], errStr, size);
 
-	PIReportError(p_str);
-	gResult = errReportString;
+static void PoolTrim(size_t keep_bytes)
+{
+	for(int list = 0; list < POOL_SIZE_LISTS && sMemory.pooled > (int64)keep_bytes; list++)
+	{
+		while(sPoolFree[list] != 0 && sMemory.pooled > (int64)keep_bytes)
+		{
+			const int i = sPoolFree[list] - 1;
+			
+			sPoolFree[list] = sPool[i].next;
+			
+			PoolRemove(i);
+		}
+	}
 }
 
 
-static void DoReadPrepare(GPtr globals)
+static int PoolFindLocked(const void *p)
 {
-	gStuff->maxData = 0;
+	crnlib::scoped_mutex lock(sMemoryMutex);
+	
+	return PoolFind(p);
 }
 
 
-static void DoReadStart(GPtr globals)
+static void * PoolAllocate(size_t size, size_t *actual_size)
 {
-	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable);
+	const int i = PoolTake(size);
+	
+	if(i >= 0)
+	{
+		*actual_size = sPool[i].size;
+		
+		return sPool[i].ptr;
+	}
+	else
+	{
+		void *p = malloc(size);
+		
+		*actual_size = (p ? AllocatedSize(p) : 0);
+		
+		return p;
+	}
+}
 
-	crnlib::data_stream_serializer serializer(&ps_stream);
 
-	crnlib::mipmapped_texture dds_file;
+// follows crnlib's own crnlib_default_realloc()
+static void * TrackedRealloc(void *p, size_t size, size_t *pActual_size, bool movable, void *pUser_data)
+{
+	void *p_new = NULL;
+	
+	const bool pooled = (p != NULL && PoolFindLocked(p) >= 0);
 
-	if( dds_file.read_dds(serializer) )
+	if(p == NULL)
 	{
-		gStuff->imageMode = plugInModeRGBColor;
-		gStuff->depth = 8;
-
-		if(dds_file.determine_texture_type() == crnlib::cTextureTypeCubemap)
+		size_t new_size = 0;
+		
+		if(size >= POOL_MIN_BLOCK)
+		{
+			crnlib::scoped_mutex lock(sMemoryMutex);
+		
+			p_new = PoolAllocate(size, &new_size);
+		}
+		else
+		{
+			p_new = malloc(size);
+			
+			new_size = (p_new ? AllocatedSize(p_new) : 0);
+		}
+		
+		if(p_new)
+			CountMemory(0, new_size, true);
+		
+		if(pActual_size)
+			*pActual_size = new_size;
+	}
+	else if(size == 0)
+	{
+		if(pooled)
 		{
-			gStuff->imageSize.h = gStuff->imageSize32.h = dds_file.get_width() * 3;
-			gStuff->imageSize.v = gStuff->imageSize32.v = dds_file.get_height() * 4;
+			crnlib::scoped_mutex lock(sMemoryMutex);
+			
+			// look again, indices move when the pool is trimmed
+			const int pool_block = PoolFind(p);
+			
+			sMemory.current -= sPool[pool_block].size;
+			
+			PoolGive(pool_block);
 		}
 		else
 		{
-			gStuff->imageSize.h = gStuff->imageSize32.h = dds_file.get_width();
-			gStuff->imageSize.v = gStuff->imageSize32.v = dds_file.get_height();
+			CountMemory(AllocatedSize(p), 0, false);
+		
+			free(p);
 		}
 		
-		gStuff->planes = (dds_file.has_alpha() ? 4 : 3);
+		if(pActual_size)
+			*pActual_size = 0;
+	}
+	else if(pooled)
+	{
+		crnlib::scoped_mutex lock(sMemoryMutex);
 		
+		const int pool_block = PoolFind(p);
 		
-		bool reverting = ReadParams(globals, &gInOptions);
+		const size_t old_size = sPool[pool_block].size;
 		
-		if(!reverting && gStuff->hostSig != 'FXTC')
+		if(size <= old_size)
 		{
-			DDS_InUI_Data params;
+			p_new = p; // fits where it is
 			
-		#ifdef __PIMac__
-			const char * const plugHndl = "com.fnordware.Photoshop.DDS";
-			const void *hwnd = globals;
-		#else
-			const HINSTANCE const plugHndl = GetDLLInstance((SPPluginRef)gStuff->plugInRef);
-			HWND hwnd = (HWND)((PlatformData *)gStuff->platformData)->hwnd;
-		#endif
+			if(pActual_size)
+				*pActual_size = old_size;
+		}
+		else if(movable)
+		{
+			size_t new_size = 0;
 			
-			// DDS_InUI is responsible for not popping a dialog if the user
-			// didn't request it.  It still has to set the read settings from preferences though.
-			bool result = DDS_InUI(&params, dds_file.has_alpha(), plugHndl, hwnd);
+			p_new = PoolAllocate(size, &new_size);
 			
-			if(result)
+			if(p_new)
 			{
-				gInOptions.alpha = params.alpha;
+				memcpy(p_new, p, old_size);
 				
-				WriteParams(globals, &gInOptions);
+				PoolGive(pool_block);
+				
+				sMemory.current += (int64)new_size - (int64)old_size;
+				sMemory.allocations++;
+				
+				if(sMemory.current > sMemory.stage_peak)
+					sMemory.stage_peak = sMemory.current;
+				
+				if(sMemory.current > sMemory.session_peak)
+					sMemory.session_peak = sMemory.current;
 			}
-			else
-				gResult = userCanceledErr;
-		}
-		
-		if(gInOptions.alpha == DDS_ALPHA_TRANSPARENCY && gStuff->planes == 4)
-		{
-			gStuff->transparencyPlane = gStuff->planes - 1;
-			gStuff->transparencyMatting = 0;
+			
+			if(pActual_size)
+				*pActual_size = (p_new ? new_size : old_size);
 		}
-
-		assert(dds_file.get_num_faces() == 1);
+		else if(pActual_size)
+			*pActual_size = old_size;
 	}
 	else
-		HandleError(globals, dds_file);
-}
-
-
-static void DoReadContinue(GPtr globals)
-{
-	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable);
-
-	crnlib::data_stream_serializer serializer(&ps_stream);
-
-	crnlib::mipmapped_texture dds_file;
-
-	if( dds_file.read_dds(serializer) )
 	{
-		if(dds_file.determine_texture_type() == crnlib::cTextureTypeCubemap)
+		const size_t old_size = AllocatedSize(p);
+		
+		void *p_final_block = p;
+		
+	#ifndef __PIMac__
+		p_new = _expand(p, size);
+	#endif
+	
+		if(p_new)
+			p_final_block = p_new;
+		else if(movable)
 		{
-			const bool converted = dds_file.cubemap_to_vertical_cross();
+			p_new = realloc(p, size);
 			
-			assert(converted);
+			if(p_new)
+				p_final_block = p_new;
 		}
 		
-		crnlib::image_u8 img(dds_file.get_width(), dds_file.get_height());
-
-		crnlib::image_u8 *img_ptr = dds_file.get_level_image(0, 0, img);
-
-		gStuff->planeBytes = 1;
-		gStuff->colBytes = gStuff->planeBytes * 4;
-		gStuff->rowBytes = gStuff->colBytes * img_ptr->get_pitch();
-		
-		gStuff->loPlane = 0;
-		gStuff->hiPlane = gStuff->planes - 1;
-				
-		gStuff->theRect.left = gStuff->theRect32.left = 0;
-		gStuff->theRect.right = gStuff->theRect32.right = gStuff->imageSize.h;
-		assert(gStuff->imageSize.h == img_ptr->get_width());
+		const size_t new_size = AllocatedSize(p_final_block);
 		
-		gStuff->theRect.top = gStuff->theRect32.top = 0;
-		gStuff->theRect.bottom = gStuff->theRect32.bottom = gStuff->imageSize.v;
-		assert(gStuff->imageSize.v == img_ptr->get_height());
-
-		gStuff->data = img_ptr->get_pixels();
+		if(new_size != old_size)
+			CountMemory(old_size, new_size, false);
 		
-		gResult = AdvanceState();
+		if(pActual_size)
+			*pActual_size = new_size;
 	}
-	else
-		HandleError(globals, dds_file);
 	
-	// very important!
-	gStuff->data = NULL;
-}
-
-
-static void DoReadFinish(GPtr globals)
-{
-
+	return p_new;
 }
 
-#pragma mark-
 
-static void DoOptionsPrepare(GPtr globals)
+static size_t TrackedMSize(void *p, void *pUser_data)
 {
-	gStuff->maxData = 0;
+	if(p == NULL)
+		return 0;
+	
+	crnlib::scoped_mutex lock(sMemoryMutex);
+	
+	const int pool_block = PoolFind(p);
+	
+	return (pool_block >= 0 ? sPool[pool_block].size : AllocatedSize(p));
 }
 
 
-static void DoOptionsStart(GPtr globals)
+static void InstallMemoryTracking()
 {
-	ReadParams(globals, &gOptions);
+	static bool installed = false;
 	
-	if( ReadScriptParamsOnWrite(globals) )
+	if(!installed)
 	{
-		bool have_transparency = false;
-		const char *alpha_name = NULL;
+		crn_set_memory_callbacks(TrackedRealloc, TrackedMSize, NULL);
 		
-		if(gStuff->hostSig == '8BIM')
-			have_transparency = (gStuff->documentInfo && gStuff->documentInfo->mergedTransparency);
-		else
-			have_transparency = (gStuff->planes == 2 || gStuff->planes == 4);
+		installed = true;
+	}
+}
 
-			
-		if(gStuff->documentInfo && gStuff->documentInfo->alphaChannels)
-			alpha_name = gStuff->documentInfo->alphaChannels->name;
+
+static MemoryCounters StartMemoryStage()
+{
+	crnlib::scoped_mutex lock(sMemoryMutex);
 	
+	sMemory.stage_peak = sMemory.current;
 	
-		DDS_OutUI_Data params;
-		
-		params.format			= (gOptions.format == DDS_FMT_DXT1 ? DIALOG_FMT_DXT1 :
-									gOptions.format == DDS_FMT_DXT1A ? DIALOG_FMT_DXT1A :
-									gOptions.format == DDS_FMT_DXT2 ? DIALOG_FMT_DXT2 :
-									gOptions.format == DDS_FMT_DXT3 ? DIALOG_FMT_DXT3 :
-									gOptions.format == DDS_FMT_DXT4 ? DIALOG_FMT_DXT4 :
-									gOptions.format == DDS_FMT_DXT5 ? DIALOG_FMT_DXT5 :
-									gOptions.format == DDS_FMT_DXT5A ? DIALOG_FMT_DXT5A :
-									gOptions.format == DDS_FMT_3DC ? DIALOG_FMT_3DC :
-									gOptions.format == DDS_FMT_DXN ? DIALOG_FMT_DXN :
-									gOptions.format == DDS_FMT_UNCOMPRESSED ? DIALOG_FMT_UNCOMPRESSED :
-									DIALOG_FMT_DXT5);
-
-		params.alpha			= (DialogAlpha)gOptions.alpha;
-		params.premultiply		= gOptions.premultiply;
+	return sMemory;
+}
 
-		params.mipmap			= gOptions.mipmap;
 
-		params.filter			= (gOptions.filter == DDS_FILTER_BOX ? DIALOG_FILTER_BOX :
-									gOptions.filter == DDS_FILTER_TENT ? DIALOG_FILTER_TENT :
-									gOptions.filter == DDS_FILTER_LANCZOS4 ? DIALOG_FILTER_LANCZOS4 :
-									gOptions.filter == DDS_FILTER_MITCHELL ? DIALOG_FILTER_MITCHELL :
-									gOptions.filter == DDS_FILTER_KAISER ? DIALOG_FILTER_KAISER :
-									DIALOG_FILTER_MITCHELL);
-								
-		params.cubemap			= gOptions.cubemap;
+static MemoryCounters StartMemorySession()
+{
+	crnlib::scoped_mutex lock(sMemoryMutex);
 	
-	#ifdef __PIMac__
-		const char * const plugHndl = "com.fnordware.Photoshop.DDS";
-		const void *hwnd = globals;	
-	#else
-		const HINSTANCE const plugHndl = GetDLLInstance((SPPluginRef)gStuff->plugInRef);
-		HWND hwnd = (HWND)((PlatformData *)gStuff->platformData)->hwnd;
-	#endif
+	sMemory.session_peak = sMemory.current;
+	
+	return sMemory;
+}
 
-		const bool ae_ui = (gStuff->hostSig == 'FXTC');
 
+static MemoryCounters GetMemoryCounters()
+{
+	crnlib::scoped_mutex lock(sMemoryMutex);
+	
+	return sMemory;
+}
 
-		bool result = DDS_OutUI(&params, have_transparency, alpha_name, ae_ui, plugHndl, hwnd);
-		
-		
-		if(result)
-		{
-			gOptions.format			= (params.format == DIALOG_FMT_DXT1 ? DDS_FMT_DXT1 :
-										params.format == DIALOG_FMT_DXT1A ? DDS_FMT_DXT1A :
-										params.format == DIALOG_FMT_DXT2 ? DDS_FMT_DXT2 :
-										params.format == DIALOG_FMT_DXT3 ? DDS_FMT_DXT3 :
-										params.format == DIALOG_FMT_DXT4 ? DDS_FMT_DXT4 :
-										params.format == DIALOG_FMT_DXT5 ? DDS_FMT_DXT5 :
-										params.format == DIALOG_FMT_DXT5A ? DDS_FMT_DXT5A :
-										params.format == DIALOG_FMT_3DC ? DDS_FMT_3DC :
-										params.format == DIALOG_FMT_DXN ? DDS_FMT_DXN :
-										params.format == DIALOG_FMT_UNCOMPRESSED ? DDS_FMT_UNCOMPRESSED :
-										DDS_FMT_DXT5);
 
-			gOptions.alpha			= params.alpha;
-			gOptions.premultiply	= params.premultiply;
+// After Effects keeps some blocks for the next frame, a one-off read or save
+// gives them all back
+class MemoryPoolSession
+{
+public:
+	MemoryPoolSession(bool keep_some) : _keep_bytes(keep_some ? POOL_KEEP_BYTES : 0) {}
+	~MemoryPoolSession();
 
-			gOptions.mipmap			= params.mipmap;
+private:
+	size_t _keep_bytes;
+};
 
-			gOptions.filter			= (params.filter == DIALOG_FILTER_BOX ? DDS_FILTER_BOX :
-										params.filter == DIALOG_FILTER_TENT ? DDS_FILTER_TENT :
-										params.filter == DIALOG_FILTER_LANCZOS4 ? DDS_FILTER_LANCZOS4 :
-										params.filter == DIALOG_FILTER_MITCHELL ? DDS_FILTER_MITCHELL :
-										params.filter == DIALOG_FILTER_KAISER ? DDS_FILTER_KAISER :
-										DDS_FILTER_MITCHELL);
-										
-			gOptions.cubemap		= params.cubemap;
-			
 
-			WriteParams(globals, &gOptions);
-			WriteScriptParamsOnWrite(globals);
-		}
-		else
-			gResult = userCanceledErr;
-	}
+MemoryPoolSession::~MemoryPoolSession()
+{
+	crnlib::scoped_mutex lock(sMemoryMutex);
+	
+	PoolTrim(_keep_bytes);
 }
 
 
-static void DoOptionsContinue(GPtr globals)
-{
+// Stage statistics
+//   Each stage adds its wall time, process CPU time and byte counts to
+//   globals->stats.  They go out in the scripting descriptor after a save
+//   and, if DDS_STATS_LOG names a file, get appended there too.
 
+static double GetCPUTime()
+{
+#ifdef __PIMac__
+	struct rusage usage;
+	
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0.0;
+	
+	return	(double)usage.ru_utime.tv_sec + ((double)usage.ru_utime.tv_usec / 1000000.0) +
+			(double)usage.ru_stime.tv_sec + ((double)usage.ru_stime.tv_usec / 1000000.0);
+#else
+	FILETIME creation_time, exit_time, kernel_time, user_time;
+	
+	if( !GetProcessTimes(GetCurrentProcess(), &creation_time, &exit_time, &kernel_time, &user_time) )
+		return 0.0;
+	
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = kernel_time.dwLowDateTime;
+	kernel.HighPart = kernel_time.dwHighDateTime;
+	user.LowPart = user_time.dwLowDateTime;
+	user.HighPart = user_time.dwHighDateTime;
+	
+	return (double)(kernel.QuadPart + user.QuadPart) / 10000000.0; // 100 ns units
+#endif
 }
 
 
-static void DoOptionsFinish(GPtr globals)
+static void StartStats(GPtr globals, DDS_Session session)
 {
+	memset(globals->stats, 0, sizeof(globals->stats));
 
+	globals->stats_session = session;
+	
+	globals->memory_peak = StartMemorySession().session_peak;
+}
+
+
+class StageTimer
+{
+public:
+	// without track_memory, the memory counters are left to a stage running alongside
+	StageTimer(GPtr globals, DDS_Stage stage, bool track_memory = true);
+	~StageTimer();
+	
+	void count(int64 bytes_in, int64 bytes_out, int64 pixels);
+
+private:
+	TraceSpan _span;
+	DDS_StageStats &_stats;
+	const double _wall_start;
+	const double _cpu_start;
+	const bool _track_memory;
+	const MemoryCounters _memory_start;
+};
+
+
+static const char * StageName(DDS_Stage stage);
+
+
+StageTimer::StageTimer(GPtr globals, DDS_Stage stage, bool track_memory) :
+	_span(StageName(stage)),
+	_stats(globals->stats[stage]),
+	_wall_start(crnlib::timer::get_secs()),
+	_cpu_start(GetCPUTime()),
+	_track_memory(track_memory),
+	_memory_start(track_memory ? StartMemoryStage() : GetMemoryCounters())
+{
+
+}
+
+
+StageTimer::~StageTimer()
+{
+	_stats.wall_time += crnlib::timer::get_secs() - _wall_start;
+	_stats.cpu_time += GetCPUTime() - _cpu_start;
+	
+	if(!_track_memory)
+		return;
+	
+	const MemoryCounters memory = GetMemoryCounters();
+	
+	if(memory.stage_peak > _stats.memory_peak)
+		_stats.memory_peak = memory.stage_peak;
+	
+	_stats.memory_change += memory.current - _memory_start.current;
+	_stats.allocations += memory.allocations - _memory_start.allocations;
+}
+
+
+void
+StageTimer::count(int64 bytes_in, int64 bytes_out, int64 pixels)
+{
+	_stats.bytes_in += bytes_in;
+	_stats.bytes_out += bytes_out;
+	_stats.pixels += pixels;
+}
+
+
+static const char *
+StageName(DDS_Stage stage)
+{
+	return (stage == DDS_STAGE_FETCH ? "fetch" :
+			stage == DDS_STAGE_ALPHA ? "alpha" :
+			stage == DDS_STAGE_PREMULTIPLY ? "premultiply" :
+			stage == DDS_STAGE_CUBEMAP ? "cubemap" :
+			stage == DDS_STAGE_MIPMAP ? "mipmap" :
+			stage == DDS_STAGE_PACK ? "pack" :
+			stage == DDS_STAGE_WRITE ? "write" :
+			stage == DDS_STAGE_READ ? "read" :
+			stage == DDS_STAGE_DECODE ? "decode" :
+			stage == DDS_STAGE_HANDOFF ? "handoff" :
+			"unknown");
+}
+
+
+static void LogStats(GPtr globals);
+
+static void FinishStats(GPtr globals)
+{
+	globals->memory_peak = GetMemoryCounters().session_peak;
+	
+	LogStats(globals);
+}
+
+
+static void LogStats(GPtr globals)
+{
+	const char *log_path = getenv("DDS_STATS_LOG");
+	
+	if(log_path == NULL || *log_path == '\0')
+		return;
+	
+	FILE *f = fopen(log_path, "a");
+	
+	if(f == NULL)
+		return;
+	
+	const char *session = (globals->stats_session == DDS_SESSION_WRITE ? "write" : "read");
+	
+	const int width = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.h : gStuff->imageSize.h);
+	const int height = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.v : gStuff->imageSize.v);
+	
+	fprintf(f, "%s %dx%d result=%d cancel_latency=%.4f memory_peak=%.0f memory_pooled=%.0f\n", session, width, height, (int)gResult,
+				globals->abort_max_latency, (double)globals->memory_peak, (double)GetMemoryCounters().pooled);
+	
+	for(int i=0; i < DDS_NUM_STAGES; i++)
+	{
+		const DDS_StageStats &stats = globals->stats[i];
+		
+		if(stats.wall_time > 0.0 || stats.pixels > 0)
+		{
+			const double mpps = (stats.wall_time > 0.0 ? (double)stats.pixels / stats.wall_time / 1000000.0 : 0.0);
+		
+			fprintf(f, "%s %s wall=%.4f cpu=%.4f in=%.0f out=%.0f mpps=%.2f memory_peak=%.0f memory_change=%.0f allocations=%.0f\n",
+						session, StageName(i), stats.wall_time, stats.cpu_time, (double)stats.bytes_in, (double)stats.bytes_out, mpps,
+						(double)stats.memory_peak, (double)stats.memory_change, (double)stats.allocations);
+		}
+	}
+	
+	fclose(f);
+}
+
+
+// size of all faces and levels, in memory, packed or not
+static int64 TextureBytes(const crnlib::mipmapped_texture &dds_file)
+{
+	int64 bytes = 0;
+
+	for(crnlib::uint f = 0; f < dds_file.get_num_faces(); f++)
+	{
+		for(crnlib::uint l = 0; l < dds_file.get_num_levels(); l++)
+		{
+			const crnlib::mip_level *level = dds_file.get_level(f, l);
+			
+			if(level->is_packed())
+				bytes += level->get_dxt_image()->get_size_in_bytes();
+			else
+				bytes += (int64)level->get_total_pixels() * sizeof(crnlib::color_quad_u8);
+		}
+	}
+	
+	return bytes;
+}
+
+
+static int64 TexturePixels(const crnlib::mipmapped_texture &dds_file)
+{
+	int64 pixels = 0;
+
+	for(crnlib::uint l = 0; l < dds_file.get_num_levels(); l++)
+		pixels += dds_file.get_level(0, l)->get_total_pixels();
+	
+	return pixels * dds_file.get_num_faces();
+}
+
+
+class ps_data_stream : public crnlib::data_stream
+{
+public:
+	ps_data_stream(intptr_t dataFork, attribs_t attribs, GPtr globals = NULL);
+	virtual ~ps_data_stream() {};
+
+	virtual crnlib::uint read(void* pBuf, crnlib::uint len);
+	virtual crnlib::uint write(const void* pBuf, crnlib::uint len);
+	virtual bool flush() { return true; };
+	virtual crnlib::uint64 get_size();
+	virtual crnlib::uint64 get_remaining();
+	virtual crnlib::uint64 get_ofs();
+	virtual bool seek(crnlib::int64 ofs, bool relative);
+	
+	bool set_size(crnlib::uint64 size); // grow or truncate the file, position stays put
+	
+	bool write_at(crnlib::uint64 offset, const void* pBuf, crnlib::uint len); // safe from several threads at once
+	
+	void set_cancel(const crnlib::atomic32_t *cancel) { _cancel = cancel; } // reads fail once it's non-zero
+
+private:
+	intptr_t _dataFork;
+	GPtr _globals; // if not NULL, reads and writes fail after a cancel
+	const crnlib::atomic32_t *_cancel;
+};
+
+
+ps_data_stream::ps_data_stream(intptr_t dataFork, attribs_t attribs, GPtr globals) :
+	crnlib::data_stream("Photoshop stream", attribs),
+	_dataFork(dataFork),
+	_globals(globals),
+	_cancel(NULL)
+{
+	if( is_writable() )
+	{
+		assert( get_ofs() == 0 );
+	}
+	else
+		seek(0, false);
+}
+
+
+crnlib::uint
+ps_data_stream::read(void* pBuf, crnlib::uint len)
+{
+	if(_globals != NULL && CheckAbort(_globals))
+		return 0;
+	
+	if(_cancel != NULL && *_cancel != 0)
+		return 0;
+	
+	TraceSpan span("FSRead");
+	span.set_bytes(len);
+
+#ifdef __PIMac__
+	ByteCount count = len;
+	
+	OSErr result = FSReadFork(_dataFork, fsAtMark, 0, count, pBuf, &count);
+	
+	return count;
+#else
+	DWORD count = len, bytes_read = 0;
+	
+	BOOL result = ReadFile((HANDLE)_dataFork, pBuf, count, &bytes_read, NULL);
+
+	return bytes_read;
+#endif
+}
+
+
+crnlib::uint
+ps_data_stream::write(const void* pBuf, crnlib::uint len)
+{
+	if(_globals != NULL && CheckAbort(_globals))
+		return 0;
+	
+	TraceSpan span("FSWrite");
+	span.set_bytes(len);
+
+#ifdef __PIMac__
+	ByteCount count = len;
+
+	OSErr result = FSWriteFork(_dataFork, fsAtMark, 0, count, (const void *)pBuf, &count);
+	
+	return count;
+#else
+	DWORD count = len, out = 0;
+	
+	BOOL result = WriteFile((HANDLE)_dataFork, pBuf, count, &out, NULL);
+	
+	return out;
+#endif
+}
+
+
+crnlib::uint64
+ps_data_stream::get_size()
+{
+#ifdef __PIMac__
+	SInt64 fork_size = 0;
+	
+	OSErr result = FSGetForkSize(_dataFork, &fork_size);
+		
+	return fork_size;
+#else
+	return GetFileSize((HANDLE)_dataFork, NULL);
+#endif
+}
+
+
+crnlib::uint64
+ps_data_stream::get_remaining()
+{
+	if( is_writable() )
+	{
+		return crnlib::DATA_STREAM_SIZE_UNKNOWN;
+	}
+	else
+		return (get_size() - get_ofs());
+}
+
+
+crnlib::uint64
+ps_data_stream::get_ofs()
+{
+#ifdef __PIMac__
+	SInt64 lpos;
+
+	OSErr result = FSGetForkPosition(_dataFork, &lpos);
+	
+	return lpos;
+#else
+	LARGE_INTEGER lpos, zero;
+
+	zero.QuadPart = 0;
+
+	BOOL result = SetFilePointerEx((HANDLE)_dataFork, zero, &lpos, FILE_CURRENT);
+
+	return lpos.QuadPart;
+#endif
+}
+
+
+bool
+ps_data_stream::seek(crnlib::int64 ofs, bool relative)
+{
+#ifdef __PIMac__
+	const UInt16 positionMode = (relative ? fsFromMark : fsFromStart);
+	
+	OSErr result = FSSetForkPosition(_dataFork, positionMode, ofs);
+
+	return (result == noErr);
+#else
+	LARGE_INTEGER lpos;
+
+	lpos.QuadPart = ofs;
+
+	const DWORD method = ( relative ? FILE_CURRENT : FILE_BEGIN );
+
+#if _MSC_VER < 1300
+	DWORD pos = SetFilePointer((HANDLE)_dataFork, lpos.u.LowPart, &lpos.u.HighPart, method);
+
+	BOOL result = (pos != 0xFFFFFFFF || NO_ERROR == GetLastError());
+#else
+	BOOL result = SetFilePointerEx((HANDLE)_dataFork, lpos, NULL, method);
+#endif
+
+	return result;
+#endif
+}
+
+
+bool
+ps_data_stream::write_at(crnlib::uint64 offset, const void* pBuf, crnlib::uint len)
+{
+	TraceSpan span("FSWriteAt");
+	span.set_bytes(len);
+
+#ifdef __PIMac__
+	ByteCount count = 0;
+
+	OSErr result = FSWriteFork(_dataFork, fsFromStart, offset, len, pBuf, &count);
+	
+	return (result == noErr && count == len);
+#else
+	// a synchronous handle still takes its position from the OVERLAPPED
+	OVERLAPPED overlapped;
+	
+	memset(&overlapped, 0, sizeof(overlapped));
+	
+	overlapped.Offset = (DWORD)(offset & 0xffffffff);
+	overlapped.OffsetHigh = (DWORD)(offset >> 32);
+	
+	DWORD out = 0;
+	
+	BOOL result = WriteFile((HANDLE)_dataFork, pBuf, len, &out, &overlapped);
+	
+	return (result && out == len);
+#endif
+}
+
+
+bool
+ps_data_stream::set_size(crnlib::uint64 size)
+{
+#ifdef __PIMac__
+	OSErr result = FSSetForkSize(_dataFork, fsFromStart, size);
+	
+	return (result == noErr);
+#else
+	const crnlib::uint64 pos = get_ofs();
+	
+	LARGE_INTEGER lsize;
+	
+	lsize.QuadPart = size;
+	
+	BOOL result = SetFilePointerEx((HANDLE)_dataFork, lsize, NULL, FILE_BEGIN) && SetEndOfFile((HANDLE)_dataFork);
+	
+	seek(pos, false);
+	
+	return result;
+#endif
+}
+
+
+// Gathers small writes, like the one per header field write_dds() makes,
+// into big ones for the stream underneath.
+
+#define BUFFERED_STREAM_SIZE	(4 * 1024 * 1024)
+
+class buffered_stream : public crnlib::data_stream
+{
+public:
+	buffered_stream(crnlib::data_stream &stream);
+	virtual ~buffered_stream() { flush(); };
+
+	virtual crnlib::uint read(void* pBuf, crnlib::uint len) { return 0; }
+	virtual crnlib::uint write(const void* pBuf, crnlib::uint len);
+	virtual bool flush();
+	virtual crnlib::uint64 get_size() { return crnlib::math::maximum(_stream.get_size(), get_ofs()); }
+	virtual crnlib::uint64 get_remaining() { return crnlib::DATA_STREAM_SIZE_UNKNOWN; }
+	virtual crnlib::uint64 get_ofs() { return _ofs + _buffer.size(); }
+	virtual bool seek(crnlib::int64 ofs, bool relative);
+
+private:
+	crnlib::data_stream &_stream;
+	crnlib::vector<crnlib::uint8> _buffer;
+	crnlib::uint64 _ofs; // of the start of _buffer
+	bool _ok;
+};
+
+
+buffered_stream::buffered_stream(crnlib::data_stream &stream) :
+	crnlib::data_stream("Buffered stream", crnlib::cDataStreamWritable | crnlib::cDataStreamSeekable),
+	_stream(stream),
+	_ofs(stream.get_ofs()),
+	_ok(true)
+{
+	_buffer.reserve(BUFFERED_STREAM_SIZE);
+}
+
+
+crnlib::uint
+buffered_stream::write(const void* pBuf, crnlib::uint len)
+{
+	if(_buffer.size() + len > BUFFERED_STREAM_SIZE && !flush())
+		return 0;
+	
+	if(len >= BUFFERED_STREAM_SIZE)
+	{
+		const crnlib::uint wrote = _stream.write(pBuf, len);
+		
+		_ofs += wrote;
+		
+		_ok = (wrote == len);
+		
+		return wrote;
+	}
+	
+	const crnlib::uint size = _buffer.size();
+	
+	_buffer.resize(size + len);
+	
+	memcpy(&_buffer[size], pBuf, len);
+	
+	return len;
+}
+
+
+bool
+buffered_stream::flush()
+{
+	if(_ok && !_buffer.empty())
+	{
+		_ok = (_stream.write(_buffer.get_ptr(), _buffer.size()) == _buffer.size());
+		
+		_ofs += _buffer.size();
+		
+		_buffer.resize(0);
+	}
+	
+	return _ok;
+}
+
+
+bool
+buffered_stream::seek(crnlib::int64 ofs, bool relative)
+{
+	const crnlib::uint64 target = (relative ? get_ofs() + ofs : ofs);
+	
+	if( !flush() || !_stream.seek(target, false) )
+		return false;
+	
+	_ofs = target;
+	
+	return true;
+}
+
+
+// DDS header
+//   Just enough of the header to find any one level of a plain DXTn file
+//   and read only that, for scaled reads, or of an uncompressed file in one
+//   of the common layouts.  Anything else (swizzled, cube maps, odd
+//   layouts) goes through read_dds().
+
+#define DDS_HEADER_SIZE		128		// "DDS " + DDSURFACEDESC2
+
+// uncompressed layouts we unpack ourselves
+enum {
+	DDS_LAYOUT_NONE = 0,
+	DDS_LAYOUT_R5G6B5,
+	DDS_LAYOUT_A1R5G5B5,
+	DDS_LAYOUT_A4R4G4B4,
+	DDS_LAYOUT_R8G8B8,
+	DDS_LAYOUT_L8,
+	DDS_LAYOUT_A8L8,
+	DDS_LAYOUT_A8
+};
+
+#define DDS_FOURCC(A, B, C, D)	((crnlib::uint32)(A) | ((crnlib::uint32)(B) << 8) | \
+									((crnlib::uint32)(C) << 16) | ((crnlib::uint32)(D) << 24))
+
+typedef struct {
+	crnlib::uint			width;
+	crnlib::uint			height;
+	crnlib::uint			levels;
+	bool					cubemap;
+	crnlib::pixel_format	format;		// PIXEL_FMT_INVALID if we can't read it directly
+	crnlib::uint			block_bytes;
+	int						layout;		// DDS_LAYOUT_NONE unless it's one we unpack
+	crnlib::uint			pixel_bytes;
+	crnlib::uint			pitch;		// bytes from one row of level 0 to the next
+	crnlib::uint			row_align;	// 4 if the rows of every level are padded to a DWORD, or 1
+} DDSHeader;
+
+
+static crnlib::uint32 ReadLE32(const crnlib::uint8 *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((crnlib::uint32)p[3] << 24);
+}
+
+
+static void WriteLE32(crnlib::uint8 *p, crnlib::uint32 v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+
+static crnlib::uint LevelDimension(crnlib::uint size, crnlib::uint level)
+{
+	return crnlib::math::maximum<crnlib::uint>(1, size >> level);
+}
+
+
+static bool ReadDDSHeader(crnlib::data_stream &stream, DDSHeader &header)
+{
+	using namespace crnlib;
+	
+	uint8 buf[DDS_HEADER_SIZE];
+	
+	stream.seek(0, false);
+	
+	if(stream.read(buf, sizeof(buf)) != sizeof(buf) || memcmp(buf, "DDS ", 4) != 0 || ReadLE32(buf + 4) != 124)
+		return false;
+	
+	const uint8 *desc = buf + 4;
+	
+	const uint32 flags = ReadLE32(desc + 4);
+	
+	header.height = ReadLE32(desc + 8);
+	header.width = ReadLE32(desc + 12);
+	header.levels = ((flags & 0x20000) ? math::maximum<uint32>(1, ReadLE32(desc + 24)) : 1); // DDSD_MIPMAPCOUNT
+	header.cubemap = ((ReadLE32(desc + 108) & 0x200) != 0); // DDSCAPS2_CUBEMAP
+	
+	if(header.width == 0 || header.height == 0)
+		return false;
+	
+	uint max_levels = 1;
+	
+	while( (header.width >> max_levels) > 0 || (header.height >> max_levels) > 0 )
+		max_levels++;
+	
+	header.levels = math::minimum(header.levels, max_levels);
+	
+	const uint32 pixel_flags = ReadLE32(desc + 76);
+	const uint32 fourcc = ReadLE32(desc + 80);
+	const uint32 bit_count = ReadLE32(desc + 84); // crnlib keeps its swizzle codes here
+	
+	header.format = PIXEL_FMT_INVALID;
+	
+	if((pixel_flags & 0x4) && bit_count == 0) // DDPF_FOURCC
+	{
+		header.format = (fourcc == DDS_FOURCC('D','X','T','1') ? PIXEL_FMT_DXT1 :
+						fourcc == DDS_FOURCC('D','X','T','2') ? PIXEL_FMT_DXT2 :
+						fourcc == DDS_FOURCC('D','X','T','3') ? PIXEL_FMT_DXT3 :
+						fourcc == DDS_FOURCC('D','X','T','4') ? PIXEL_FMT_DXT4 :
+						fourcc == DDS_FOURCC('D','X','T','5') ? PIXEL_FMT_DXT5 :
+						PIXEL_FMT_INVALID);
+	}
+	
+	header.block_bytes = (header.format == PIXEL_FMT_DXT1 ? 8 : 16);
+	
+	const uint32 red_mask = ReadLE32(desc + 88);
+	const uint32 green_mask = ReadLE32(desc + 92);
+	const uint32 blue_mask = ReadLE32(desc + 96);
+	const uint32 alpha_mask = ((pixel_flags & 0x1) ? ReadLE32(desc + 100) : 0); // DDPF_ALPHAPIXELS
+	
+	const bool rgb = ((pixel_flags & 0x40) != 0); // DDPF_RGB
+	const bool luminance = ((pixel_flags & 0x20000) != 0); // DDPF_LUMINANCE
+	const bool alpha_only = ((pixel_flags & 0x2) != 0); // DDPF_ALPHA
+	
+	#define DDS_MASKS(R, G, B, A)	(red_mask == (R) && green_mask == (G) && blue_mask == (B) && alpha_mask == (A))
+	
+	header.layout = (header.format != PIXEL_FMT_INVALID ? DDS_LAYOUT_NONE :
+					rgb && bit_count == 16 && DDS_MASKS(0xF800, 0x07E0, 0x001F, 0) ? DDS_LAYOUT_R5G6B5 :
+					rgb && bit_count == 16 && DDS_MASKS(0x7C00, 0x03E0, 0x001F, 0x8000) ? DDS_LAYOUT_A1R5G5B5 :
+					rgb && bit_count == 16 && DDS_MASKS(0x0F00, 0x00F0, 0x000F, 0xF000) ? DDS_LAYOUT_A4R4G4B4 :
+					rgb && bit_count == 24 && DDS_MASKS(0xFF0000, 0xFF00, 0xFF, 0) ? DDS_LAYOUT_R8G8B8 :
+					luminance && bit_count == 8 && DDS_MASKS(0xFF, 0, 0, 0) ? DDS_LAYOUT_L8 :
+					luminance && bit_count == 16 && DDS_MASKS(0xFF, 0, 0, 0xFF00) ? DDS_LAYOUT_A8L8 :
+					alpha_only && bit_count == 8 && ReadLE32(desc + 100) == 0xFF ? DDS_LAYOUT_A8 :
+					DDS_LAYOUT_NONE);
+	
+	#undef DDS_MASKS
+	
+	header.pixel_bytes = (header.layout == DDS_LAYOUT_NONE ? 0 : bit_count / 8);
+	
+	// With DDSD_PITCH the header says how far apart the rows are, and some
+	// writers pad them out to a DWORD.  One too short to hold a row is wrong.
+	const uint64 tight = (uint64)header.width * header.pixel_bytes;
+	const uint32 pitch = ReadLE32(desc + 16);
+	
+	const bool have_pitch = (header.layout != DDS_LAYOUT_NONE && (flags & 0x8) && pitch >= tight);
+	
+	header.pitch = (uint)(have_pitch ? pitch : tight);
+	header.row_align = (have_pitch && pitch != tight && pitch == ((tight + 3) & ~3) ? 4 : 1);
+	
+	return true;
+}
+
+
+// for the uncompressed layouts
+static crnlib::uint RowBytes(const DDSHeader &header, crnlib::uint level)
+{
+	const crnlib::uint tight = LevelDimension(header.width, level) * header.pixel_bytes;
+	
+	return (level == 0 ? header.pitch : (tight + header.row_align - 1) & ~(header.row_align - 1));
+}
+
+
+static crnlib::uint64 LevelBytes(const DDSHeader &header, crnlib::uint level)
+{
+	if(header.layout != DDS_LAYOUT_NONE)
+		return (crnlib::uint64)RowBytes(header, level) * LevelDimension(header.height, level);
+	
+	const crnlib::uint blocks_x = (LevelDimension(header.width, level) + 3) / 4;
+	const crnlib::uint blocks_y = (LevelDimension(header.height, level) + 3) / 4;
+	
+	return (crnlib::uint64)blocks_x * blocks_y * header.block_bytes;
+}
+
+
+// only for the formats ReadDDSHeader() recognizes, first face only
+static bool ReadDDSLevel(crnlib::data_stream &stream, const DDSHeader &header, crnlib::uint level, crnlib::dxt_image &dxt)
+{
+	using namespace crnlib;
+	
+	assert(header.format != PIXEL_FMT_INVALID);
+	
+	uint64 offset = DDS_HEADER_SIZE;
+	
+	for(uint l = 0; l < level; l++)
+		offset += LevelBytes(header, l);
+	
+	const uint64 bytes = LevelBytes(header, level);
+	
+	vector<dxt_image::element> elements(bytes / sizeof(dxt_image::element));
+	
+	stream.seek(offset, false);
+	
+	if(stream.read(elements.get_ptr(), bytes) != bytes)
+		return false;
+	
+	return dxt.init(pixel_format_helpers::get_dxt_format(header.format),
+					LevelDimension(header.width, level), LevelDimension(header.height, level),
+					elements.size(), elements.get_ptr(), true);
+}
+
+
+// DXT1 blocks in 3-color mode can have transparent pixels
+static bool DXT1HasAlpha(const crnlib::dxt_image &dxt)
+{
+	using namespace crnlib;
+	
+	const dxt_image::element *block = dxt.get_element_ptr();
+	
+	for(uint i=0; i < dxt.get_total_elements(); i++, block++)
+	{
+		const uint color0 = block->m_bytes[0] | (block->m_bytes[1] << 8);
+		const uint color1 = block->m_bytes[2] | (block->m_bytes[3] << 8);
+		
+		if(color0 <= color1)
+		{
+			for(int b=4; b < 8; b++)
+			{
+				const uint8 selectors = block->m_bytes[b];
+				
+				for(int s=0; s < 8; s += 2)
+				{
+					if( ((selectors >> s) & 3) == 3 )
+						return true;
+				}
+			}
+		}
+	}
+	
+	return false;
+}
+
+
+// Uncompressed unpacking
+//   One small struct per layout, and a row loop instantiated for each, so
+//   the layout is picked once per level and the inner loop is straight-line
+//   shifts and masks the compiler can vectorize.  Pixels come out in the
+//   r, g, b, a order we hand the host.  Alpha-only files show the alpha as
+//   gray, like DXT5A.
+
+static inline crnlib::uint8 Expand5(crnlib::uint v) { return (crnlib::uint8)((v << 3) | (v >> 2)); }
+static inline crnlib::uint8 Expand6(crnlib::uint v) { return (crnlib::uint8)((v << 2) | (v >> 4)); }
+
+struct UnpackR5G6B5 {
+	enum { bytes = 2, alpha = false };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		const crnlib::uint v = in[0] | (in[1] << 8);
+		out[0] = Expand5(v >> 11);
+		out[1] = Expand6((v >> 5) & 0x3F);
+		out[2] = Expand5(v & 0x1F);
+		out[3] = 255;
+	}
+};
+
+struct UnpackA1R5G5B5 {
+	enum { bytes = 2, alpha = true };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		const crnlib::uint v = in[0] | (in[1] << 8);
+		out[0] = Expand5((v >> 10) & 0x1F);
+		out[1] = Expand5((v >> 5) & 0x1F);
+		out[2] = Expand5(v & 0x1F);
+		out[3] = (crnlib::uint8)(0 - (v >> 15));
+	}
+};
+
+struct UnpackA4R4G4B4 {
+	enum { bytes = 2, alpha = true };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		out[0] = (in[1] & 0x0F) * 0x11;
+		out[1] = (in[0] >> 4) * 0x11;
+		out[2] = (in[0] & 0x0F) * 0x11;
+		out[3] = (in[1] >> 4) * 0x11;
+	}
+};
+
+struct UnpackR8G8B8 {
+	enum { bytes = 3, alpha = false };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		out[0] = in[2];
+		out[1] = in[1];
+		out[2] = in[0];
+		out[3] = 255;
+	}
+};
+
+struct UnpackL8 {
+	enum { bytes = 1, alpha = false };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		out[0] = out[1] = out[2] = in[0];
+		out[3] = 255;
+	}
+};
+
+struct UnpackA8L8 {
+	enum { bytes = 2, alpha = true };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		out[0] = out[1] = out[2] = in[0];
+		out[3] = in[1];
+	}
+};
+
+struct UnpackA8 {
+	enum { bytes = 1, alpha = true };
+	static inline void pixel(const crnlib::uint8 *in, crnlib::uint8 *out)
+	{
+		out[0] = out[1] = out[2] = out[3] = in[0];
+	}
+};
+
+
+template <typename Layout>
+static void UnpackRows(const crnlib::uint8 *in, size_t in_pitch, crnlib::image_u8 &out)
+{
+	const crnlib::uint width = out.get_width();
+	
+	for(crnlib::uint y=0; y < out.get_height(); y++)
+	{
+		const crnlib::uint8 *src = in + (size_t)y * in_pitch;
+		crnlib::uint8 *dst = (crnlib::uint8 *)out.get_scanline(y);
+		
+		for(crnlib::uint x=0; x < width; x++)
+			Layout::pixel(src + x * Layout::bytes, dst + x * 4);
+	}
+}
+
+
+static bool LayoutHasAlpha(int layout)
+{
+	return (layout == DDS_LAYOUT_A1R5G5B5 ? UnpackA1R5G5B5::alpha :
+			layout == DDS_LAYOUT_A4R4G4B4 ? UnpackA4R4G4B4::alpha :
+			layout == DDS_LAYOUT_A8L8 ? UnpackA8L8::alpha :
+			layout == DDS_LAYOUT_A8 ? UnpackA8::alpha :
+			false);
+}
+
+
+// one or two bytes a pixel, just like a grayscale document
+static bool GrayLayout(int layout)
+{
+	return (layout == DDS_LAYOUT_L8 || layout == DDS_LAYOUT_A8L8 || layout == DDS_LAYOUT_A8);
+}
+
+
+// crnlib counts the bytes in a vector or an image in 32 bits, and reads and
+// writes go 32 bits at a time, so this is as much as we hold in one piece
+#define IN_MEMORY_MAX_BYTES		((crnlib::uint64)0xFFFFFFFF)
+
+
+// only for the layouts ReadDDSHeader() recognizes, first face only
+static bool ReadUncompressedLevel(crnlib::data_stream &stream, const DDSHeader &header, crnlib::uint level,
+									crnlib::vector<crnlib::uint8> &data)
+{
+	using namespace crnlib;
+	
+	assert(header.layout != DDS_LAYOUT_NONE);
+	
+	uint64 offset = DDS_HEADER_SIZE;
+	
+	for(uint l = 0; l < level; l++)
+		offset += LevelBytes(header, l);
+	
+	const uint64 bytes = LevelBytes(header, level);
+	
+	if(bytes > IN_MEMORY_MAX_BYTES)
+		return false;
+	
+	data.resize(static_cast<uint>(bytes));
+	
+	stream.seek(offset, false);
+	
+	return (stream.read(data.get_ptr(), data.size()) == data.size());
+}
+
+
+static bool UnpackLevel(const DDSHeader &header, crnlib::uint level, const crnlib::vector<crnlib::uint8> &data, crnlib::image_u8 &out)
+{
+	if( !out.resize(LevelDimension(header.width, level), LevelDimension(header.height, level)) )
+		return false;
+	
+	const size_t pitch = RowBytes(header, level);
+	
+	switch(header.layout)
+	{
+		case DDS_LAYOUT_R5G6B5:		UnpackRows<UnpackR5G6B5>(data.get_ptr(), pitch, out);		break;
+		case DDS_LAYOUT_A1R5G5B5:	UnpackRows<UnpackA1R5G5B5>(data.get_ptr(), pitch, out);	break;
+		case DDS_LAYOUT_A4R4G4B4:	UnpackRows<UnpackA4R4G4B4>(data.get_ptr(), pitch, out);	break;
+		case DDS_LAYOUT_R8G8B8:		UnpackRows<UnpackR8G8B8>(data.get_ptr(), pitch, out);		break;
+		case DDS_LAYOUT_L8:			UnpackRows<UnpackL8>(data.get_ptr(), pitch, out);			break;
+		case DDS_LAYOUT_A8L8:		UnpackRows<UnpackA8L8>(data.get_ptr(), pitch, out);		break;
+		case DDS_LAYOUT_A8:			UnpackRows<UnpackA8>(data.get_ptr(), pitch, out);			break;
+		default:					return false;
+	}
+	
+	return true;
+}
+
+
+// Uncompressed packing
+//   The other way, for the formats that store fewer bits than we have.
+//   Each channel is scaled down with a rounding bias, which with dithering
+//   comes from a 4x4 Bayer matrix instead.  The bias is kept to the range
+//   where a value that fits exactly in the smaller size isn't dithered,
+//   which is narrower the more bits there are.  A 1-bit alpha is never
+//   dithered, it would stipple the edges.
+
+static const crnlib::uint8 kBayer4[4][4] = {	{  0,  8,  2, 10 },
+												{ 12,  4, 14,  6 },
+												{  3, 11,  1,  9 },
+												{ 15,  7, 13,  5 } };
+
+#define PACK_ROUND		127
+
+typedef struct {
+	crnlib::uint	bits4;
+	crnlib::uint	bits5;
+	crnlib::uint	bits6;
+} PackBias;
+
+static inline crnlib::uint Quantize(crnlib::uint v, crnlib::uint max, crnlib::uint bias)
+{
+	return (v * max + bias) / 255;
+}
+
+static inline crnlib::uint8 Luma(const crnlib::uint8 *in)
+{
+	return (crnlib::uint8)((in[0] * 77 + in[1] * 150 + in[2] * 29 + 128) >> 8);
+}
+
+static inline void PackLE16(crnlib::uint v, crnlib::uint8 *out)
+{
+	out[0] = v & 0xFF;
+	out[1] = v >> 8;
+}
+
+struct PackR5G6B5 {
+	enum { bytes = 2 };
+	static inline void pixel(const crnlib::uint8 *in, const PackBias &bias, crnlib::uint8 *out)
+	{
+		PackLE16((Quantize(in[0], 31, bias.bits5) << 11) | (Quantize(in[1], 63, bias.bits6) << 5) | Quantize(in[2], 31, bias.bits5), out);
+	}
+};
+
+struct PackA1R5G5B5 {
+	enum { bytes = 2 };
+	static inline void pixel(const crnlib::uint8 *in, const PackBias &bias, crnlib::uint8 *out)
+	{
+		PackLE16((Quantize(in[3], 1, PACK_ROUND) << 15) |
+					(Quantize(in[0], 31, bias.bits5) << 10) | (Quantize(in[1], 31, bias.bits5) << 5) | Quantize(in[2], 31, bias.bits5), out);
+	}
+};
+
+struct PackA4R4G4B4 {
+	enum { bytes = 2 };
+	static inline void pixel(const crnlib::uint8 *in, const PackBias &bias, crnlib::uint8 *out)
+	{
+		PackLE16((Quantize(in[3], 15, bias.bits4) << 12) |
+					(Quantize(in[0], 15, bias.bits4) << 8) | (Quantize(in[1], 15, bias.bits4) << 4) | Quantize(in[2], 15, bias.bits4), out);
+	}
+};
+
+struct PackL8 {
+	enum { bytes = 1 };
+	static inline void pixel(const crnlib::uint8 *in, const PackBias &bias, crnlib::uint8 *out)
+	{
+		out[0] = Luma(in);
+	}
+};
+
+struct PackA8 {
+	enum { bytes = 1 };
+	static inline void pixel(const crnlib::uint8 *in, const PackBias &bias, crnlib::uint8 *out)
+	{
+		out[0] = in[3];
+	}
+};
+
+struct PackA8L8 {
+	enum { bytes = 2 };
+	static inline void pixel(const crnlib::uint8 *in, const PackBias &bias, crnlib::uint8 *out)
+	{
+		out[0] = Luma(in);
+		out[1] = in[3];
+	}
+};
+
+
+template <typename Layout>
+static void PackRows(const crnlib::image_u8 &img, bool dither, crnlib::uint8 *out)
+{
+	const crnlib::uint width = img.get_width();
+	
+	for(crnlib::uint y=0; y < img.get_height(); y++)
+	{
+		PackBias bias[4];
+		
+		for(int i=0; i < 4; i++)
+		{
+			const crnlib::uint m = kBayer4[y & 3][i];
+			
+			bias[i].bits4 = (dither ? m * 16 + 7 : PACK_ROUND);
+			bias[i].bits5 = (dither ? m * 14 + 22 : PACK_ROUND);
+			bias[i].bits6 = (dither ? m * 10 + 52 : PACK_ROUND);
+		}
+		
+		const crnlib::uint8 *src = (const crnlib::uint8 *)img.get_scanline(y);
+		crnlib::uint8 *dst = out + (size_t)y * width * Layout::bytes;
+		
+		for(crnlib::uint x=0; x < width; x++)
+			Layout::pixel(src + x * 4, bias[x & 3], dst + x * Layout::bytes);
+	}
+}
+
+
+static int LayoutBytes(int layout)
+{
+	return (layout == DDS_LAYOUT_R8G8B8 ? 3 :
+			layout == DDS_LAYOUT_L8 || layout == DDS_LAYOUT_A8 ? 1 :
+			layout == DDS_LAYOUT_NONE ? 0 :
+			2);
+}
+
+
+static bool PackPixels(int layout, const crnlib::image_u8 &img, bool dither, crnlib::uint8 *out)
+{
+	switch(layout)
+	{
+		case DDS_LAYOUT_R5G6B5:		PackRows<PackR5G6B5>(img, dither, out);		break;
+		case DDS_LAYOUT_A1R5G5B5:	PackRows<PackA1R5G5B5>(img, dither, out);	break;
+		case DDS_LAYOUT_A4R4G4B4:	PackRows<PackA4R4G4B4>(img, dither, out);	break;
+		case DDS_LAYOUT_L8:			PackRows<PackL8>(img, dither, out);			break;
+		case DDS_LAYOUT_A8:			PackRows<PackA8>(img, dither, out);			break;
+		case DDS_LAYOUT_A8L8:		PackRows<PackA8L8>(img, dither, out);		break;
+		default:					return false;
+	}
+	
+	return true;
+}
+
+
+// the pixel format part of the header, the same masks ReadDDSHeader() looks for
+static void MakePackedHeader(crnlib::uint width, crnlib::uint height, crnlib::uint levels, bool cubemap, int layout,
+								crnlib::uint8 *header)
+{
+	using namespace crnlib;
+	
+	memset(header, 0, DDS_HEADER_SIZE);
+	
+	memcpy(header, "DDS ", 4);
+	
+	uint8 *desc = header + 4;
+	
+	const bool complex = (levels > 1 || cubemap);
+	
+	WriteLE32(desc + 0, 124);
+	WriteLE32(desc + 4, 0x1 | 0x2 | 0x4 | 0x8 | 0x1000 | (levels > 1 ? 0x20000 : 0)); // CAPS, HEIGHT, WIDTH, PITCH, PIXELFORMAT, MIPMAPCOUNT
+	WriteLE32(desc + 8, height);
+	WriteLE32(desc + 12, width);
+	WriteLE32(desc + 16, width * LayoutBytes(layout));
+	WriteLE32(desc + 24, levels);
+	
+	const uint32 pixel_flags = (layout == DDS_LAYOUT_R5G6B5 ? 0x40 :			// DDPF_RGB
+								layout == DDS_LAYOUT_A1R5G5B5 ? 0x40 | 0x1 :	// DDPF_RGB, DDPF_ALPHAPIXELS
+								layout == DDS_LAYOUT_A4R4G4B4 ? 0x40 | 0x1 :
+								layout == DDS_LAYOUT_L8 ? 0x20000 :				// DDPF_LUMINANCE
+								layout == DDS_LAYOUT_A8L8 ? 0x20000 | 0x1 :
+								0x2);											// DDPF_ALPHA
+	
+	const uint32 red_mask = (layout == DDS_LAYOUT_R5G6B5 ? 0xF800 : layout == DDS_LAYOUT_A1R5G5B5 ? 0x7C00 :
+								layout == DDS_LAYOUT_A4R4G4B4 ? 0x0F00 : layout == DDS_LAYOUT_A8 ? 0 : 0xFF);
+	const uint32 green_mask = (layout == DDS_LAYOUT_R5G6B5 ? 0x07E0 : layout == DDS_LAYOUT_A1R5G5B5 ? 0x03E0 :
+								layout == DDS_LAYOUT_A4R4G4B4 ? 0x00F0 : 0);
+	const uint32 blue_mask = (layout == DDS_LAYOUT_R5G6B5 || layout == DDS_LAYOUT_A1R5G5B5 ? 0x001F :
+								layout == DDS_LAYOUT_A4R4G4B4 ? 0x000F : 0);
+	const uint32 alpha_mask = (layout == DDS_LAYOUT_A1R5G5B5 ? 0x8000 : layout == DDS_LAYOUT_A4R4G4B4 ? 0xF000 :
+								layout == DDS_LAYOUT_A8L8 ? 0xFF00 : layout == DDS_LAYOUT_A8 ? 0xFF : 0);
+	
+	const uint32 masks[4] = { red_mask, green_mask, blue_mask, alpha_mask };
+	
+	WriteLE32(desc + 72, 32);
+	WriteLE32(desc + 76, pixel_flags);
+	WriteLE32(desc + 84, LayoutBytes(layout) * 8);
+	
+	for(int i=0; i < 4; i++)
+		WriteLE32(desc + 88 + i * 4, masks[i]);
+	
+	WriteLE32(desc + 104, 0x1000 | (complex ? 0x8 : 0) | (levels > 1 ? 0x400000 : 0)); // TEXTURE, COMPLEX, MIPMAP
+	WriteLE32(desc + 108, (cubemap ? 0x200 | 0xFC00 : 0)); // CUBEMAP and all six faces
+}
+
+
+// Scaled reads
+//   With a read scale of N we hand the host the smallest mip level that's
+//   still at least 1/N the size.  If there are no mips, we box-filter
+//   level 0 down by N as it's decoded.
+//   A preview size of N asks instead for an image no bigger than N x N:
+//   the smallest level that's at least that big, box-filtered the rest
+//   of the way.
+
+typedef struct {
+	crnlib::uint	level;		// mip level to read
+	crnlib::uint	reduce;		// then average reduce x reduce squares of it
+	int				width;		// what the host gets
+	int				height;
+} ReadPlan;
+
+
+static crnlib::uint ChooseReadLevel(crnlib::uint width, crnlib::uint height, crnlib::uint levels, crnlib::uint scale)
+{
+	const crnlib::uint target_width = crnlib::math::maximum<crnlib::uint>(1, width / scale);
+	const crnlib::uint target_height = crnlib::math::maximum<crnlib::uint>(1, height / scale);
+	
+	crnlib::uint level = 0;
+	
+	while(level + 1 < levels &&
+			LevelDimension(width, level + 1) >= target_width &&
+			LevelDimension(height, level + 1) >= target_height)
+	{
+		level++;
+	}
+	
+	return level;
+}
+
+
+static crnlib::uint ChoosePreviewLevel(crnlib::uint width, crnlib::uint height, crnlib::uint levels, crnlib::uint preview)
+{
+	crnlib::uint level = 0;
+	
+	while(level + 1 < levels &&
+			crnlib::math::maximum(LevelDimension(width, level + 1), LevelDimension(height, level + 1)) >= preview)
+	{
+		level++;
+	}
+	
+	return level;
+}
+
+
+static void PlanRead(crnlib::uint width, crnlib::uint height, crnlib::uint levels,
+						crnlib::uint scale, crnlib::uint preview, ReadPlan &plan)
+{
+	if(preview > 0)
+	{
+		plan.level = ChoosePreviewLevel(width, height, levels, preview);
+		
+		const crnlib::uint largest = crnlib::math::maximum(LevelDimension(width, plan.level), LevelDimension(height, plan.level));
+		
+		// the smallest factor that fits, whole blocks or not; rounding it up
+		// to a multiple of 4 for BlockAverages() could leave us far short
+		plan.reduce = crnlib::math::maximum<crnlib::uint>(1, (largest + preview - 1) / preview);
+	}
+	else
+	{
+		plan.level = ChooseReadLevel(width, height, levels, scale);
+		plan.reduce = (plan.level == 0 ? scale : 1);
+	}
+	
+	plan.width = (LevelDimension(width, plan.level) + plan.reduce - 1) / plan.reduce;
+	plan.height = (LevelDimension(height, plan.level) + plan.reduce - 1) / plan.reduce;
+}
+
+
+// averages scale x scale squares, fed one source row at a time, top to bottom
+class BoxReducer
+{
+public:
+	BoxReducer(crnlib::uint width, crnlib::uint height, crnlib::uint scale, crnlib::image_u8 &out);
+	
+	void add_row(const crnlib::color_quad_u8 *row);
+
+private:
+	crnlib::uint _width;
+	crnlib::uint _height;
+	crnlib::uint _scale;
+	crnlib::uint _y;
+	crnlib::image_u8 &_out;
+	crnlib::vector<crnlib::uint32> _sums;
+};
+
+
+BoxReducer::BoxReducer(crnlib::uint width, crnlib::uint height, crnlib::uint scale, crnlib::image_u8 &out) :
+	_width(width),
+	_height(height),
+	_scale(scale),
+	_y(0),
+	_out(out)
+{
+	_out.resize((width + scale - 1) / scale, (height + scale - 1) / scale);
+	
+	_sums.resize(_out.get_width() * 4);
+	
+	memset(_sums.get_ptr(), 0, _sums.size() * sizeof(crnlib::uint32));
+}
+
+
+void
+BoxReducer::add_row(const crnlib::color_quad_u8 *row)
+{
+	using namespace crnlib;
+	
+	for(uint x=0; x < _width; x++)
+	{
+		uint32 *sum = &_sums[(x / _scale) * 4];
+		
+		sum[0] += row[x].r;
+		sum[1] += row[x].g;
+		sum[2] += row[x].b;
+		sum[3] += row[x].a;
+	}
+	
+	const uint out_y = _y / _scale;
+	
+	_y++;
+	
+	if(_y % _scale == 0 || _y == _height)
+	{
+		const uint rows = _y - (out_y * _scale);
+		
+		color_quad_u8 *out_row = _out.get_scanline(out_y);
+		
+		for(uint x=0; x < _out.get_width(); x++)
+		{
+			const uint cols = math::minimum(_scale, _width - (x * _scale));
+			const uint count = rows * cols;
+			
+			uint32 *sum = &_sums[x * 4];
+			
+			out_row[x].set((sum[0] + count / 2) / count, (sum[1] + count / 2) / count,
+							(sum[2] + count / 2) / count, (sum[3] + count / 2) / count);
+			
+			sum[0] = sum[1] = sum[2] = sum[3] = 0;
+		}
+	}
+}
+
+
+static void BoxReduceImage(const crnlib::image_u8 &in, crnlib::uint scale, crnlib::image_u8 &out)
+{
+	BoxReducer reducer(in.get_width(), in.get_height(), scale, out);
+	
+	for(crnlib::uint y=0; y < in.get_height(); y++)
+		reducer.add_row(in.get_scanline(y));
+}
+
+
+// decode a strip of blocks at a time, never the whole image
+static void BoxReduceBlocks(const crnlib::dxt_image &dxt, crnlib::uint scale, crnlib::image_u8 &out)
+{
+	using namespace crnlib;
+	
+	const uint width = dxt.get_width();
+	const uint height = dxt.get_height();
+	
+	BoxReducer reducer(width, height, scale, out);
+	
+	vector<color_quad_u8> strip(dxt.get_blocks_x() * 4 * 4);
+	
+	const uint strip_pitch = dxt.get_blocks_x() * 4;
+	
+	color_quad_u8 block[16];
+	
+	for(uint by=0; by < dxt.get_blocks_y(); by++)
+	{
+		for(uint bx=0; bx < dxt.get_blocks_x(); bx++)
+		{
+			dxt.get_block_pixels(bx, by, block);
+			
+			for(uint y=0; y < 4; y++)
+				memcpy(&strip[y * strip_pitch + bx * 4], &block[y * 4], 4 * sizeof(color_quad_u8));
+		}
+		
+		for(uint y=0; y < 4 && (by * 4 + y) < height; y++)
+			reducer.add_row(&strip[y * strip_pitch]);
+	}
+}
+
+
+static void UnpackColor(crnlib::uint color, crnlib::uint rgb[3])
+{
+	const crnlib::uint r = (color >> 11) & 31;
+	const crnlib::uint g = (color >> 5) & 63;
+	const crnlib::uint b = color & 31;
+	
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+
+// One pixel per block: the average of the block's pixels, worked out from the
+// endpoints and how many pixels use each palette entry.  Much cheaper than
+// decoding all 16 pixels.
+static void BlockAverages(const crnlib::dxt_image &dxt, crnlib::image_u8 &out)
+{
+	using namespace crnlib;
+	
+	const dxt_format fmt = dxt.get_format();
+	
+	const bool dxt1 = (fmt == cDXT1 || fmt == cDXT1A);
+	const bool dxt3 = (fmt == cDXT3);
+	
+	assert(dxt1 || dxt3 || fmt == cDXT5);
+	
+	out.resize(dxt.get_blocks_x(), dxt.get_blocks_y());
+	
+	for(uint by=0; by < dxt.get_blocks_y(); by++)
+	{
+		const uint rows = math::minimum<uint>(4, dxt.get_height() - (by * 4));
+		
+		color_quad_u8 *out_row = out.get_scanline(by);
+		
+		for(uint bx=0; bx < dxt.get_blocks_x(); bx++)
+		{
+			const uint cols = math::minimum<uint>(4, dxt.get_width() - (bx * 4));
+			const uint count = rows * cols;
+			
+			const uint8 *color = dxt.get_element(bx, by, (dxt1 ? 0 : 1)).m_bytes;
+			
+			uint color_count[4] = { 0, 0, 0, 0 };
+			
+			for(uint y=0; y < rows; y++)
+				for(uint x=0; x < cols; x++)
+					color_count[(color[4 + y] >> (x * 2)) & 3]++;
+			
+			const uint color0 = color[0] | (color[1] << 8);
+			const uint color1 = color[2] | (color[3] << 8);
+			
+			uint rgb0[3], rgb1[3];
+			
+			UnpackColor(color0, rgb0);
+			UnpackColor(color1, rgb1);
+			
+			uint sum[4] = { 0, 0, 0, 0 };
+			
+			for(int c=0; c < 3; c++)
+			{
+				sum[c] = (color_count[0] * rgb0[c]) + (color_count[1] * rgb1[c]);
+				
+				if(color0 > color1)
+				{
+					sum[c] += (color_count[2] * ((rgb0[c] * 2 + rgb1[c]) / 3)) +
+								(color_count[3] * ((rgb0[c] + rgb1[c] * 2) / 3));
+				}
+				else
+					sum[c] += (color_count[2] * ((rgb0[c] + rgb1[c]) / 2)); // entry 3 is black
+			}
+			
+			if(dxt1)
+			{
+				sum[3] = (count - (color0 > color1 ? 0 : color_count[3])) * 255; // 3 is transparent
+			}
+			else if(dxt3)
+			{
+				const uint8 *alpha = dxt.get_element(bx, by, 0).m_bytes;
+				
+				for(uint y=0; y < rows; y++)
+					for(uint x=0; x < cols; x++)
+						sum[3] += ((alpha[y * 2 + (x / 2)] >> ((x & 1) * 4)) & 15) * 17;
+			}
+			else
+			{
+				const uint8 *alpha = dxt.get_element(bx, by, 0).m_bytes;
+				
+				const uint alpha0 = alpha[0];
+				const uint alpha1 = alpha[1];
+				
+				uint values[8] = { alpha0, alpha1, 0, 0, 0, 0, 0, 255 };
+				
+				if(alpha0 > alpha1)
+				{
+					for(uint i=1; i < 7; i++)
+						values[i + 1] = ((alpha0 * (7 - i)) + (alpha1 * i)) / 7;
+				}
+				else
+				{
+					for(uint i=1; i < 5; i++)
+						values[i + 1] = ((alpha0 * (5 - i)) + (alpha1 * i)) / 5;
+				}
+				
+				uint64 selectors = 0;
+				
+				for(int i=0; i < 6; i++)
+					selectors |= (uint64)alpha[2 + i] << (i * 8);
+				
+				for(uint y=0; y < rows; y++)
+					for(uint x=0; x < cols; x++)
+						sum[3] += values[(selectors >> ((y * 4 + x) * 3)) & 7];
+			}
+			
+			out_row[bx].set((sum[0] + count / 2) / count, (sum[1] + count / 2) / count,
+							(sum[2] + count / 2) / count, (sum[3] + count / 2) / count);
+		}
+	}
+}
+
+
+// decode just what the plan needs from the chosen level
+static bool DecodePlanned(const crnlib::dxt_image &dxt, const ReadPlan &plan, crnlib::image_u8 &out)
+{
+	if(plan.reduce == 1)
+	{
+		return dxt.unpack(out);
+	}
+	else if(plan.reduce % 4 == 0)
+	{
+		crnlib::image_u8 averages;
+		
+		BlockAverages(dxt, averages);
+		
+		if(plan.reduce == 4)
+			out.swap(averages);
+		else
+			BoxReduceImage(averages, plan.reduce / 4, out);
+	}
+	else
+		BoxReduceBlocks(dxt, plan.reduce, out);
+	
+	return true;
+}
+
+
+// Source hash
+//   64-bit hash of everything that goes into a save: the pixels after alpha
+//   and premultiply, and the options.  Four independent lanes over 32-byte
+//   stripes, so the compiler can keep it in vector registers and it runs
+//   at about the speed of memory.
+
+class SourceHash
+{
+public:
+	SourceHash();
+	
+	void update(const void *data, size_t len);
+	crnlib::uint64 finish();
+
+private:
+	void stripe(const crnlib::uint8 *p);
+
+	crnlib::uint64 _lane[4];
+	crnlib::uint8 _tail[32];
+	size_t _tail_len;
+	crnlib::uint64 _total_len;
+};
+
+
+#define HASH_PRIME1		0x9E3779B185EBCA87ULL
+#define HASH_PRIME2		0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3		0x165667B19E3779F9ULL
+
+static inline crnlib::uint64 HashRotate(crnlib::uint64 x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline crnlib::uint64 HashLoad(const crnlib::uint8 *p)
+{
+	crnlib::uint64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline crnlib::uint64 HashRound(crnlib::uint64 acc, crnlib::uint64 v)
+{
+	return HashRotate(acc + v * HASH_PRIME2, 31) * HASH_PRIME1;
+}
+
+
+SourceHash::SourceHash() :
+	_tail_len(0),
+	_total_len(0)
+{
+	_lane[0] = HASH_PRIME1 + HASH_PRIME2;
+	_lane[1] = HASH_PRIME2;
+	_lane[2] = 0;
+	_lane[3] = 0 - HASH_PRIME1;
+}
+
+
+void
+SourceHash::stripe(const crnlib::uint8 *p)
+{
+	_lane[0] = HashRound(_lane[0], HashLoad(p +  0));
+	_lane[1] = HashRound(_lane[1], HashLoad(p +  8));
+	_lane[2] = HashRound(_lane[2], HashLoad(p + 16));
+	_lane[3] = HashRound(_lane[3], HashLoad(p + 24));
+}
+
+
+void
+SourceHash::update(const void *data, size_t len)
+{
+	const crnlib::uint8 *p = (const crnlib::uint8 *)data;
+	
+	_total_len += len;
+	
+	if(_tail_len > 0)
+	{
+		const size_t fill = crnlib::math::minimum<size_t>(len, sizeof(_tail) - _tail_len);
+		
+		memcpy(_tail + _tail_len, p, fill);
+		
+		_tail_len += fill;
+		p += fill;
+		len -= fill;
+		
+		if(_tail_len < sizeof(_tail))
+			return;
+		
+		stripe(_tail);
+		
+		_tail_len = 0;
+	}
+	
+	while(len >= 32)
+	{
+		stripe(p);
+		
+		p += 32;
+		len -= 32;
+	}
+	
+	if(len > 0)
+	{
+		memcpy(_tail, p, len);
+		
+		_tail_len = len;
+	}
+}
+
+
+crnlib::uint64
+SourceHash::finish()
+{
+	crnlib::uint64 h = HashRotate(_lane[0], 1) + HashRotate(_lane[1], 7) +
+						HashRotate(_lane[2], 12) + HashRotate(_lane[3], 18);
+	
+	for(int i=0; i < 4; i++)
+		h = (h ^ HashRound(0, _lane[i])) * HASH_PRIME1 + HASH_PRIME3;
+	
+	h += _total_len;
+	
+	for(size_t i=0; i < _tail_len; i++)
+		h = HashRotate(h ^ (_tail[i] * HASH_PRIME3), 11) * HASH_PRIME1;
+	
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+	
+	return h;
+}
+
+
+// Source hash stamp
+//   Written into the DDS header's reserved area (dwReserved1), which
+//   crnlib leaves zeroed: a 'DDSh' tag followed by the hash, little-endian.
+//   Lets a build system tell whether a DDS is up to date without
+//   decoding it.
+
+#define HASH_STAMP_OFFSET	(4 + 28)	// "DDS " + header up to dwReserved1
+#define HASH_STAMP_SIZE		12
+
+static void MakeHashStamp(crnlib::uint64 hash, crnlib::uint8 *stamp)
+{
+	stamp[0] = 'D';
+	stamp[1] = 'D';
+	stamp[2] = 'S';
+	stamp[3] = 'h';
+	
+	for(int i=0; i < 8; i++)
+		stamp[4 + i] = (hash >> (8 * i)) & 0xff;
+}
+
+
+static bool StampSourceHash(crnlib::data_stream &stream, crnlib::uint64 hash)
+{
+	crnlib::uint8 stamp[HASH_STAMP_SIZE];
+	
+	MakeHashStamp(hash, stamp);
+	
+	const crnlib::uint64 end = stream.get_ofs();
+	
+	stream.seek(HASH_STAMP_OFFSET, false);
+	
+	const bool wrote = (stream.write(stamp, sizeof(stamp)) == sizeof(stamp));
+	
+	stream.seek(end, false);
+	
+	return wrote;
+}
+
+
+// Output cache
+//   If DDS_CACHE is set to a folder, finished DDS files are kept there,
+//   named by their source hash.  Saving the same pixels with the same
+//   options again just copies the cached file.  Oldest files are deleted
+//   once the folder goes over DDS_CACHE_MAX_BYTES.
+
+#define DDS_CACHE_MAX_BYTES		((crnlib::int64)1024 * 1024 * 1024)
+
+static const char * CachePath()
+{
+	static const char *path = getenv("DDS_CACHE");
+	
+	// leave room in our 1024-byte path buffers for the file name
+	return (path != NULL && path[0] != '\0' && strlen(path) < 900 ? path : NULL);
+}
+
+
+static void CacheFilePath(crnlib::uint64 hash, const char *extension, char *path)
+{
+#ifdef __PIMac__
+	const char separator = '/';
+#else
+	const char separator = '\\';
+#endif
+
+	sprintf(path, "%s%c%08x%08x.%s", CachePath(), separator,
+				(unsigned int)(hash >> 32), (unsigned int)(hash & 0xffffffff), extension);
+}
+
+
+// copy the cached file to the output, returns false on a miss
+static bool WriteCachedFile(GPtr globals, crnlib::uint64 hash, crnlib::data_stream &out)
+{
+	char path[1024];
+	
+	CacheFilePath(hash, "dds", path);
+	
+	FILE *f = fopen(path, "rb");
+	
+	if(f == NULL)
+		return false;
+	
+	crnlib::vector<crnlib::uint8> buf;
+	
+	{
+		TraceSpan span("CacheRead");
+	
+		fseek(f, 0, SEEK_END);
+		
+		const long size = ftell(f);
+		
+		fseek(f, 0, SEEK_SET);
+		
+		if(size > HASH_STAMP_OFFSET + HASH_STAMP_SIZE)
+		{
+			buf.resize(size);
+			
+			if(fread(buf.get_ptr(), 1, size, f) != (size_t)size)
+				buf.clear();
+			
+			span.set_bytes(size);
+		}
+		
+		fclose(f);
+	}
+	
+	crnlib::uint8 stamp[HASH_STAMP_SIZE];
+	
+	MakeHashStamp(hash, stamp);
+	
+	if(buf.empty() || memcmp(buf.get_ptr(), "DDS ", 4) != 0 ||
+		memcmp(buf.get_ptr() + HASH_STAMP_OFFSET, stamp, HASH_STAMP_SIZE) != 0)
+	{
+		return false;
+	}
+	
+	const crnlib::uint wrote = out.write(buf.get_ptr(), buf.size());
+	
+	if(wrote != buf.size() && gResult == noErr)
+		gResult = writErr;
+	
+	return true;
+}
+
+
+typedef struct {
+	char			name[64];
+	crnlib::int64	size;
+	crnlib::int64	time;
+} CacheEntry;
+
+static void TrimCache()
+{
+	crnlib::vector<CacheEntry> entries;
+	
+	crnlib::int64 total = 0;
+
+#ifdef __PIMac__
+	DIR *dir = opendir(CachePath());
+	
+	if(dir == NULL)
+		return;
+	
+	struct dirent *ent = NULL;
+	
+	while( (ent = readdir(dir)) )
+	{
+		const size_t len = strlen(ent->d_name);
+		
+		if(len < 4 || len >= sizeof(entries[0].name) || strcmp(ent->d_name + len - 4, ".dds") != 0)
+			continue;
+		
+		char path[1024];
+		sprintf(path, "%s/%s", CachePath(), ent->d_name);
+		
+		struct stat st;
+		
+		if(stat(path, &st) == 0)
+		{
+			CacheEntry entry;
+			strcpy(entry.name, ent->d_name);
+			entry.size = st.st_size;
+			entry.time = st.st_mtime;
+			
+			entries.push_back(entry);
+			
+			total += entry.size;
+		}
+	}
+	
+	closedir(dir);
+#else
+	char pattern[1024];
+	sprintf(pattern, "%s\\*.dds", CachePath());
+	
+	WIN32_FIND_DATAA find_data;
+	
+	HANDLE find = FindFirstFileA(pattern, &find_data);
+	
+	if(find == INVALID_HANDLE_VALUE)
+		return;
+	
+	do{
+		if(strlen(find_data.cFileName) < sizeof(entries[0].name))
+		{
+			CacheEntry entry;
+			strcpy(entry.name, find_data.cFileName);
+			entry.size = ((crnlib::int64)find_data.nFileSizeHigh << 32) | find_data.nFileSizeLow;
+			entry.time = ((crnlib::int64)find_data.ftLastWriteTime.dwHighDateTime << 32) | find_data.ftLastWriteTime.dwLowDateTime;
+			
+			entries.push_back(entry);
+			
+			total += entry.size;
+		}
+	}while( FindNextFileA(find, &find_data) );
+	
+	FindClose(find);
+#endif
+
+	while(total > DDS_CACHE_MAX_BYTES && !entries.empty())
+	{
+		crnlib::uint oldest = 0;
+		
+		for(crnlib::uint i=1; i < entries.size(); i++)
+		{
+			if(entries[i].time < entries[oldest].time)
+				oldest = i;
+		}
+		
+		char path[1024];
+		sprintf(path, "%s%c%s", CachePath(),
+	#ifdef __PIMac__
+					'/',
+	#else
+					'\\',
+	#endif
+					entries[oldest].name);
+		
+		remove(path);
+		
+		total -= entries[oldest].size;
+		
+		entries[oldest] = entries.back();
+		entries.pop_back();
+	}
+}
+
+
+// file is the DDS as written, hash already stamped, copied a piece at a time
+static void AddToCache(crnlib::data_stream &file, crnlib::uint64 hash)
+{
+	TraceSpan span("CacheWrite");
+	
+	char temp_extension[32], temp_path[1024], path[1024];
+	
+	sprintf(temp_extension, "tmp%x", CurrentThreadID()); // other threads could be saving the same thing
+	
+	CacheFilePath(hash, temp_extension, temp_path);
+	CacheFilePath(hash, "dds", path);
+	
+	bool ok = false;
+	
+	{
+		crnlib::cfile_stream cache_file(temp_path, crnlib::cDataStreamWritable | crnlib::cDataStreamSeekable);
+		
+		const crnlib::uint64 size = file.get_size();
+		
+		if( cache_file.is_opened() && file.seek(0, false) )
+		{
+			crnlib::vector<crnlib::uint8> buf(BUFFERED_STREAM_SIZE);
+			
+			ok = true;
+			
+			for(crnlib::uint64 pos = 0; pos < size && ok; pos += buf.size())
+			{
+				const crnlib::uint len = (crnlib::uint)crnlib::math::minimum<crnlib::uint64>(buf.size(), size - pos);
+				
+				ok = (file.read(buf.get_ptr(), len) == len && cache_file.write(buf.get_ptr(), len) == len);
+			}
+			
+			span.set_bytes(size);
+		}
+	}
+	
+	if(ok)
+		ok = (rename(temp_path, path) == 0);
+	
+	if(ok)
+		TrimCache();
+	else
+		remove(temp_path);
+}
+
+
+// File identity
+//   Tells us whether two forks refer to the same file contents, without
+//   reading them.
+
+typedef struct {
+	crnlib::uint64	volume;
+	crnlib::uint64	file;
+	crnlib::int64	size;
+	crnlib::int64	modified;
+} FileIdentity;
+
+
+static bool GetFileIdentity(intptr_t dataFork, FileIdentity &id)
+{
+#ifdef __PIMac__
+	FSRef ref;
+	FSCatalogInfo info;
+	
+	if(noErr != FSGetForkCBInfo((FSIORefNum)dataFork, 0, NULL, NULL, NULL, &ref, NULL))
+		return false;
+	
+	if(noErr != FSGetCatalogInfo(&ref, kFSCatInfoVolume | kFSCatInfoNodeID | kFSCatInfoContentMod | kFSCatInfoDataSizes,
+									&info, NULL, NULL, NULL))
+	{
+		return false;
+	}
+	
+	id.volume = info.volume;
+	id.file = info.nodeID;
+	id.size = info.dataLogicalSize;
+	id.modified = ((crnlib::int64)info.contentModDate.highSeconds << 48) |
+					((crnlib::int64)info.contentModDate.lowSeconds << 16) |
+					info.contentModDate.fraction;
+#else
+	BY_HANDLE_FILE_INFORMATION info;
+	
+	if( !GetFileInformationByHandle((HANDLE)dataFork, &info) )
+		return false;
+	
+	id.volume = info.dwVolumeSerialNumber;
+	id.file = ((crnlib::uint64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+	id.size = ((crnlib::int64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+	id.modified = ((crnlib::int64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+#endif
+
+	return true;
+}
+
+
+static bool SameFile(const FileIdentity &a, const FileIdentity &b)
+{
+	return (a.volume == b.volume && a.file == b.file && a.size == b.size && a.modified == b.modified);
+}
+
+
+// our own fork on the same file, with its own position
+static intptr_t ReopenFile(intptr_t dataFork, bool write)
+{
+#ifdef __PIMac__
+	FSRef ref;
+	HFSUniStr255 dataForkName;
+	FSIORefNum refNum = 0;
+	
+	if(noErr != FSGetForkCBInfo((FSIORefNum)dataFork, 0, NULL, NULL, NULL, &ref, NULL))
+		return 0;
+	
+	FSGetDataForkName(&dataForkName);
+	
+	if(noErr != FSOpenFork(&ref, dataForkName.length, dataForkName.unicode, (write ? fsRdWrShPerm : fsRdPerm), &refNum))
+		return 0;
+	
+	return refNum;
+#else
+	HANDLE h = ReOpenFile((HANDLE)dataFork, (write ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ),
+							FILE_SHARE_READ | FILE_SHARE_WRITE, (write ? 0 : FILE_FLAG_SEQUENTIAL_SCAN));
+	
+	return (h == INVALID_HANDLE_VALUE ? 0 : (intptr_t)h);
+#endif
+}
+
+
+static void CloseReopenedFile(intptr_t fork)
+{
+#ifdef __PIMac__
+	FSCloseFork((FSIORefNum)fork);
+#else
+	CloseHandle((HANDLE)fork);
+#endif
+}
+
+
+// Staying loaded
+//   A thread of ours that outlives the call that started it would be left
+//   running code that isn't there any more if the host unloaded us, and no
+//   selector tells us that's coming.  So before starting one we make sure
+//   we stay loaded until the process exits.
+
+static crnlib::atomic32_t sKeptLoaded = 0;
+
+static bool KeepPluginLoaded()
+{
+	if(sKeptLoaded != 0)
+		return true;
+	
+#ifdef __PIMac__
+	Dl_info info;
+	
+	if(0 == dladdr((const void *)&KeepPluginLoaded, &info) || info.dli_fname == NULL)
+		return false;
+	
+	// never closed
+	const bool kept = (NULL != dlopen(info.dli_fname, RTLD_LAZY | RTLD_NOLOAD | RTLD_NODELETE));
+#else
+	HMODULE module = NULL;
+	
+	const bool kept = (FALSE != GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+													(LPCTSTR)&KeepPluginLoaded, &module));
+#endif
+
+	if(kept)
+		crnlib::atomic_exchange32(&sKeptLoaded, 1);
+	
+	return kept;
+}
+
+
+// Speculative read
+//   Photoshop calls FilterFile right before opening, then takes its time
+//   with ReadStart and the input dialog.  With DDS_SPECULATIVE_READ set,
+//   FilterFile starts reading and decoding on a thread of our own, and
+//   ReadContinue picks up the result.  It's off by default because
+//   FilterFile also comes while browsing, for files that are never opened.
+//   Only for files big enough to be worth it, and not in AE, which doesn't
+//   use FilterFile that way.
+//   A read nobody wants any more (another FilterFile, a cancelled open) is
+//   told to stop and joined, which only waits out a decode already under
+//   way.  A result nobody has come for after SPECULATIVE_HOLD_MS is let go.
+
+#define SPECULATIVE_MIN_SIZE	(1024 * 1024)
+#define SPECULATIVE_HOLD_MS		15000
+
+typedef struct {
+	FileIdentity				id;
+	intptr_t					fork;
+#ifdef __PIMac__
+	pthread_t					thread;
+#else
+	HANDLE						thread;
+#endif
+	crnlib::mipmapped_texture	dds_file; // as read, before cube map conversion
+	crnlib::image_u8			img;
+	bool						ok;
+	crnlib::atomic32_t			cancel;		// the read gives up when this is set
+	crnlib::semaphore			claimed;	// released when it's taken or abandoned
+} SpeculativeRead;
+
+static crnlib::mutex sSpeculativeMutex;
+static SpeculativeRead *sSpeculative = NULL;
+
+
+static bool SpeculativeReadOn()
+{
+	static const char *env = getenv("DDS_SPECULATIVE_READ");
+	
+	return (env != NULL && atoi(env) != 0);
+}
+
+
+// take ownership of the pending read, if any
+static SpeculativeRead * PendingSpeculativeRead()
+{
+	crnlib::scoped_mutex lock(sSpeculativeMutex);
+	
+	SpeculativeRead *spec = sSpeculative;
+	
+	sSpeculative = NULL;
+	
+	return spec;
+}
+
+
+static void RunSpeculativeRead(SpeculativeRead *spec)
+{
+	TraceSpan span("SpeculativeRead");
+
+	ps_data_stream stream(spec->fork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable);
+	
+	stream.set_cancel(&spec->cancel);
+	
+	DDSHeader header;
+	
+	if(ReadDDSHeader(stream, header) && header.layout != DDS_LAYOUT_NONE && !header.cubemap)
+	{
+		crnlib::vector<crnlib::uint8> data;
+		
+		// grayscale layouts are handed over straight from the file, nothing to get ahead on
+		spec->ok = (!GrayLayout(header.layout) && ReadUncompressedLevel(stream, header, 0, data) &&
+					spec->cancel == 0 && UnpackLevel(header, 0, data, spec->img));
+		
+		CloseReopenedFile(spec->fork);
+		
+		return;
+	}
+	
+	stream.seek(0, false);
+	
+	crnlib::data_stream_serializer serializer(&stream);
+	
+	spec->ok = spec->dds_file.read_dds(serializer);
+	
+	CloseReopenedFile(spec->fork);
+	
+	if(spec->ok && spec->cancel == 0)
+	{
+		TraceSpan decode_span("SpeculativeDecode");
+	
+		if(spec->dds_file.determine_texture_type() == crnlib::cTextureTypeCubemap)
+		{
+			crnlib::mipmapped_texture cross(spec->dds_file);
+			
+			spec->ok = cross.cubemap_to_vertical_cross() &&
+						(cross.get_level_image(0, 0, spec->img) != NULL);
+		}
+		else
+			spec->ok = (spec->dds_file.get_level_image(0, 0, spec->img) != NULL);
+	}
+	
+	if(spec->cancel != 0)
+		spec->ok = false;
+}
+
+
+#ifdef __PIMac__
+static void * SpeculativeReadThread(void *arg)
+#else
+static DWORD WINAPI SpeculativeReadThread(LPVOID arg)
+#endif
+{
+	SpeculativeRead *spec = (SpeculativeRead *)arg;
+
+	RunSpeculativeRead(spec);
+	
+	if(spec->ok && !spec->claimed.wait(SPECULATIVE_HOLD_MS))
+	{
+		// gone stale, nobody's holding the memory for it now
+		spec->ok = false;
+		
+		spec->img.clear();
+		spec->dds_file.clear();
+	}
+	
+	return 0;
+}
+
+
+static void JoinSpeculativeRead(SpeculativeRead *spec)
+{
+	TraceSpan span("JoinSpeculativeRead");
+
+#ifdef __PIMac__
+	pthread_join(spec->thread, NULL);
+#else
+	WaitForSingleObject(spec->thread, INFINITE);
+	
+	CloseHandle(spec->thread);
+#endif
+}
+
+
+// stop it and wait for it to go
+static void AbandonSpeculativeRead(SpeculativeRead *spec)
+{
+	crnlib::atomic_exchange32(&spec->cancel, 1);
+	
+	spec->claimed.release();
+	
+	JoinSpeculativeRead(spec);
+	
+	crnlib::crnlib_delete(spec);
+}
+
+
+static void DiscardSpeculativeRead()
+{
+	SpeculativeRead *spec = PendingSpeculativeRead();
+
+	if(spec != NULL)
+		AbandonSpeculativeRead(spec);
+}
+
+
+static void StartSpeculativeRead(GPtr globals)
+{
+	DiscardSpeculativeRead();
+	
+	if(gStuff->hostSig == 'FXTC' || !SpeculativeReadOn())
+		return;
+	
+	FileIdentity id;
+	
+	if(!GetFileIdentity(gStuff->dataFork, id) || id.size < SPECULATIVE_MIN_SIZE || !KeepPluginLoaded())
+		return;
+	
+	const intptr_t fork = ReopenFile(gStuff->dataFork, false);
+	
+	if(fork == 0)
+		return;
+	
+	SpeculativeRead *spec = crnlib::crnlib_new<SpeculativeRead>();
+	
+	spec->id = id;
+	spec->fork = fork;
+	spec->ok = false;
+	spec->cancel = 0;
+	
+#ifdef __PIMac__
+	const bool started = (0 == pthread_create(&spec->thread, NULL, SpeculativeReadThread, spec));
+#else
+	spec->thread = CreateThread(NULL, 0, SpeculativeReadThread, spec, 0, NULL);
+	
+	const bool started = (spec->thread != NULL);
+#endif
+
+	if(started)
+	{
+		crnlib::scoped_mutex lock(sSpeculativeMutex);
+		
+		assert(sSpeculative == NULL);
+		
+		sSpeculative = spec;
+	}
+	else
+	{
+		CloseReopenedFile(fork);
+		
+		crnlib::crnlib_delete(spec);
+	}
+}
+
+
+// the finished read if it was for this file, caller deletes
+static SpeculativeRead * TakeSpeculativeRead(GPtr globals)
+{
+	SpeculativeRead *spec = PendingSpeculativeRead();
+	
+	if(spec == NULL)
+		return NULL;
+	
+	FileIdentity id;
+	
+	const bool same_file = (GetFileIdentity(gStuff->dataFork, id) && SameFile(id, spec->id));
+	
+	if(!same_file)
+	{
+		AbandonSpeculativeRead(spec);
+		
+		return NULL;
+	}
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_READ);
+		
+		spec->claimed.release();
+		
+		JoinSpeculativeRead(spec);
+		
+		if(spec->ok)
+			timer.count(spec->id.size, TextureBytes(spec->dds_file), TexturePixels(spec->dds_file));
+	}
+	
+	if(!spec->ok)
+	{
+		crnlib::crnlib_delete(spec);
+		
+		spec = NULL;
+	}
+	
+	return spec;
+}
+
+
+// Decoded image cache
+//   After Effects reads the same footage over and over, so we keep decoded
+//   images around, keyed by file identity, most recently used first.
+//   Entries are pinned while a read is handing them to the host.  The
+//   budget is DDS_DECODE_CACHE_MB megabytes (512 by default), and the
+//   cache is off in Photoshop, which reads each file once.
+//   The tiles RegionReader decodes are kept here too, under the same lock,
+//   clock and budget, so whichever image or tile was used longest ago goes
+//   first.  There can be thousands of those, so they're found through a
+//   hash table and kept in least recently used order as they're touched.
+
+#define DECODE_CACHE_DEFAULT_MB		512
+
+typedef struct {
+	FileIdentity		id;
+	crnlib::uint32		size_key;
+	crnlib::image_u8	img;
+	bool				has_alpha;
+	crnlib::int64		bytes;
+	crnlib::uint64		last_used;
+	int					pins;
+} DecodeCacheEntry;
+
+typedef struct DecodedTile {
+	FileIdentity		id;
+	crnlib::uint		face;
+	crnlib::uint		level;
+	crnlib::uint		tile_x;
+	crnlib::uint		tile_y;
+	crnlib::image_u8	img;
+	crnlib::int64		bytes;
+	crnlib::uint64		last_used;
+	struct DecodedTile	*hash_next;	// in the same bucket
+	struct DecodedTile	*newer;		// least recently used order
+	struct DecodedTile	*older;
+} DecodedTile;
+
+static crnlib::mutex sDecodeCacheMutex;
+static crnlib::vector<DecodeCacheEntry *> sDecodeCache;
+static crnlib::int64 sDecodeCacheBytes = 0;		// images and tiles together
+static crnlib::uint64 sDecodeCacheClock = 0;
+
+static crnlib::vector<DecodedTile *> sTileBuckets; // a power of 2 of them, or none yet
+static crnlib::uint sTileCount = 0;
+static DecodedTile *sTileNewest = NULL;
+static DecodedTile *sTileOldest = NULL;
+
+
+static int DecodeCacheMegabytes()
+{
+	static const char *env = getenv("DDS_DECODE_CACHE_MB");
+	
+	return crnlib::math::maximum<int>(0, env != NULL ? atoi(env) : DECODE_CACHE_DEFAULT_MB);
+}
+
+
+static crnlib::int64 DecodeCacheBudget(GPtr globals)
+{
+	if(gStuff->hostSig != 'FXTC')
+		return 0;
+	
+	return (crnlib::int64)DecodeCacheMegabytes() * 1024 * 1024;
+}
+
+
+// call with sDecodeCacheMutex held
+static DecodeCacheEntry * FindDecoded(const FileIdentity &id, crnlib::uint32 size_key)
+{
+	for(crnlib::uint i=0; i < sDecodeCache.size(); i++)
+	{
+		if(SameFile(sDecodeCache[i]->id, id) && sDecodeCache[i]->size_key == size_key)
+			return sDecodeCache[i];
+	}
+	
+	return NULL;
+}
+
+
+static crnlib::uint TileBucket(const FileIdentity &id, crnlib::uint face, crnlib::uint level, crnlib::uint tile_x, crnlib::uint tile_y)
+{
+	crnlib::uint64 h = id.file * 0x9E3779B97F4A7C15ULL + id.volume;
+	
+	h = (h ^ (h >> 29)) * 0xBF58476D1CE4E5B9ULL + ((crnlib::uint64)face << 40 | (crnlib::uint64)level << 32 | tile_y);
+	h = (h ^ (h >> 32)) * 0x94D049BB133111EBULL + tile_x;
+	
+	return (crnlib::uint)((h ^ (h >> 31)) & (sTileBuckets.size() - 1));
+}
+
+
+// call with sDecodeCacheMutex held
+static DecodedTile * FindTile(const FileIdentity &id, crnlib::uint face, crnlib::uint level, crnlib::uint tile_x, crnlib::uint tile_y)
+{
+	if(sTileBuckets.empty())
+		return NULL;
+	
+	for(DecodedTile *tile = sTileBuckets[TileBucket(id, face, level, tile_x, tile_y)]; tile != NULL; tile = tile->hash_next)
+	{
+		if(tile->tile_x == tile_x && tile->tile_y == tile_y && tile->level == level && tile->face == face && SameFile(tile->id, id))
+			return tile;
+	}
+	
+	return NULL;
+}
+
+
+// call with sDecodeCacheMutex held
+static void UnlinkTile(DecodedTile *tile)
+{
+	(tile->newer != NULL ? tile->newer->older : sTileNewest) = tile->older;
+	(tile->older != NULL ? tile->older->newer : sTileOldest) = tile->newer;
+	
+	tile->newer = tile->older = NULL;
+}
+
+
+// call with sDecodeCacheMutex held, tile not in the list
+static void LinkNewestTile(DecodedTile *tile)
+{
+	tile->newer = NULL;
+	tile->older = sTileNewest;
+	
+	(sTileNewest != NULL ? sTileNewest->newer : sTileOldest) = tile;
+	
+	sTileNewest = tile;
+	
+	tile->last_used = ++sDecodeCacheClock;
+}
+
+
+// call with sDecodeCacheMutex held
+static void TouchTile(DecodedTile *tile)
+{
+	UnlinkTile(tile);
+	LinkNewestTile(tile);
+}
+
+
+// call with sDecodeCacheMutex held, the cache owns tile now
+static void AddTile(DecodedTile *tile)
+{
+	if(sTileCount >= sTileBuckets.size())
+	{
+		// twice as many buckets, and everything rehashed into them
+		const crnlib::vector<DecodedTile *> old_buckets(sTileBuckets);
+		
+		sTileBuckets.resize(crnlib::math::maximum<crnlib::uint>(256, old_buckets.size() * 2));
+		
+		for(crnlib::uint i=0; i < sTileBuckets.size(); i++)
+			sTileBuckets[i] = NULL;
+		
+		for(crnlib::uint i=0; i < old_buckets.size(); i++)
+		{
+			DecodedTile *next = NULL;
+			
+			for(DecodedTile *t = old_buckets[i]; t != NULL; t = next)
+			{
+				next = t->hash_next;
+				
+				DecodedTile *&bucket = sTileBuckets[TileBucket(t->id, t->face, t->level, t->tile_x, t->tile_y)];
+				
+				t->hash_next = bucket;
+				bucket = t;
+			}
+		}
+	}
+	
+	DecodedTile *&bucket = sTileBuckets[TileBucket(tile->id, tile->face, tile->level, tile->tile_x, tile->tile_y)];
+	
+	tile->hash_next = bucket;
+	bucket = tile;
+	
+	LinkNewestTile(tile);
+	
+	sTileCount++;
+	sDecodeCacheBytes += tile->bytes;
+}
+
+
+// call with sDecodeCacheMutex held
+static void RemoveTile(DecodedTile *tile)
+{
+	DecodedTile **link = &sTileBuckets[TileBucket(tile->id, tile->face, tile->level, tile->tile_x, tile->tile_y)];
+	
+	while(*link != tile)
+		link = &(*link)->hash_next;
+	
+	*link = tile->hash_next;
+	
+	UnlinkTile(tile);
+	
+	sTileCount--;
+	sDecodeCacheBytes -= tile->bytes;
+	
+	crnlib::crnlib_delete(tile);
+}
+
+
+// call with sDecodeCacheMutex held
+static void TrimDecodeCache(crnlib::int64 budget)
+{
+	while(sDecodeCacheBytes > budget)
+	{
+		int oldest = -1;
+		
+		for(crnlib::uint i=0; i < sDecodeCache.size(); i++)
+		{
+			if(sDecodeCache[i]->pins == 0 &&
+				(oldest < 0 || sDecodeCache[i]->last_used < sDecodeCache[oldest]->last_used))
+			{
+				oldest = i;
+			}
+		}
+		
+		if(sTileOldest != NULL && (oldest < 0 || sTileOldest->last_used < sDecodeCache[oldest]->last_used))
+		{
+			RemoveTile(sTileOldest);
+			
+			continue;
+		}
+		
+		if(oldest < 0)
+			break; // everything's in use
+		
+		sDecodeCacheBytes -= sDecodeCache[oldest]->bytes;
+		
+		crnlib::crnlib_delete(sDecodeCache[oldest]);
+		
+		sDecodeCache[oldest] = sDecodeCache.back();
+		sDecodeCache.pop_back();
+	}
+}
+
+
+static bool PeekDecodeCache(const FileIdentity &id, crnlib::uint32 size_key, int &width, int &height, bool &has_alpha)
+{
+	crnlib::scoped_mutex lock(sDecodeCacheMutex);
+	
+	const DecodeCacheEntry *entry = FindDecoded(id, size_key);
+	
+	if(entry != NULL)
+	{
+		width = entry->img.get_width();
+		height = entry->img.get_height();
+		has_alpha = entry->has_alpha;
+	}
+	
+	return (entry != NULL);
+}
+
+
+static DecodeCacheEntry * PinDecoded(const FileIdentity &id, crnlib::uint32 size_key)
+{
+	crnlib::scoped_mutex lock(sDecodeCacheMutex);
+	
+	DecodeCacheEntry *entry = FindDecoded(id, size_key);
+	
+	if(entry != NULL)
+	{
+		entry->pins++;
+		entry->last_used = ++sDecodeCacheClock;
+	}
+	
+	return entry;
+}
+
+
+static void UnpinDecoded(DecodeCacheEntry *entry)
+{
+	crnlib::scoped_mutex lock(sDecodeCacheMutex);
+	
+	assert(entry->pins > 0);
+	
+	entry->pins--;
+}
+
+
+// takes img's pixels and returns the entry pinned, or NULL if it won't fit
+static DecodeCacheEntry * AddDecoded(GPtr globals, const FileIdentity &id, crnlib::uint32 size_key, crnlib::image_u8 &img, bool has_alpha)
+{
+	const crnlib::int64 budget = DecodeCacheBudget(globals);
+	
+	const crnlib::int64 bytes = (crnlib::int64)img.get_pitch() * img.get_height() * sizeof(crnlib::color_quad_u8);
+	
+	if(bytes > budget)
+		return NULL;
+	
+	crnlib::scoped_mutex lock(sDecodeCacheMutex);
+	
+	if(FindDecoded(id, size_key) != NULL)
+		return NULL; // someone beat us to it
+	
+	TrimDecodeCache(budget - bytes);
+	
+	DecodeCacheEntry *entry = crnlib::crnlib_new<DecodeCacheEntry>();
+	
+	entry->id = id;
+	entry->size_key = size_key;
+	entry->img.swap(img);
+	entry->has_alpha = has_alpha;
+	entry->bytes = bytes;
+	entry->last_used = ++sDecodeCacheClock;
+	entry->pins = 1;
+	
+	sDecodeCache.push_back(entry);
+	
+	sDecodeCacheBytes += bytes;
+	
+	return entry;
+}
+
+
+// Region reads
+//   A RegionReader returns any rectangle of any level and face of a plain
+//   DXT1-5 file, decoding only the REGION_TILE_SIZE tiles that overlap it.
+//   In After Effects the decoded tiles go in the decode cache, so reading
+//   the same area of a file again doesn't decode it again.  Blocks come straight out
+//   of a memory mapping of the file when we can get one.
+
+#define REGION_TILE_SIZE		256		// pixels, a multiple of 4
+
+class MappedFile
+{
+public:
+	MappedFile(intptr_t dataFork);
+	~MappedFile();
+	
+	const crnlib::uint8 * data() const { return _data; } // NULL if we couldn't map it
+	crnlib::uint64 size() const { return _size; }
+
+private:
+	const crnlib::uint8 *_data;
+	crnlib::uint64 _size;
+#ifdef __PIMac__
+	int _fd;
+#else
+	HANDLE _mapping;
+#endif
+};
+
+
+MappedFile::MappedFile(intptr_t dataFork) :
+	_data(NULL),
+	_size(0)
+{
+#ifdef __PIMac__
+	_fd = -1;
+	
+	FSRef ref;
+	UInt8 path[PATH_MAX];
+	struct stat st;
+	
+	if(noErr == FSGetForkCBInfo((FSIORefNum)dataFork, 0, NULL, NULL, NULL, &ref, NULL) &&
+		noErr == FSRefMakePath(&ref, path, sizeof(path)))
+	{
+		_fd = open((const char *)path, O_RDONLY);
+	}
+	
+	if(_fd >= 0 && fstat(_fd, &st) == 0 && st.st_size > 0)
+	{
+		void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+		
+		if(p != MAP_FAILED)
+		{
+			_data = (const crnlib::uint8 *)p;
+			_size = st.st_size;
+		}
+	}
+#else
+	_mapping = CreateFileMapping((HANDLE)dataFork, NULL, PAGE_READONLY, 0, 0, NULL);
+	
+	if(_mapping != NULL)
+	{
+		LARGE_INTEGER file_size;
+		
+		const void *p = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0); // can fail in a 32-bit address space
+		
+		if(p != NULL && GetFileSizeEx((HANDLE)dataFork, &file_size))
+		{
+			_data = (const crnlib::uint8 *)p;
+			_size = file_size.QuadPart;
+		}
+		else if(p != NULL)
+			UnmapViewOfFile(p);
+	}
+#endif
+}
+
+
+MappedFile::~MappedFile()
+{
+#ifdef __PIMac__
+	if(_data != NULL)
+		munmap((void *)_data, _size);
+	
+	if(_fd >= 0)
+		close(_fd);
+#else
+	if(_data != NULL)
+		UnmapViewOfFile(_data);
+	
+	if(_mapping != NULL)
+		CloseHandle(_mapping);
+#endif
+}
+
+
+class RegionReader
+{
+public:
+	RegionReader(GPtr globals);
+	~RegionReader() {};
+	
+	bool ok() const { return _ok; } // false if it's not a file we can read in pieces
+	const DDSHeader & header() const { return _header; }
+	
+	// the region is as big as out
+	bool read(crnlib::uint face, crnlib::uint level, crnlib::uint x, crnlib::uint y, crnlib::image_u8 &out);
+
+private:
+	bool decode_tile(crnlib::uint face, crnlib::uint level, crnlib::uint tile_x, crnlib::uint tile_y, crnlib::image_u8 &img);
+	void copy_tile(const crnlib::image_u8 &tile, crnlib::uint tile_left, crnlib::uint tile_top,
+					crnlib::uint x, crnlib::uint y, crnlib::image_u8 &out);
+	
+	GPtr _globals;
+	ps_data_stream _stream;
+	MappedFile _mapped;
+	DDSHeader _header;
+	FileIdentity _id;
+	crnlib::int64 _budget;
+	bool _ok;
+};
+
+
+RegionReader::RegionReader(GPtr globals) :
+	_globals(globals),
+	_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable, globals),
+	_mapped(gStuff->dataFork),
+	_budget(0),
+	_ok(false)
+{
+	_ok = (ReadDDSHeader(_stream, _header) && _header.format != crnlib::PIXEL_FMT_INVALID);
+	
+	if(_ok && DecodeCacheBudget(globals) > 0 && GetFileIdentity(gStuff->dataFork, _id))
+		_budget = DecodeCacheBudget(globals);
+}
+
+
+bool
+RegionReader::read(crnlib::uint face, crnlib::uint level, crnlib::uint x, crnlib::uint y, crnlib::image_u8 &out)
+{
+	using namespace crnlib;
+	
+	if(!_ok || face >= (_header.cubemap ? 6U : 1U) || level >= _header.levels ||
+		x + out.get_width() > LevelDimension(_header.width, level) ||
+		y + out.get_height() > LevelDimension(_header.height, level))
+	{
+		return false;
+	}
+	
+	const uint first_x = x / REGION_TILE_SIZE;
+	const uint first_y = y / REGION_TILE_SIZE;
+	const uint last_x = (x + out.get_width() - 1) / REGION_TILE_SIZE;
+	const uint last_y = (y + out.get_height() - 1) / REGION_TILE_SIZE;
+	
+	for(uint tile_y = first_y; tile_y <= last_y; tile_y++)
+	{
+		for(uint tile_x = first_x; tile_x <= last_x; tile_x++)
+		{
+			if(_budget > 0)
+			{
+				scoped_mutex lock(sDecodeCacheMutex);
+				
+				DecodedTile *tile = FindTile(_id, face, level, tile_x, tile_y);
+				
+				if(tile != NULL)
+				{
+					TouchTile(tile);
+					
+					copy_tile(tile->img, tile_x * REGION_TILE_SIZE, tile_y * REGION_TILE_SIZE, x, y, out);
+					
+					continue;
+				}
+			}
+			
+			DecodedTile *tile = crnlib_new<DecodedTile>();
+			
+			if( !decode_tile(face, level, tile_x, tile_y, tile->img) )
+			{
+				crnlib_delete(tile);
+				
+				return false;
+			}
+			
+			copy_tile(tile->img, tile_x * REGION_TILE_SIZE, tile_y * REGION_TILE_SIZE, x, y, out);
+			
+			tile->bytes = (int64)tile->img.get_pitch() * tile->img.get_height() * sizeof(color_quad_u8);
+			
+			if(_budget > 0 && tile->bytes <= _budget)
+			{
+				scoped_mutex lock(sDecodeCacheMutex);
+				
+				if(FindTile(_id, face, level, tile_x, tile_y) == NULL)
+				{
+					TrimDecodeCache(_budget - tile->bytes);
+					
+					tile->id = _id;
+					tile->face = face;
+					tile->level = level;
+					tile->tile_x = tile_x;
+					tile->tile_y = tile_y;
+					
+					AddTile(tile);
+					
+					tile = NULL;
+				}
+			}
+			
+			if(tile != NULL)
+				crnlib_delete(tile);
+		}
+	}
+	
+	return true;
+}
+
+
+bool
+RegionReader::decode_tile(crnlib::uint face, crnlib::uint level, crnlib::uint tile_x, crnlib::uint tile_y, crnlib::image_u8 &img)
+{
+	using namespace crnlib;
+	
+	const uint level_width = LevelDimension(_header.width, level);
+	const uint level_height = LevelDimension(_header.height, level);
+	
+	const uint left = tile_x * REGION_TILE_SIZE;
+	const uint top = tile_y * REGION_TILE_SIZE;
+	const uint width = math::minimum<uint>(REGION_TILE_SIZE, level_width - left);
+	const uint height = math::minimum<uint>(REGION_TILE_SIZE, level_height - top);
+	
+	const uint blocks_x = (width + 3) / 4;
+	const uint blocks_y = (height + 3) / 4;
+	
+	uint64 face_bytes = 0, offset = DDS_HEADER_SIZE;
+	
+	for(uint l = 0; l < _header.levels; l++)
+	{
+		if(l < level)
+			offset += LevelBytes(_header, l);
+		
+		face_bytes += LevelBytes(_header, l);
+	}
+	
+	offset += face * face_bytes;
+	
+	const uint64 level_row_bytes = (uint64)((level_width + 3) / 4) * _header.block_bytes;
+	const uint tile_row_bytes = blocks_x * _header.block_bytes;
+	
+	offset += (uint64)(top / 4) * level_row_bytes + (left / 4) * _header.block_bytes;
+	
+	vector<dxt_image::element> elements(blocks_x * blocks_y * _header.block_bytes / sizeof(dxt_image::element));
+	
+	{
+		StageTimer timer(_globals, DDS_STAGE_READ);
+		
+		uint8 *dest = (uint8 *)elements.get_ptr();
+		
+		for(uint by = 0; by < blocks_y; by++, offset += level_row_bytes, dest += tile_row_bytes)
+		{
+			if(_mapped.data() != NULL)
+			{
+				if(offset + tile_row_bytes > _mapped.size())
+					return false;
+				
+				memcpy(dest, _mapped.data() + offset, tile_row_bytes);
+			}
+			else
+			{
+				if(!_stream.seek(offset, false) || _stream.read(dest, tile_row_bytes) != tile_row_bytes)
+					return false;
+			}
+		}
+		
+		timer.count((int64)blocks_y * tile_row_bytes, (int64)blocks_y * tile_row_bytes, (int64)width * height);
+	}
+	
+	StageTimer timer(_globals, DDS_STAGE_DECODE);
+	
+	dxt_image dxt;
+	
+	if(!dxt.init(pixel_format_helpers::get_dxt_format(_header.format), width, height, elements.size(), elements.get_ptr(), false) ||
+		!dxt.unpack(img))
+	{
+		return false;
+	}
+	
+	timer.count((int64)blocks_y * tile_row_bytes, (int64)width * height * sizeof(color_quad_u8), (int64)width * height);
+	
+	return true;
+}
+
+
+void
+RegionReader::copy_tile(const crnlib::image_u8 &tile, crnlib::uint tile_left, crnlib::uint tile_top,
+						crnlib::uint x, crnlib::uint y, crnlib::image_u8 &out)
+{
+	using namespace crnlib;
+	
+	const uint left = math::maximum(x, tile_left);
+	const uint top = math::maximum(y, tile_top);
+	const uint right = math::minimum(x + out.get_width(), tile_left + tile.get_width());
+	const uint bottom = math::minimum(y + out.get_height(), tile_top + tile.get_height());
+	
+	for(uint row = top; row < bottom; row++)
+	{
+		memcpy(out.get_scanline(row - y) + (left - x), tile.get_scanline(row - tile_top) + (left - tile_left),
+				(right - left) * sizeof(color_quad_u8));
+	}
+}
+
+
+// Write-behind
+//   In After Effects, with DDS_WRITE_BEHIND set to a number of frames, a
+//   save fetches the frame and leaves the mipmaps, compression and writing
+//   to a couple of threads of ours, so AE can get on with the next frame.
+//   Once that many frames are waiting, a save waits for room.  No save
+//   waits for its own frame, so a failure is kept with its file and reported
+//   once, by the next save to finish (whose own frame still goes ahead) or
+//   by a read of that file, which waits for it to be written.  The threads
+//   are never stopped, and keep us loaded.
+
+#define WRITE_BEHIND_THREADS	2
+
+typedef struct {
+	Globals				context;	// our copy, pointing at the record and result below
+	FormatRecord		record;		// a copy too, only good for what doesn't call the host
+	short				result;
+	Str255				error;
+	FileIdentity		id;
+	crnlib::image_u8	*img;
+	crnlib::uint64		source_hash;
+	bool				started;
+} WriteBehindJob;
+
+typedef struct {
+	FileIdentity		id;
+	short				result;
+	Str255				error;
+} WriteBehindError;
+
+static crnlib::mutex sWriteBehindMutex;
+static crnlib::vector<WriteBehindJob *> sWriteBehindJobs; // oldest first, queued or in progress
+static crnlib::vector<WriteBehindError> sWriteBehindErrors; // failed frames nobody has asked about yet
+static crnlib::semaphore *sWriteBehindQueued = NULL;
+static crnlib::semaphore *sWriteBehindRoom = NULL;
+static crnlib::semaphore *sWriteBehindDone = NULL; // released once for each waiter when a job finishes
+static int sWriteBehindWaiters = 0;
+static int sWriteBehindThreadCount = 0;
+
+
+static int WriteBehindFrames()
+{
+	static const char *env = getenv("DDS_WRITE_BEHIND");
+	
+	return crnlib::math::maximum<int>(0, env != NULL ? atoi(env) : 0);
+}
+
+
+static bool SameWriteBehindFile(const FileIdentity &a, const FileIdentity &b)
+{
+	return (a.volume == b.volume && a.file == b.file);
+}
+
+
+// call with sWriteBehindMutex held
+static void WakeWriteBehindWaiters()
+{
+	if(sWriteBehindWaiters > 0)
+	{
+		sWriteBehindDone->release(sWriteBehindWaiters);
+		
+		sWriteBehindWaiters = 0;
+	}
+}
+
+
+static void CompressAndWrite(GPtr globals, crnlib::mipmapped_texture &dds_file, crnlib::uint64 source_hash);
+
+static void RunWriteBehindJob(WriteBehindJob *job)
+{
+	GPtr globals = &job->context;
+	
+	{
+		TraceSpan span("WriteBehind");
+		
+		crnlib::mipmapped_texture dds_file;
+		
+		dds_file.assign(job->img); // dds_file owns img now
+		
+		CompressAndWrite(globals, dds_file, job->source_hash);
+	}
+	
+	CloseReopenedFile(gStuff->dataFork);
+	
+	FinishStats(globals);
+	WriteTrace();
+	
+	crnlib::scoped_mutex lock(sWriteBehindMutex);
+	
+	if(gResult != noErr)
+	{
+		WriteBehindError failed;
+		
+		failed.id = job->id;
+		failed.result = gResult;
+		memcpy(failed.error, job->error, sizeof(Str255));
+		
+		sWriteBehindErrors.push_back(failed);
+	}
+	
+	for(crnlib::uint i=0; i < sWriteBehindJobs.size(); i++)
+	{
+		if(sWriteBehindJobs[i] == job)
+		{
+			for(crnlib::uint j=i; j + 1 < sWriteBehindJobs.size(); j++)
+				sWriteBehindJobs[j] = sWriteBehindJobs[j + 1];
+			
+			sWriteBehindJobs.pop_back();
+			
+			break;
+		}
+	}
+	
+	crnlib::crnlib_delete(job);
+	
+	WakeWriteBehindWaiters();
+}
+
+
+#ifdef __PIMac__
+static void * WriteBehindThread(void *arg)
+#else
+static DWORD WINAPI WriteBehindThread(LPVOID arg)
+#endif
+{
+	while(true)
+	{
+		sWriteBehindQueued->wait();
+		
+		WriteBehindJob *job = NULL;
+		
+		{
+			crnlib::scoped_mutex lock(sWriteBehindMutex);
+			
+			for(crnlib::uint i=0; i < sWriteBehindJobs.size() && job == NULL; i++)
+			{
+				if(!sWriteBehindJobs[i]->started)
+					job = sWriteBehindJobs[i];
+			}
+			
+			assert(job != NULL);
+			
+			job->started = true;
+		}
+		
+		sWriteBehindRoom->release();
+		
+		RunWriteBehindJob(job);
+	}
+	
+	return 0;
+}
+
+
+// call with sWriteBehindMutex held
+static bool StartWriteBehindThreads()
+{
+	if(sWriteBehindQueued != NULL)
+		return (sWriteBehindThreadCount > 0);
+	
+	if( !KeepPluginLoaded() )
+		return false;
+	
+	const int frames = WriteBehindFrames();
+	
+	sWriteBehindQueued = crnlib::crnlib_new<crnlib::semaphore>(0, frames + WRITE_BEHIND_THREADS);
+	sWriteBehindRoom = crnlib::crnlib_new<crnlib::semaphore>(frames, frames);
+	sWriteBehindDone = crnlib::crnlib_new<crnlib::semaphore>(0, 0x7fffffff);
+	
+	for(int i=0; i < WRITE_BEHIND_THREADS; i++)
+	{
+#ifdef __PIMac__
+		pthread_t thread;
+		
+		if(0 == pthread_create(&thread, NULL, WriteBehindThread, NULL))
+		{
+			pthread_detach(thread);
+			
+			sWriteBehindThreadCount++;
+		}
+#else
+		HANDLE thread = CreateThread(NULL, 0, WriteBehindThread, NULL, 0, NULL);
+		
+		if(thread != NULL)
+		{
+			CloseHandle(thread);
+			
+			sWriteBehindThreadCount++;
+		}
+#endif
+	}
+	
+	return (sWriteBehindThreadCount > 0);
+}
+
+
+// call with sWriteBehindMutex held
+static bool WritingBehind(const FileIdentity *id)
+{
+	for(crnlib::uint i=0; i < sWriteBehindJobs.size(); i++)
+	{
+		if(id == NULL || SameWriteBehindFile(sWriteBehindJobs[i]->id, *id))
+			return true;
+	}
+	
+	return false;
+}
+
+
+// wait until nothing for this file (or any file, if id is NULL) is in the queue
+static void DrainWriteBehind(const FileIdentity *id)
+{
+	while(true)
+	{
+		{
+			crnlib::scoped_mutex lock(sWriteBehindMutex);
+			
+			if( !WritingBehind(id) )
+				return;
+			
+			sWriteBehindWaiters++;
+		}
+		
+		sWriteBehindDone->wait();
+	}
+}
+
+
+// true if the frame is queued, in which case the queue owns img
+static bool QueueWriteBehind(GPtr globals, crnlib::image_u8 *img, crnlib::uint64 source_hash)
+{
+	if(gStuff->hostSig != 'FXTC' || WriteBehindFrames() == 0)
+		return false;
+	
+	{
+		crnlib::scoped_mutex lock(sWriteBehindMutex);
+		
+		if( !StartWriteBehindThreads() )
+			return false;
+	}
+	
+	const intptr_t fork = ReopenFile(gStuff->dataFork, true);
+	
+	if(fork == 0)
+		return false;
+	
+	WriteBehindJob *job = crnlib::crnlib_new<WriteBehindJob>();
+	
+	job->context = *globals;
+	job->record = *gStuff;
+	job->result = noErr;
+	job->error[0] = 0;
+	job->img = img;
+	job->source_hash = source_hash;
+	job->started = false;
+	
+	job->record.dataFork = fork;
+	job->record.data = NULL;
+	job->record.errorString = &job->error;
+	
+	job->context.result = &job->result;
+	job->context.formatParamBlock = &job->record;
+	
+	{
+		TraceSpan span("WriteBehindWait");
+		
+		// an earlier save of the same file goes first
+		if( GetFileIdentity(fork, job->id) )
+			DrainWriteBehind(&job->id);
+		else
+			memset(&job->id, 0, sizeof(job->id));
+	
+		sWriteBehindRoom->wait();
+	}
+	
+	{
+		crnlib::scoped_mutex lock(sWriteBehindMutex);
+		
+		sWriteBehindJobs.push_back(job);
+	}
+	
+	sWriteBehindQueued->release();
+	
+	return true;
+}
+
+
+// a failed frame, this file's or else whichever failed first
+static void ReportWriteBehindError(GPtr globals, const FileIdentity *id)
+{
+	crnlib::scoped_mutex lock(sWriteBehindMutex);
+	
+	for(crnlib::uint i=0; i < sWriteBehindErrors.size(); i++)
+	{
+		if(id == NULL || SameWriteBehindFile(sWriteBehindErrors[i].id, *id))
+		{
+			const WriteBehindError failed = sWriteBehindErrors[i];
+			
+			for(crnlib::uint j=i; j + 1 < sWriteBehindErrors.size(); j++)
+				sWriteBehindErrors[j] = sWriteBehindErrors[j + 1];
+			
+			sWriteBehindErrors.pop_back();
+			
+			if(failed.result == errReportString)
+			{
+				const char *prefix = (id == NULL ? "A queued frame failed to save: " : "This file failed to save: ");
+				
+				const int prefix_size = strlen(prefix);
+				const int size = crnlib::math::minimum<int>(255, prefix_size + failed.error[0]);
+				
+				Str255 p_str;
+				p_str[0] = size;
+				memcpy(&p_str[1], prefix, prefix_size);
+				memcpy(&p_str[1 + prefix_size], &failed.error[1], size - prefix_size);
+				
+				PIReportError(p_str);
+			}
+			
+			gResult = failed.result;
+			
+			break;
+		}
+	}
+}
+
+
+// wait for this file to be written if it's still in the queue, and say if that failed
+static void WaitForWriteBehind(GPtr globals)
+{
+	FileIdentity id;
+	
+	if(WriteBehindFrames() == 0 || !GetFileIdentity(gStuff->dataFork, id))
+		return;
+	
+	{
+		TraceSpan span("WaitForWriteBehind");
+		
+		DrainWriteBehind(&id);
+	}
+	
+	ReportWriteBehindError(globals, &id);
+}
+
+
+#pragma mark-
+
+
+static void DoFilterFile(GPtr globals)
+{
+	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable);
+
+	crnlib::data_stream_serializer serializer(&ps_stream);
+
+	// copied from mipmapped_texture::read_dds_internal()
+	uint8 hdr[4];
+	if(!serializer.read(hdr, sizeof(hdr)))
+		gResult = formatCannotRead;
+	else if(memcmp(hdr, "DDS ", 4) != 0)
+		gResult = formatCannotRead;
+	else
+		StartSpeculativeRead(globals);
+}
+
+
+// Additional parameter functions
+//   These transfer settings to and from gStuff->revertInfo
+
+static void TwiddleOptions(DDS_inData *options)
+{
+#ifndef __PIMacPPC__
+	// none
+#endif
+}
+
+static void TwiddleOptions(DDS_outData *options)
+{
+#ifndef __PIMacPPC__
+	// none
+#endif
+}
+
+template <typename T>
+static bool ReadParams(GPtr globals, T *options)
+{
+	bool found_revert = FALSE;
+	
+	if( gStuff->revertInfo != NULL )
+	{
+		if( myGetHandleSize(globals, gStuff->revertInfo) == sizeof(T) )
+		{
+			T *flat_options = (T *)myLockHandle(globals, gStuff->revertInfo);
+			
+			// flatten and copy
+			TwiddleOptions(flat_options);
+			
+			memcpy((char*)options, (char*)flat_options, sizeof(T) );
+			
+			TwiddleOptions(flat_options);
+			
+			myUnlockHandle(globals, gStuff->revertInfo);
+			
+			found_revert = TRUE;
+		}
+	}
+	
+	return found_revert;
+}
+
+template <typename T>
+static void WriteParams(GPtr globals, T *options)
+{
+	T *flat_options = NULL;
+	
+	if(gStuff->hostNewHdl != NULL) // we have the handle function
+	{
+		if(gStuff->revertInfo == NULL)
+		{
+			gStuff->revertInfo = myNewHandle(globals, sizeof(T) );
+		}
+		else
+		{
+			if(myGetHandleSize(globals, gStuff->revertInfo) != sizeof(T)  )
+				mySetHandleSize(globals, gStuff->revertInfo, sizeof(T) );
+		}
+		
+		flat_options = (T *)myLockHandle(globals, gStuff->revertInfo);
+		
+		// flatten and copy
+		TwiddleOptions(flat_options);
+		
+		memcpy((char*)flat_options, (char*)options, sizeof(T) );	
+		
+		TwiddleOptions(flat_options);
+			
+		
+		myUnlockHandle(globals, gStuff->revertInfo);
+	}
+}
+
+
+static void HandleError(GPtr globals, const crnlib::mipmapped_texture &dds_file)
+{
+	if(gResult != noErr)
+		return; // canceled, crnlib's error is just the fallout
+
+	const crnlib::dynamic_string &err = dds_file.get_last_error();
+
+	const int size = crnlib::math::minimum<int>(255, err.get_len());
+
+	Str255 p_str;
+	p_str[0] = size;
+	strncpy((char *)&p_str[1], err.c_str(), size);
+
+	PIReportError(p_str);
+	gResult = errReportString;
+}
+
+
+static void HandleError(GPtr globals, const char *errStr)
+{
+	const int size = crnlib::math::minimum<int>(255, strlen(errStr));
+
+	Str255 p_str;
+	p_str[0] = size;
+	strncpy((char *)&p_str[1], errStr, size);
+
+	PIReportError(p_str);
+	gResult = errReportString;
+}
+
+
+// Reference texture
+//   The DDS most recently opened or saved, still compressed.  When the
+//   next save has the same layout and format, blocks whose pixels haven't
+//   changed are copied from here instead of being compressed again, which
+//   is faster and avoids generation loss on re-save.
+//   After a save in After Effects we also keep the pixels that were
+//   compressed, up to REFERENCE_SOURCE_MAX_MB, so the next frame of a
+//   sequence can be compared with the last frame's source rather than its
+//   lossy blocks.  Saves only read the reference, so several write-behind
+//   frames can use it at once; the last one out deletes a replaced one.
+
+#define REFERENCE_SOURCE_MAX_MB		256
+
+typedef struct {
+	crnlib::mipmapped_texture	packed;
+	crnlib::mipmapped_texture	source;	// unpacked levels packed came from, empty after a read
+	int							filter;	// DDS_Filter that made its mipmaps, -1 if we didn't make them
+	int							users;	// saves using it right now, under sReferenceMutex
+} ReferenceTexture;
+
+static crnlib::mutex sReferenceMutex;
+static ReferenceTexture *sReference = NULL;
+
+
+static bool CanReuseBlocks(crnlib::pixel_format fmt)
+{
+	using namespace crnlib;
+	
+	// the swizzled DXT5 variants are cooked before packing, so skip those
+	return (fmt == PIXEL_FMT_DXT1 || fmt == PIXEL_FMT_DXT1A ||
+			fmt == PIXEL_FMT_DXT2 || fmt == PIXEL_FMT_DXT3 ||
+			fmt == PIXEL_FMT_DXT4 || fmt == PIXEL_FMT_DXT5 ||
+			fmt == PIXEL_FMT_DXT5A || fmt == PIXEL_FMT_3DC ||
+			fmt == PIXEL_FMT_DXN);
+}
+
+
+// call with sReferenceMutex held
+static void DropReference()
+{
+	if(sReference != NULL && sReference->users == 0)
+		crnlib::crnlib_delete(sReference);
+	
+	sReference = NULL; // otherwise its last user deletes it
+}
+
+
+// copy when the caller still needs dds_file, otherwise take it, and source too if there is one
+static void KeepReference(crnlib::mipmapped_texture &dds_file, bool copy, int filter = -1,
+							crnlib::mipmapped_texture *source = NULL)
+{
+	using namespace crnlib;
+	
+	crnlib::scoped_mutex lock(sReferenceMutex);
+	
+	if(dds_file.is_valid() && dds_file.is_packed() && CanReuseBlocks(dds_file.get_format()))
+	{
+		TraceSpan span("KeepReference");
+	
+		if(sReference != NULL && sReference->users > 0)
+			DropReference();
+	
+		if(sReference == NULL)
+		{
+			sReference = crnlib_new<ReferenceTexture>();
+			
+			sReference->users = 0;
+		}
+		
+		if(copy)
+			sReference->packed = dds_file;
+		else
+			sReference->packed.swap(dds_file);
+		
+		sReference->filter = filter;
+		
+		sReference->source.clear();
+		
+		if(source != NULL && source->get_num_faces() == sReference->packed.get_num_faces())
+			sReference->source.swap(*source);
+	}
+	else
+		DropReference();
+}
+
+
+// if it matches, the reference is ours to read until ReleaseReference()
+static const ReferenceTexture * TakeReference(const crnlib::mipmapped_texture &dds_file, crnlib::pixel_format fmt)
+{
+	crnlib::scoped_mutex lock(sReferenceMutex);
+	
+	ReferenceTexture *reference = sReference;
+	
+	if(reference != NULL &&
+		reference->packed.get_format() == fmt &&
+		reference->packed.get_num_faces() == dds_file.get_num_faces() &&
+		reference->packed.get_width() == dds_file.get_width() &&
+		reference->packed.get_height() == dds_file.get_height())
+	{
+		reference->users++;
+		
+		return reference;
+	}
+	
+	return NULL;
+}
+
+
+static void ReleaseReference(const ReferenceTexture *reference)
+{
+	crnlib::scoped_mutex lock(sReferenceMutex);
+	
+	ReferenceTexture *ref = const_cast<ReferenceTexture *>(reference);
+	
+	ref->users--;
+	
+	if(ref->users == 0 && ref != sReference)
+		crnlib::crnlib_delete(ref);
+}
+
+
+// rows per AdvanceState() or ReadProc() call
+#define ADVANCE_BAND_HEIGHT		256
+
+// bigger than this on a side and we don't hold the whole image, where we can help it
+#define IN_MEMORY_MAX_SIZE		8192
+
+
+static crnlib::uint ReadScale(GPtr globals)
+{
+	return crnlib::math::maximum<crnlib::uint>(1, gInOptions.scale);
+}
+
+
+static bool ReadFullSize(GPtr globals)
+{
+	return (gInOptions.preview == 0 && ReadScale(globals) == 1);
+}
+
+
+static void PlanRead(GPtr globals, crnlib::uint width, crnlib::uint height, crnlib::uint levels, ReadPlan &plan)
+{
+	PlanRead(width, height, levels, ReadScale(globals), gInOptions.preview, plan);
+}
+
+
+// decoded images are cached separately for each read size
+static crnlib::uint32 ReadSizeKey(GPtr globals)
+{
+	return ((crnlib::uint32)gInOptions.preview << 8) | ReadScale(globals);
+}
+
+
+static void DoReadPrepare(GPtr globals)
+{
+	gStuff->maxData = 0;
+}
+
+
+static void DoReadStart(GPtr globals)
+{
+	WaitForWriteBehind(globals);
+	
+	if(gResult != noErr)
+		return;
+	
+	const bool reverting = ReadParams(globals, &gInOptions);
+	
+	if(!reverting)
+	{
+		gInOptions.scale = 1;
+		gInOptions.preview = 0;
+	}
+	
+	const bool allow_dialog = ReadScriptParamsOnRead(globals);
+	
+	if(gResult != noErr)
+	{
+		DiscardSpeculativeRead();
+		
+		return;
+	}
+	
+
+	crnlib::mipmapped_texture dds_file;
+	
+	int width = 0, height = 0;
+	bool has_alpha = false;
+	bool gray = false;
+	
+	FileIdentity id;
+	
+	bool read_ok = (DecodeCacheBudget(globals) > 0 && GetFileIdentity(gStuff->dataFork, id) &&
+					PeekDecodeCache(id, ReadSizeKey(globals), width, height, has_alpha));
+	
+	if(!read_ok)
+	{
+		ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable);
+		
+		DDSHeader header;
+		
+		if(ReadDDSHeader(ps_stream, header) && !header.cubemap &&
+			(header.format != crnlib::PIXEL_FMT_INVALID || header.layout != DDS_LAYOUT_NONE))
+		{
+			// no need to read the whole file just to get the size
+			ReadPlan plan;
+			
+			PlanRead(globals, header.width, header.height, header.levels, plan);
+			
+			width = plan.width;
+			height = plan.height;
+			
+			if(header.format == crnlib::PIXEL_FMT_DXT1)
+			{
+				crnlib::dxt_image dxt;
+				
+				read_ok = ReadDDSLevel(ps_stream, header, plan.level, dxt);
+				
+				has_alpha = (read_ok && DXT1HasAlpha(dxt));
+			}
+			else
+			{
+				read_ok = true;
+				has_alpha = (header.layout == DDS_LAYOUT_NONE || LayoutHasAlpha(header.layout));
+			}
+			
+			gray = (GrayLayout(header.layout) && gStuff->hostSig != 'FXTC');
+			
+			if(gray)
+				has_alpha = (header.layout == DDS_LAYOUT_A8L8); // A8's one channel is the gray
+		}
+		else
+		{
+			ps_stream.seek(0, false);
+		
+			crnlib::data_stream_serializer serializer(&ps_stream);
+
+			read_ok = dds_file.read_dds(serializer);
+			
+			if(read_ok)
+			{
+				if(dds_file.determine_texture_type() == crnlib::cTextureTypeCubemap)
+				{
+					width = dds_file.get_width() * 3;
+					height = dds_file.get_height() * 4;
+				}
+				else
+				{
+					ReadPlan plan;
+					
+					PlanRead(globals, dds_file.get_width(), dds_file.get_height(), dds_file.get_num_levels(), plan);
+					
+					width = plan.width;
+					height = plan.height;
+				}
+				
+				has_alpha = dds_file.has_alpha();
+				
+				gray = (dds_file.get_format() == crnlib::PIXEL_FMT_DXT5A &&
+						dds_file.determine_texture_type() != crnlib::cTextureTypeCubemap && gStuff->hostSig != 'FXTC');
+				
+				if(gray)
+					has_alpha = false;
+				
+				assert(dds_file.get_num_faces() == 1);
+			}
+		}
+	}
+
+	if(read_ok)
+	{
+		gStuff->imageMode = (gray ? plugInModeGrayScale : plugInModeRGBColor);
+		gStuff->depth = 8;
+
+		if(gStuff->HostSupports32BitCoordinates)
+			gStuff->PluginUsing32BitCoordinates = TRUE;
+		
+		gStuff->imageSize.h = gStuff->imageSize32.h = width;
+		gStuff->imageSize.v = gStuff->imageSize32.v = height;
+		
+		gStuff->planes = (gray ? 1 : 3) + (has_alpha ? 1 : 0);
+		
+		
+		if(!reverting && gStuff->hostSig != 'FXTC')
+		{
+			DDS_InUI_Data params;
+			
+		#ifdef __PIMac__
+			const char * const plugHndl = "com.fnordware.Photoshop.DDS";
+			const void *hwnd = globals;
+		#else
+			const HINSTANCE const plugHndl = GetDLLInstance((SPPluginRef)gStuff->plugInRef);
+			HWND hwnd = (HWND)((PlatformData *)gStuff->platformData)->hwnd;
+		#endif
+			
+			// DDS_InUI is responsible for not popping a dialog if the user
+			// didn't request it, or a script said not to.  It still has to set the read settings from preferences though.
+			bool result = DDS_InUI(&params, has_alpha, allow_dialog, plugHndl, hwnd);
+			
+			if(result)
+			{
+				gInOptions.alpha = params.alpha;
+				
+				WriteParams(globals, &gInOptions);
+			}
+			else
+				gResult = userCanceledErr;
+		}
+		
+		if(gInOptions.alpha == DDS_ALPHA_TRANSPARENCY && has_alpha)
+		{
+			gStuff->transparencyPlane = gStuff->planes - 1;
+			gStuff->transparencyMatting = 0;
+		}
+	}
+	else
+		HandleError(globals, dds_file);
+	
+	if(gResult != noErr)
+		DiscardSpeculativeRead(); // not opening after all
+}
+
+
+// reads only the mip level we need, straight from the file
+static bool ReadScaled(GPtr globals, crnlib::image_u8 &img)
+{
+	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable, globals);
+	
+	DDSHeader header;
+	
+	if(!ReadDDSHeader(ps_stream, header) || header.format == crnlib::PIXEL_FMT_INVALID || header.cubemap)
+		return false;
+	
+	ReadPlan plan;
+	
+	PlanRead(globals, header.width, header.height, header.levels, plan);
+	
+	crnlib::dxt_image dxt;
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_READ);
+		
+		if( !ReadDDSLevel(ps_stream, header, plan.level, dxt) )
+			return false;
+		
+		timer.count(ps_stream.get_ofs(), dxt.get_size_in_bytes(), (int64)dxt.get_width() * dxt.get_height());
+	}
+	
+	if( CheckAbort(globals) )
+		return false;
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_DECODE);
+		
+		if( !DecodePlanned(dxt, plan, img) )
+			return false;
+		
+		timer.count(dxt.get_size_in_bytes(), (int64)img.get_total_pixels() * sizeof(crnlib::color_quad_u8), img.get_total_pixels());
+	}
+	
+	return true;
+}
+
+
+// the planned level of an uncompressed file, unpacked without read_dds()
+static bool ReadUncompressed(GPtr globals, crnlib::image_u8 &img)
+{
+	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable, globals);
+	
+	DDSHeader header;
+	
+	if(!ReadDDSHeader(ps_stream, header) || header.layout == DDS_LAYOUT_NONE || header.cubemap)
+		return false;
+	
+	ReadPlan plan;
+	
+	PlanRead(globals, header.width, header.height, header.levels, plan);
+	
+	crnlib::vector<crnlib::uint8> data;
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_READ);
+		
+		if( !ReadUncompressedLevel(ps_stream, header, plan.level, data) )
+			return false;
+		
+		timer.count(ps_stream.get_ofs(), data.size(), (crnlib::int64)data.size() / header.pixel_bytes);
+	}
+	
+	if( CheckAbort(globals) )
+		return false;
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_DECODE);
+		
+		if( !UnpackLevel(header, plan.level, data, img) )
+			return false;
+		
+		if(plan.reduce > 1)
+		{
+			crnlib::image_u8 reduced;
+			
+			BoxReduceImage(img, plan.reduce, reduced);
+			
+			img.swap(reduced);
+		}
+		
+		timer.count(data.size(), (crnlib::int64)img.get_total_pixels() * sizeof(crnlib::color_quad_u8), img.get_total_pixels());
+	}
+	
+	return true;
+}
+
+
+// A full size grayscale file is already laid out the way a grayscale document
+// wants it, so the level goes straight from the file to the host.
+static bool ReadGrayDirect(GPtr globals)
+{
+	ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable, globals);
+	
+	DDSHeader header;
+	
+	if(!ReadDDSHeader(ps_stream, header) || !GrayLayout(header.layout) || header.cubemap || (int)header.pixel_bytes != gStuff->planes)
+		return false;
+	
+	ReadPlan plan;
+	
+	PlanRead(globals, header.width, header.height, header.levels, plan);
+	
+	if(plan.level != 0 || plan.reduce != 1)
+		return false;
+	
+	crnlib::vector<crnlib::uint8> data;
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_READ);
+		
+		if( !ReadUncompressedLevel(ps_stream, header, 0, data) )
+			return false;
+		
+		timer.count(ps_stream.get_ofs(), data.size(), (crnlib::int64)data.size() / header.pixel_bytes);
+	}
+	
+	StageTimer timer(globals, DDS_STAGE_HANDOFF);
+	
+	const int width = header.width;
+	const int height = header.height;
+	
+	gStuff->planeBytes = 1;
+	gStuff->colBytes = gStuff->planeBytes * header.pixel_bytes;
+	gStuff->rowBytes = RowBytes(header, 0); // the host is fine with padded rows
+	
+	gStuff->loPlane = 0;
+	gStuff->hiPlane = gStuff->planes - 1;
+	
+	gStuff->theRect.left = gStuff->theRect32.left = 0;
+	gStuff->theRect.right = gStuff->theRect32.right = width;
+	
+	for(int y = 0; y < height && gResult == noErr; y += ADVANCE_BAND_HEIGHT)
+	{
+		const int band_bottom = crnlib::math::minimum<int>(height, y + ADVANCE_BAND_HEIGHT);
+		
+		gStuff->theRect.top = gStuff->theRect32.top = y;
+		gStuff->theRect.bottom = gStuff->theRect32.bottom = band_bottom;
+		
+		gStuff->data = data.get_ptr() + (size_t)y * gStuff->rowBytes;
+		
+		{
+			TraceSpan span("AdvanceState");
+			
+			gResult = AdvanceState();
+		}
+		
+		if(gResult == noErr)
+		{
+			const int64 band_pixels = (int64)width * (band_bottom - y);
+			
+			timer.count(band_pixels * gStuff->colBytes, band_pixels * gStuff->planes, band_pixels);
+			
+			CheckAbort(globals);
+		}
+	}
+	
+	return true;
+}
+
+
+// Everything else decodes to RGBA, where the gray is in red (all the
+// grayscale formats unpack with r=g=b) and the alpha where it always is.
+static void GrayBand(const crnlib::image_u8 &img, int y, int rows, int planes, crnlib::vector<crnlib::uint8> &band)
+{
+	const int width = img.get_width();
+	
+	band.resize(width * rows * planes);
+	
+	crnlib::uint8 *out = band.get_ptr();
+	
+	for(int r = 0; r < rows; r++)
+	{
+		const crnlib::color_quad_u8 *in = img.get_scanline(y + r);
+		
+		if(planes == 2)
+		{
+			for(int x = 0; x < width; x++)
+			{
+				out[x * 2 + 0] = in[x].r;
+				out[x * 2 + 1] = in[x].a;
+			}
+		}
+		else
+		{
+			for(int x = 0; x < width; x++)
+				out[x] = in[x].r;
+		}
+		
+		out += width * planes;
+	}
+}
+
+
+// Hands the top level over a band at a time as it's decoded, for files
+// too big to decode in one piece.
+static void ReadInRegions(GPtr globals, RegionReader &reader)
+{
+	const int width = LevelDimension(reader.header().width, 0);
+	const int height = LevelDimension(reader.header().height, 0);
+	
+	gStuff->planeBytes = 1;
+	gStuff->colBytes = gStuff->planeBytes * 4;
+	
+	gStuff->loPlane = 0;
+	gStuff->hiPlane = gStuff->planes - 1;
+	
+	gStuff->theRect.left = gStuff->theRect32.left = 0;
+	gStuff->theRect.right = gStuff->theRect32.right = width;
+	
+	crnlib::image_u8 band(width, crnlib::math::minimum<int>(height, ADVANCE_BAND_HEIGHT));
+	
+	for(int y = 0; y < height && gResult == noErr; y += ADVANCE_BAND_HEIGHT)
+	{
+		const int band_bottom = crnlib::math::minimum<int>(height, y + ADVANCE_BAND_HEIGHT);
+		
+		if((int)band.get_height() != band_bottom - y)
+			band.resize(width, band_bottom - y);
+		
+		if( !reader.read(0, 0, 0, y, band) )
+		{
+			HandleError(globals, "Failed to read file");
+			
+			break;
+		}
+		
+		StageTimer timer(globals, DDS_STAGE_HANDOFF);
+		
+		gStuff->rowBytes = gStuff->colBytes * band.get_pitch();
+		
+		gStuff->theRect.top = gStuff->theRect32.top = y;
+		gStuff->theRect.bottom = gStuff->theRect32.bottom = band_bottom;
+
+		gStuff->data = band.get_pixels();
+		
+		{
+			TraceSpan span("AdvanceState");
+			
+			gResult = AdvanceState();
+		}
+		
+		if(gResult == noErr)
+		{
+			const int64 band_pixels = (int64)width * (band_bottom - y);
+		
+			timer.count(band_pixels * gStuff->colBytes, band_pixels * gStuff->planes, band_pixels);
+		
+			CheckAbort(globals);
+		}
+	}
+}
+
+
+static void DoReadContinue(GPtr globals)
+{
+	StartAbortChecks(globals);
+	StartStats(globals, DDS_SESSION_READ);
+	
+	const int image_width = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.h : gStuff->imageSize.h);
+	const int image_height = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.v : gStuff->imageSize.v);
+	
+	const crnlib::uint32 size_key = ReadSizeKey(globals);
+	
+	FileIdentity id;
+	
+	const bool use_cache = (DecodeCacheBudget(globals) > 0 && GetFileIdentity(gStuff->dataFork, id));
+	
+	DecodeCacheEntry *cached = (use_cache ? PinDecoded(id, size_key) : NULL);
+	
+	RegionReader *regions = NULL;
+	
+	if(cached == NULL && ReadFullSize(globals) && (image_width > IN_MEMORY_MAX_SIZE || image_height > IN_MEMORY_MAX_SIZE))
+	{
+		regions = crnlib::crnlib_new<RegionReader>(globals);
+		
+		if(!regions->ok() || regions->header().cubemap)
+		{
+			crnlib::crnlib_delete(regions);
+			
+			regions = NULL;
+		}
+	}
+	
+	MemoryPoolSession pool_session(gStuff->hostSig == 'FXTC');
+
+	crnlib::mipmapped_texture dds_file;
+	
+	crnlib::image_u8 img;
+	
+	crnlib::image_u8 *img_ptr = NULL;
+	
+	// the speculative read decoded the full size image
+	SpeculativeRead *speculative = (cached != NULL || regions != NULL || !ReadFullSize(globals) ? NULL : TakeSpeculativeRead(globals));
+	
+	const bool in_regions = (regions != NULL);
+	
+	const bool gray = (gStuff->imageMode == plugInModeGrayScale);
+	
+	bool handed_over = in_regions;
+	
+	if(cached != NULL)
+	{
+		img_ptr = &cached->img; // no reading or decoding at all
+	}
+	else if(in_regions)
+	{
+		ReadInRegions(globals, *regions); // hands it over as it goes
+		
+		crnlib::crnlib_delete(regions);
+	}
+	else if(gray && speculative == NULL && ReadGrayDirect(globals))
+	{
+		handed_over = true; // no decoding at all
+	}
+	else if(speculative != NULL)
+	{
+		KeepReference(speculative->dds_file, false);
+		
+		img.swap(speculative->img);
+		
+		img_ptr = &img;
+		
+		crnlib::crnlib_delete(speculative);
+	}
+	else if(ReadUncompressed(globals, img))
+	{
+		img_ptr = &img;
+		
+		if(use_cache)
+		{
+			cached = AddDecoded(globals, id, size_key, img, (gStuff->planes == 4));
+			
+			if(cached != NULL)
+				img_ptr = &cached->img;
+		}
+	}
+	else if(!ReadFullSize(globals) && ReadScaled(globals, img))
+	{
+		img_ptr = &img;
+	}
+	else
+	{
+		ps_data_stream ps_stream(gStuff->dataFork, crnlib::cDataStreamReadable | crnlib::cDataStreamSeekable, globals);
+
+		crnlib::data_stream_serializer serializer(&ps_stream);
+
+		bool read_ok = false;
+		
+		// only a full size read in Photoshop can be saved back over itself
+		const bool keep_reference = (gStuff->hostSig != 'FXTC' && ReadFullSize(globals));
+		
+		bool cubemap = false;
+		
+		{
+			StageTimer timer(globals, DDS_STAGE_READ);
+		
+			ps_stream.seek(0, false);
+			
+			read_ok = dds_file.read_dds(serializer);
+			
+			if(read_ok)
+				timer.count(ps_stream.get_ofs(), TextureBytes(dds_file), TexturePixels(dds_file));
+		}
+		
+		if( read_ok && !CheckAbort(globals) )
+		{
+			cubemap = (dds_file.determine_texture_type() == crnlib::cTextureTypeCubemap);
+			
+			if(cubemap)
+			{
+				if(keep_reference)
+					KeepReference(dds_file, true); // the faces, before they become a cross
+				
+				StageTimer timer(globals, DDS_STAGE_CUBEMAP);
+				
+				const int64 bytes_in = TextureBytes(dds_file);
+			
+				const bool converted = dds_file.cubemap_to_vertical_cross();
+				
+				assert(converted);
+				
+				timer.count(bytes_in, TextureBytes(dds_file), TexturePixels(dds_file));
+			}
+		}
+		
+		if( read_ok && !CheckAbort(globals) )
+		{
+			StageTimer timer(globals, DDS_STAGE_DECODE);
+			
+			ReadPlan plan = { 0, 1, 0, 0 }; // cube maps always come in full size
+			
+			if(!cubemap)
+				PlanRead(globals, dds_file.get_width(), dds_file.get_height(), dds_file.get_num_levels(), plan);
+			
+			img_ptr = dds_file.get_level_image(0, plan.level, img);
+			
+			if(img_ptr != NULL)
+			{
+				const crnlib::mip_level *level = dds_file.get_level(0, plan.level);
+				
+				const int64 bytes_in = (level->is_packed() ? level->get_dxt_image()->get_size_in_bytes() :
+															(int64)level->get_total_pixels() * sizeof(crnlib::color_quad_u8));
+				
+				if(plan.reduce > 1)
+				{
+					crnlib::image_u8 reduced;
+					
+					BoxReduceImage(*img_ptr, plan.reduce, reduced);
+					
+					img.swap(reduced);
+					
+					img_ptr = &img;
+				}
+			
+				timer.count(bytes_in, (int64)img_ptr->get_total_pixels() * sizeof(crnlib::color_quad_u8), img_ptr->get_total_pixels());
+			}
+		}
+		
+		// A packed texture was decoded into img, so it can go to the reference
+		// as it is.  Anything else only replaces the last one.
+		if(img_ptr != NULL && keep_reference && !cubemap)
+			KeepReference(dds_file, false);
+		
+		if(img_ptr != NULL && use_cache)
+		{
+			cached = AddDecoded(globals, id, size_key, *img_ptr, (gStuff->planes == 4));
+			
+			if(cached != NULL)
+				img_ptr = &cached->img;
+		}
+	}
+	
+	if(img_ptr != NULL)
+	{
+		StageTimer timer(globals, DDS_STAGE_HANDOFF);
+	
+		gStuff->planeBytes = 1;
+		gStuff->colBytes = gStuff->planeBytes * (gray ? gStuff->planes : 4);
+		gStuff->rowBytes = gStuff->colBytes * (gray ? img_ptr->get_width() : img_ptr->get_pitch());
+		
+		gStuff->loPlane = 0;
+		gStuff->hiPlane = gStuff->planes - 1;
+		
+		crnlib::vector<crnlib::uint8> gray_band;
+				
+		gStuff->theRect.left = gStuff->theRect32.left = 0;
+		gStuff->theRect.right = gStuff->theRect32.right = img_ptr->get_width();
+		assert(image_width == img_ptr->get_width());
+		assert(image_height == img_ptr->get_height());
+		
+		// hand the image over in bands so a cancel doesn't wait for all of it
+		const int height = img_ptr->get_height();
+		
+		for(int y = 0; y < height && gResult == noErr; y += ADVANCE_BAND_HEIGHT)
+		{
+			const int band_bottom = crnlib::math::minimum<int>(height, y + ADVANCE_BAND_HEIGHT);
+		
+			gStuff->theRect.top = gStuff->theRect32.top = y;
+			gStuff->theRect.bottom = gStuff->theRect32.bottom = band_bottom;
+
+			if(gray)
+			{
+				GrayBand(*img_ptr, y, band_bottom - y, gStuff->planes, gray_band);
+				
+				gStuff->data = gray_band.get_ptr();
+			}
+			else
+				gStuff->data = img_ptr->get_scanline(y);
+			
+			{
+				TraceSpan span("AdvanceState");
+				
+				gResult = AdvanceState();
+			}
+			
+			if(gResult == noErr)
+			{
+				const int64 band_pixels = (int64)img_ptr->get_width() * (band_bottom - y);
+			
+				timer.count(band_pixels * gStuff->colBytes, band_pixels * gStuff->planes, band_pixels);
+			
+				CheckAbort(globals);
+			}
+		}
+	}
+	else if(!handed_over)
+		HandleError(globals, dds_file);
+	
+	if(cached != NULL)
+		UnpinDecoded(cached);
+	
+	FinishAbortChecks(globals);
+	
+	FinishStats(globals);
+	WriteTrace();
+	
+	// very important!
+	gStuff->data = NULL;
+}
+
+
+static void DoReadFinish(GPtr globals)
+{
+	DiscardSpeculativeRead();
+}
+
+#pragma mark-
+
+static void DoOptionsPrepare(GPtr globals)
+{
+	gStuff->maxData = 0;
+	
+	StartStats(globals, DDS_SESSION_NONE); // don't report the last save's
+}
+
+
+static void DoOptionsStart(GPtr globals)
+{
+	ReadParams(globals, &gOptions);
+	
+	if( ReadScriptParamsOnWrite(globals) )
+	{
+		bool have_transparency = false;
+		const char *alpha_name = NULL;
+		
+		if(gStuff->hostSig == '8BIM')
+			have_transparency = (gStuff->documentInfo && gStuff->documentInfo->mergedTransparency);
+		else
+			have_transparency = (gStuff->planes == 2 || gStuff->planes == 4);
+
+			
+		if(gStuff->documentInfo && gStuff->documentInfo->alphaChannels)
+			alpha_name = gStuff->documentInfo->alphaChannels->name;
+	
+	
+		DDS_OutUI_Data params;
+		
+		params.format			= (gOptions.format == DDS_FMT_DXT1 ? DIALOG_FMT_DXT1 :
+									gOptions.format == DDS_FMT_DXT1A ? DIALOG_FMT_DXT1A :
+									gOptions.format == DDS_FMT_DXT2 ? DIALOG_FMT_DXT2 :
+									gOptions.format == DDS_FMT_DXT3 ? DIALOG_FMT_DXT3 :
+									gOptions.format == DDS_FMT_DXT4 ? DIALOG_FMT_DXT4 :
+									gOptions.format == DDS_FMT_DXT5 ? DIALOG_FMT_DXT5 :
+									gOptions.format == DDS_FMT_DXT5A ? DIALOG_FMT_DXT5A :
+									gOptions.format == DDS_FMT_3DC ? DIALOG_FMT_3DC :
+									gOptions.format == DDS_FMT_DXN ? DIALOG_FMT_DXN :
+									gOptions.format == DDS_FMT_UNCOMPRESSED ? DIALOG_FMT_UNCOMPRESSED :
+									gOptions.format == DDS_FMT_AUTO ? DIALOG_FMT_AUTO :
+									gOptions.format == DDS_FMT_R5G6B5 ? DIALOG_FMT_R5G6B5 :
+									gOptions.format == DDS_FMT_A1R5G5B5 ? DIALOG_FMT_A1R5G5B5 :
+									gOptions.format == DDS_FMT_A4R4G4B4 ? DIALOG_FMT_A4R4G4B4 :
+									gOptions.format == DDS_FMT_L8 ? DIALOG_FMT_L8 :
+									gOptions.format == DDS_FMT_A8 ? DIALOG_FMT_A8 :
+									gOptions.format == DDS_FMT_A8L8 ? DIALOG_FMT_A8L8 :
+									gOptions.format == DDS_FMT_DXT5_CCxY ? DIALOG_FMT_DXT5_CCxY :
+									gOptions.format == DDS_FMT_DXT5_xGxR ? DIALOG_FMT_DXT5_xGxR :
+									gOptions.format == DDS_FMT_DXT5_xGBR ? DIALOG_FMT_DXT5_xGBR :
+									gOptions.format == DDS_FMT_DXT5_AGBR ? DIALOG_FMT_DXT5_AGBR :
+									DIALOG_FMT_DXT5);
+
+		params.alpha			= (DialogAlpha)gOptions.alpha;
+		params.premultiply		= gOptions.premultiply;
+
+		params.mipmap			= gOptions.mipmap;
+
+		params.filter			= (gOptions.filter == DDS_FILTER_BOX ? DIALOG_FILTER_BOX :
+									gOptions.filter == DDS_FILTER_TENT ? DIALOG_FILTER_TENT :
+									gOptions.filter == DDS_FILTER_LANCZOS4 ? DIALOG_FILTER_LANCZOS4 :
+									gOptions.filter == DDS_FILTER_MITCHELL ? DIALOG_FILTER_MITCHELL :
+									gOptions.filter == DDS_FILTER_KAISER ? DIALOG_FILTER_KAISER :
+									DIALOG_FILTER_MITCHELL);
+								
+		params.cubemap			= gOptions.cubemap;
+	
+	#ifdef __PIMac__
+		const char * const plugHndl = "com.fnordware.Photoshop.DDS";
+		const void *hwnd = globals;	
+	#else
+		const HINSTANCE const plugHndl = GetDLLInstance((SPPluginRef)gStuff->plugInRef);
+		HWND hwnd = (HWND)((PlatformData *)gStuff->platformData)->hwnd;
+	#endif
+
+		const bool ae_ui = (gStuff->hostSig == 'FXTC');
+
+
+		bool result = DDS_OutUI(&params, have_transparency, alpha_name, ae_ui, plugHndl, hwnd);
+		
+		
+		if(result)
+		{
+			gOptions.format			= (params.format == DIALOG_FMT_DXT1 ? DDS_FMT_DXT1 :
+										params.format == DIALOG_FMT_DXT1A ? DDS_FMT_DXT1A :
+										params.format == DIALOG_FMT_DXT2 ? DDS_FMT_DXT2 :
+										params.format == DIALOG_FMT_DXT3 ? DDS_FMT_DXT3 :
+										params.format == DIALOG_FMT_DXT4 ? DDS_FMT_DXT4 :
+										params.format == DIALOG_FMT_DXT5 ? DDS_FMT_DXT5 :
+										params.format == DIALOG_FMT_DXT5A ? DDS_FMT_DXT5A :
+										params.format == DIALOG_FMT_3DC ? DDS_FMT_3DC :
+										params.format == DIALOG_FMT_DXN ? DDS_FMT_DXN :
+										params.format == DIALOG_FMT_UNCOMPRESSED ? DDS_FMT_UNCOMPRESSED :
+										params.format == DIALOG_FMT_AUTO ? DDS_FMT_AUTO :
+										params.format == DIALOG_FMT_R5G6B5 ? DDS_FMT_R5G6B5 :
+										params.format == DIALOG_FMT_A1R5G5B5 ? DDS_FMT_A1R5G5B5 :
+										params.format == DIALOG_FMT_A4R4G4B4 ? DDS_FMT_A4R4G4B4 :
+										params.format == DIALOG_FMT_L8 ? DDS_FMT_L8 :
+										params.format == DIALOG_FMT_A8 ? DDS_FMT_A8 :
+										params.format == DIALOG_FMT_A8L8 ? DDS_FMT_A8L8 :
+										params.format == DIALOG_FMT_DXT5_CCxY ? DDS_FMT_DXT5_CCxY :
+										params.format == DIALOG_FMT_DXT5_xGxR ? DDS_FMT_DXT5_xGxR :
+										params.format == DIALOG_FMT_DXT5_xGBR ? DDS_FMT_DXT5_xGBR :
+										params.format == DIALOG_FMT_DXT5_AGBR ? DDS_FMT_DXT5_AGBR :
+										DDS_FMT_DXT5);
+
+			gOptions.alpha			= params.alpha;
+			gOptions.premultiply	= params.premultiply;
+
+			gOptions.mipmap			= params.mipmap;
+
+			gOptions.filter			= (params.filter == DIALOG_FILTER_BOX ? DDS_FILTER_BOX :
+										params.filter == DIALOG_FILTER_TENT ? DDS_FILTER_TENT :
+										params.filter == DIALOG_FILTER_LANCZOS4 ? DDS_FILTER_LANCZOS4 :
+										params.filter == DIALOG_FILTER_MITCHELL ? DDS_FILTER_MITCHELL :
+										params.filter == DIALOG_FILTER_KAISER ? DDS_FILTER_KAISER :
+										DDS_FILTER_MITCHELL);
+										
+			gOptions.cubemap		= params.cubemap;
+			
+
+			WriteParams(globals, &gOptions);
+			WriteScriptParamsOnWrite(globals);
+		}
+		else
+			gResult = userCanceledErr;
+	}
+}
+
+
+static void DoOptionsContinue(GPtr globals)
+{
+
+}
+
+
+static void DoOptionsFinish(GPtr globals)
+{
+
+}
+
+#pragma mark-
+
+// the uncompressed formats we pack ourselves, DDS_LAYOUT_NONE for the rest
+static int PackedLayout(DDS_Format fmt)
+{
+	return (fmt == DDS_FMT_R5G6B5 ? DDS_LAYOUT_R5G6B5 :
+			fmt == DDS_FMT_A1R5G5B5 ? DDS_LAYOUT_A1R5G5B5 :
+			fmt == DDS_FMT_A4R4G4B4 ? DDS_LAYOUT_A4R4G4B4 :
+			fmt == DDS_FMT_L8 ? DDS_LAYOUT_L8 :
+			fmt == DDS_FMT_A8 ? DDS_LAYOUT_A8 :
+			fmt == DDS_FMT_A8L8 ? DDS_LAYOUT_A8L8 :
+			DDS_LAYOUT_NONE);
+}
+
+
+static int BlockBytes(DDS_Format fmt)
+{
+	return (fmt == DDS_FMT_DXT1 || fmt == DDS_FMT_DXT1A || fmt == DDS_FMT_DXT5A ? 8 :
+			fmt == DDS_FMT_UNCOMPRESSED ? 4 * 4 * 4 :
+			PackedLayout(fmt) != DDS_LAYOUT_NONE ? 4 * 4 * LayoutBytes(PackedLayout(fmt)) :
+			16);
+}
+
+
+// Size of the file a save will write: the header plus every level of every
+// face.  Exact for the compressed formats.  Uncompressed files might come
+// out smaller, if crnlib decides fewer than 32 bits per pixel will do.
+static crnlib::uint64 DDSFileSize(int width, int height, DDS_Format fmt, bool mipmap, bool cubemap)
+{
+	crnlib::uint64 size = DDS_HEADER_SIZE;
+	
+	const bool cross = (cubemap && width * 4 == height * 3);
+	
+	const int faces = (cross ? 6 : 1);
+	
+	const int face_width = (cross ? width / 3 : width);
+	const int face_height = (cross ? height / 4 : height);
+	
+	for(int f = 0; f < faces; f++)
+	{
+		int w = face_width;
+		int h = face_height;
+		
+		do{
+			if(fmt == DDS_FMT_UNCOMPRESSED)
+				size += (crnlib::uint64)w * h * 4;
+			else if(PackedLayout(fmt) != DDS_LAYOUT_NONE)
+				size += (crnlib::uint64)w * h * LayoutBytes(PackedLayout(fmt));
+			else
+				size += (crnlib::uint64)((w + 3) / 4) * ((h + 3) / 4) * BlockBytes(fmt);
+			
+			w = crnlib::math::maximum(1, w / 2);
+			h = crnlib::math::maximum(1, h / 2);
+			
+		}while(mipmap && (w > 1 || h > 1));
+	}
+	
+	return size;
+}
+
+
+// Past IN_MEMORY_MAX_SIZE, a compressed save that isn't a cube map goes a
+// band at a time instead of holding the whole image, see WriteTiled().
+// Only the formats with a plain fourcc, so we can write the header ourselves.
+
+static crnlib::uint32 TiledFourCC(DDS_Format fmt)
+{
+	return (fmt == DDS_FMT_DXT1 || fmt == DDS_FMT_DXT1A ? DDS_FOURCC('D','X','T','1') :
+			fmt == DDS_FMT_DXT2 ? DDS_FOURCC('D','X','T','2') :
+			fmt == DDS_FMT_DXT3 ? DDS_FOURCC('D','X','T','3') :
+			fmt == DDS_FMT_DXT4 ? DDS_FOURCC('D','X','T','4') :
+			fmt == DDS_FMT_DXT5 ? DDS_FOURCC('D','X','T','5') :
+			fmt == DDS_FMT_DXT5A ? DDS_FOURCC('A','T','I','1') :
+			fmt == DDS_FMT_3DC ? DDS_FOURCC('A','T','I','2') :
+			fmt == DDS_FMT_DXN ? DDS_FOURCC('A','2','X','Y') :
+			0);
+}
+
+
+static bool TiledSave(int width, int height, DDS_Format fmt, bool cubemap)
+{
+	return ((width > IN_MEMORY_MAX_SIZE || height > IN_MEMORY_MAX_SIZE) && !cubemap && TiledFourCC(fmt) != 0);
 }
 
-#pragma mark-
 
 static void DoEstimatePrepare(GPtr globals)
 {
-	gStuff->maxData = 0;
+	gStuff->maxData = 0;
+}
+
+
+static void DoEstimateStart(GPtr globals)
+{
+	if(gStuff->HostSupports32BitCoordinates && gStuff->imageSize32.h && gStuff->imageSize32.v)
+		gStuff->PluginUsing32BitCoordinates = TRUE;
+		
+	int width = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.h : gStuff->imageSize.h);
+	int height = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.v : gStuff->imageSize.v);
+	
+	const int64 dataBytes = DDSFileSize(width, height, (DDS_Format)gOptions.format, gOptions.mipmap, gOptions.cubemap);
+	
+	// uncompressed could be as little as 8-bit luminance, Auto could pick DXT1
+	const int64 minBytes = (gOptions.format == DDS_FMT_UNCOMPRESSED ? dataBytes / 4 :
+							gOptions.format == DDS_FMT_AUTO ? DDSFileSize(width, height, DDS_FMT_DXT1, gOptions.mipmap, gOptions.cubemap) :
+							dataBytes);
+		
+#ifndef MIN
+#define MIN(A,B)			( (A) < (B) ? (A) : (B))
+#endif
+		
+	gStuff->minDataBytes = MIN(minBytes, INT_MAX);
+	gStuff->maxDataBytes = MIN(dataBytes, INT_MAX);
+	
+	gStuff->data = NULL;
+}
+
+
+static void DoEstimateContinue(GPtr globals)
+{
+
+}
+
+
+static void DoEstimateFinish(GPtr globals)
+{
+
+}
+
+#pragma mark-
+
+static void DoWritePrepare(GPtr globals)
+{
+	gStuff->maxData = 0;
+}
+
+typedef struct {
+	unsigned8	r;
+	unsigned8	g;
+	unsigned8	b;
+	unsigned8	a;
+} RGBApixel8;
+
+static void Premultiply(RGBApixel8 *buf, int64 len)
+{
+	while(len--)
+	{
+		if(buf->a != 255)
+		{	
+			const float mult = (float)buf->a / 255.f;
+			
+			buf->r = ((float)buf->r * mult) + 0.5f;
+			buf->g = ((float)buf->g * mult) + 0.5f;
+			buf->b = ((float)buf->b * mult) + 0.5f;
+		}
+		
+		buf++;
+	}
+}
+
+
+static inline crnlib::pixel_format
+Format_PS2Crunch(DDS_Format fmt)
+{
+	using namespace crnlib;
+
+	return (fmt == DDS_FMT_DXT1 ? PIXEL_FMT_DXT1 :
+			fmt == DDS_FMT_DXT1A ? PIXEL_FMT_DXT1A :
+			fmt == DDS_FMT_DXT2 ? PIXEL_FMT_DXT2 :
+			fmt == DDS_FMT_DXT3 ? PIXEL_FMT_DXT3 :
+			fmt == DDS_FMT_DXT4 ? PIXEL_FMT_DXT4 :
+			fmt == DDS_FMT_DXT5 ? PIXEL_FMT_DXT5 :
+			fmt == DDS_FMT_DXT5A ? PIXEL_FMT_DXT5A :
+			fmt == DDS_FMT_3DC ? PIXEL_FMT_3DC :
+			fmt == DDS_FMT_DXN ? PIXEL_FMT_DXN :
+			fmt == DDS_FMT_DXT5_CCxY ? PIXEL_FMT_DXT5_CCxY :
+			fmt == DDS_FMT_DXT5_xGxR ? PIXEL_FMT_DXT5_xGxR :
+			fmt == DDS_FMT_DXT5_xGBR ? PIXEL_FMT_DXT5_xGBR :
+			fmt == DDS_FMT_DXT5_AGBR ? PIXEL_FMT_DXT5_AGBR :
+			PIXEL_FMT_DXT5);
+}
+
+
+static bool crunch_progress(crnlib::uint percentage_complete, void* pUser_data_ptr)
+{
+	GPtr globals = static_cast<GPtr>(pUser_data_ptr);
+
+	if(CurrentThreadID() == globals->call_thread)
+	{
+		TraceSpan span("UpdateProgress");
+		
+		PIUpdateProgress(percentage_complete, 100);
+	}
+	else
+		crnlib::atomic_exchange32(&globals->progress, percentage_complete);
+
+	return !CheckAbort(globals);
+}
+
+static unsigned int GetNumCPUs()
+{
+	static unsigned int cpus = 0;
+
+	if(cpus == 0)
+	{
+#ifdef __PIMac__
+		// get number of CPUs using Mach calls
+		host_basic_info_data_t hostInfo;
+		mach_msg_type_number_t infoCount;
+		
+		infoCount = HOST_BASIC_INFO_COUNT;
+		host_info(mach_host_self(), HOST_BASIC_INFO, 
+				  (host_info_t)&hostInfo, &infoCount);
+		
+		cpus = hostInfo.max_cpus;
+#else // WIN_ENV
+		SYSTEM_INFO systemInfo;
+		GetSystemInfo(&systemInfo);
+
+		cpus = systemInfo.dwNumberOfProcessors;
+#endif
+
+		if(cpus == 0)
+			cpus = 1;
+	}
+
+	return cpus;
+}
+
+// Move the pixels of an unpacked texture into new mip_levels, so we can work
+// on them level by level and then hand them back with assign(), no copying.
+static void TakeLevels(crnlib::mipmapped_texture &dds_file, crnlib::face_vec &faces)
+{
+	using namespace crnlib;
+
+	faces.resize(dds_file.get_num_faces());
+	
+	for(uint f = 0; f < dds_file.get_num_faces(); f++)
+	{
+		for(uint l = 0; l < dds_file.get_num_levels(); l++)
+		{
+			mip_level *orig_level = dds_file.get_level(f, l);
+			
+			assert(!orig_level->is_packed());
+			
+			image_u8 *img = crnlib_new<image_u8>();
+			
+			img->swap( *orig_level->get_image() );
+			
+			mip_level *level = crnlib_new<mip_level>();
+			level->assign(img);
+			
+			faces[f].push_back(level);
+		}
+	}
+}
+
+
+// Same result as mipmapped_texture::generate_mipmaps(), but one level of
+// one face at a time so we can bail out in between.
+static void GenerateMipmaps(GPtr globals, crnlib::mipmapped_texture &dds_file,
+							const crnlib::mipmapped_texture::generate_mipmap_params &params)
+{
+	using namespace crnlib;
+
+	const uint num_faces = dds_file.get_num_faces();
+	
+	uint num_levels = 1;
+	
+	uint mip_width = dds_file.get_width();
+	uint mip_height = dds_file.get_height();
+	
+	while(mip_width > params.m_min_mip_size || mip_height > params.m_min_mip_size)
+	{
+		mip_width >>= 1;
+		mip_height >>= 1;
+		num_levels++;
+	}
+	
+	if(params.m_max_mips > 0 && num_levels > params.m_max_mips)
+		num_levels = params.m_max_mips;
+	
+	if(num_levels <= dds_file.get_num_levels())
+		return;
+	
+	
+	face_vec faces;
+	
+	TakeLevels(dds_file, faces);
+	
+	for(uint f = 0; f < num_faces; f++)
+	{
+		const image_u8 &orig_img = *faces[f][0]->get_image();
+	
+		for(uint l = 1; l < num_levels && !CheckAbort(globals); l++)
+		{
+			TraceSpan span("mipmap", f, l);
+		
+			image_u8 *mip_img = crnlib_new<image_u8>();
+			
+			image_utils::resample_params rparams;
+			
+			rparams.m_dst_width = math::maximum<uint>(1, orig_img.get_width() >> l);
+			rparams.m_dst_height = math::maximum<uint>(1, orig_img.get_height() >> l);
+			rparams.m_pFilter = params.m_pFilter;
+			rparams.m_filter_scale = params.m_filter_scale;
+			rparams.m_srgb = params.m_srgb;
+			rparams.m_wrapping = params.m_wrapping;
+			rparams.m_source_gamma = params.m_gamma;
+			rparams.m_multithreaded = params.m_multithreaded;
+			
+			if( image_utils::resample(orig_img, *mip_img, rparams) )
+			{
+				if(params.m_renormalize)
+					image_utils::renorm_normal_map(*mip_img);
+				
+				mip_img->set_comp_flags( orig_img.get_comp_flags() );
+			
+				mip_level *level = crnlib_new<mip_level>();
+				level->assign(mip_img);
+				
+				faces[f].push_back(level);
+			}
+			else
+			{
+				crnlib_delete(mip_img);
+				
+				HandleError(globals, "Failed to generate mipmaps");
+			}
+		}
+	}
+	
+	// faces are all the same length, even if we quit early
+	uint levels_made = num_levels;
+	
+	for(uint f = 0; f < num_faces; f++)
+		levels_made = math::minimum<uint>(levels_made, faces[f].size());
+	
+	for(uint f = 0; f < num_faces; f++)
+	{
+		while(faces[f].size() > levels_made)
+		{
+			crnlib_delete(faces[f].back());
+			
+			faces[f].pop_back();
+		}
+	}
+	
+	dds_file.assign(faces);
+}
+
+
+// Worker queue
+//   One thread of ours working through items in the order they were
+//   queued, while the calling thread gets on with the next one.  Without
+//   the thread, items are worked on as they're queued.  A subclass has to
+//   call finish() in its destructor, while work() is still there to call.
+
+template <typename T>
+class WorkerQueue
+{
+public:
+	WorkerQueue(crnlib::uint max_items);
+	virtual ~WorkerQueue() { assert(!_running); }
+	
+	void queue(const T &item);
+	
+	// waits for the queue to empty, fine to call more than once
+	void finish();
+	
+	const crnlib::vector<T> & items() const { return _items; }
+
+protected:
+	virtual void work(const T &item) = 0;
+
+private:
+	void run();
+
+#ifdef __PIMac__
+	static void * thread_func(void *arg);
+#else
+	static DWORD WINAPI thread_func(LPVOID arg);
+#endif
+	
+	const crnlib::uint _max_items;
+	crnlib::mutex _mutex;
+	crnlib::semaphore _queued;
+	crnlib::vector<T> _items;
+	bool _started;
+	bool _running;
+#ifdef __PIMac__
+	pthread_t _thread;
+#else
+	HANDLE _thread;
+#endif
+};
+
+
+template <typename T>
+WorkerQueue<T>::WorkerQueue(crnlib::uint max_items) :
+	_max_items(max_items),
+	_queued(0, max_items),
+	_started(false),
+	_running(false)
+{
+
+}
+
+
+template <typename T>
+void
+WorkerQueue<T>::queue(const T &item)
+{
+	// the thread starts with the first item, once the subclass is all there
+	if(!_started)
+	{
+		_started = true;
+		
+	#ifdef __PIMac__
+		_running = (0 == pthread_create(&_thread, NULL, thread_func, this));
+	#else
+		_thread = CreateThread(NULL, 0, thread_func, this, 0, NULL);
+		
+		_running = (_thread != NULL);
+	#endif
+	}
+
+	{
+		crnlib::scoped_mutex lock(_mutex);
+		
+		_items.push_back(item);
+		
+		assert(_items.size() < _max_items);
+	}
+	
+	if(_running)
+		_queued.release();
+	else
+		work(item);
+}
+
+
+template <typename T>
+void
+WorkerQueue<T>::finish()
+{
+	if(_running)
+	{
+		_queued.release(); // with nothing new to work on, that means we're done
+		
+#ifdef __PIMac__
+		pthread_join(_thread, NULL);
+#else
+		WaitForSingleObject(_thread, INFINITE);
+		
+		CloseHandle(_thread);
+#endif
+		_running = false;
+	}
+}
+
+
+template <typename T>
+void
+WorkerQueue<T>::run()
+{
+	crnlib::uint next = 0;
+	
+	while(true)
+	{
+		_queued.wait();
+		
+		T item;
+		
+		{
+			crnlib::scoped_mutex lock(_mutex);
+			
+			if(next >= _items.size())
+				break;
+			
+			item = _items[next++];
+		}
+		
+		work(item);
+	}
+}
+
+
+template <typename T>
+#ifdef __PIMac__
+void *
+WorkerQueue<T>::thread_func(void *arg)
+#else
+DWORD WINAPI
+WorkerQueue<T>::thread_func(LPVOID arg)
+#endif
+{
+	static_cast<WorkerQueue<T> *>(arg)->run();
+	
+	return 0;
+}
+
+
+// Level writer
+//   Each level goes to the file as soon as it's packed, at the offset it
+//   will have in the finished DDS, while the next level is being packed.
+//   The header goes last, once write_dds() has told us what it should be.
+
+typedef struct {
+	crnlib::uint64			offset;
+	const crnlib::uint8		*data;
+	crnlib::uint			size;
+} LevelWrite;
+
+
+#define LEVEL_WRITER_MAX_WRITES	1024 // 6 faces of 32 levels is as many as there can be
+
+class LevelWriter : public WorkerQueue<LevelWrite>
+{
+public:
+	LevelWriter(ps_data_stream &stream) : WorkerQueue<LevelWrite>(LEVEL_WRITER_MAX_WRITES), _stream(stream), _ok(true) {}
+	virtual ~LevelWriter() { finish(); }
+	
+	void set_size(crnlib::uint64 size) { _stream.set_size(size); }
+	
+	// data has to stay put until finish()
+	void write(crnlib::uint64 offset, const void *data, crnlib::uint size);
+	
+	// waits for the writes, true if they all made it
+	bool finish() { WorkerQueue<LevelWrite>::finish(); return _ok; }
+	
+	const crnlib::vector<LevelWrite> & writes() const { return items(); }
+
+protected:
+	virtual void work(const LevelWrite &level_write);
+
+private:
+	ps_data_stream &_stream;
+	bool _ok; // only the worker sets it, read after finish()
+};
+
+
+void
+LevelWriter::write(crnlib::uint64 offset, const void *data, crnlib::uint size)
+{
+	LevelWrite level_write = { offset, (const crnlib::uint8 *)data, size };
+	
+	queue(level_write);
+}
+
+
+void
+LevelWriter::work(const LevelWrite &level_write)
+{
+	if( !_stream.write_at(level_write.offset, level_write.data, level_write.size) )
+		_ok = false;
+}
+
+
+// Takes what write_dds() would have written.  Keeps the header and checks
+// that everything after it matches what the LevelWriter put in the file.
+class HeaderStream : public crnlib::data_stream
+{
+public:
+	HeaderStream(const crnlib::vector<LevelWrite> &writes);
+	virtual ~HeaderStream() {};
+	
+	virtual crnlib::uint read(void* pBuf, crnlib::uint len) { return 0; }
+	virtual crnlib::uint write(const void* pBuf, crnlib::uint len);
+	virtual bool flush() { return true; };
+	virtual crnlib::uint64 get_size() { return _ofs; }
+	virtual crnlib::uint64 get_remaining() { return 0; }
+	virtual crnlib::uint64 get_ofs() { return _ofs; }
+	virtual bool seek(crnlib::int64 ofs, bool relative) { return false; }
+	
+	// true if the header is all that's left to write
+	bool matches() const { return (_matches && _next == _writes.size() && _ofs == _end); }
+	
+	const crnlib::uint8 * header() const { return _header; }
+
+private:
+	const crnlib::vector<LevelWrite> &_writes;
+	crnlib::uint8 _header[DDS_HEADER_SIZE];
+	crnlib::uint64 _ofs;
+	crnlib::uint64 _end; // of the write we're in
+	crnlib::uint _next;
+	bool _matches;
+};
+
+
+HeaderStream::HeaderStream(const crnlib::vector<LevelWrite> &writes) :
+	crnlib::data_stream("Header stream", crnlib::cDataStreamWritable),
+	_writes(writes),
+	_ofs(0),
+	_end(DDS_HEADER_SIZE),
+	_next(0),
+	_matches(true)
+{
+
+}
+
+
+crnlib::uint
+HeaderStream::write(const void* pBuf, crnlib::uint len)
+{
+	const crnlib::uint8 *buf = static_cast<const crnlib::uint8 *>(pBuf);
+	
+	crnlib::uint left = len;
+	
+	while(left > 0 && _matches)
+	{
+		if(_ofs == _end)
+		{
+			// on to the next level, which has to start right here
+			if(_next < _writes.size() && _writes[_next].offset == _ofs)
+				_end = _ofs + _writes[_next++].size;
+			else
+				_matches = false;
+			
+			continue;
+		}
+		
+		const crnlib::uint count = (crnlib::uint)crnlib::math::minimum<crnlib::uint64>(left, _end - _ofs);
+		
+		if(_ofs < DDS_HEADER_SIZE)
+		{
+			memcpy(&_header[_ofs], buf, count);
+		}
+		else
+		{
+			const LevelWrite &level_write = _writes[_next - 1];
+			
+			_matches = (memcmp(buf, level_write.data + (_ofs - level_write.offset), count) == 0);
+		}
+		
+		_ofs += count;
+		buf += count;
+		left -= count;
+	}
+	
+	if(!_matches)
+		_ofs += left;
+	
+	return len;
+}
+
+
+// one flag per 4x4 block, set if the block was compressed again
+typedef struct {
+	crnlib::uint			width;
+	crnlib::uint			height;
+	crnlib::uint			blocks_x;
+	crnlib::uint			blocks_y;
+	crnlib::vector<crnlib::uint8>	flags;
+	crnlib::vector<crnlib::uint>	sums;	// summed-area table of flags, from SumBlockMap()
+} BlockMap;
+
+
+static void SumBlockMap(BlockMap &map)
+{
+	const crnlib::uint pitch = map.blocks_x + 1;
+	
+	map.sums.resize(pitch * (map.blocks_y + 1));
+	
+	for(crnlib::uint x = 0; x < pitch; x++)
+		map.sums[x] = 0;
+	
+	for(crnlib::uint y = 1; y <= map.blocks_y; y++)
+	{
+		crnlib::uint row = 0;
+		
+		map.sums[y * pitch] = 0;
+		
+		for(crnlib::uint x = 1; x < pitch; x++)
+		{
+			row += map.flags[(y - 1) * map.blocks_x + (x - 1)];
+			
+			map.sums[y * pitch + x] = map.sums[(y - 1) * pitch + x] + row;
+		}
+	}
+}
+
+
+// any flag set from block (x0, y0) to (x1, y1) inclusive
+static bool AnyDirty(const BlockMap &map, crnlib::uint x0, crnlib::uint y0, crnlib::uint x1, crnlib::uint y1)
+{
+	const crnlib::uint pitch = map.blocks_x + 1;
+	
+	return (map.sums[(y1 + 1) * pitch + (x1 + 1)] - map.sums[y0 * pitch + (x1 + 1)] -
+			map.sums[(y1 + 1) * pitch + x0] + map.sums[y0 * pitch + x0]) != 0;
+}
+
+
+// How far the mipmap filter reaches from a pixel's center, in source
+// pixels per destination pixel.  These are crnlib's filter supports.
+static float FilterSupport(int filter)
+{
+	return (filter == DDS_FILTER_BOX ? 0.5f :
+			filter == DDS_FILTER_TENT ? 1.0f :
+			filter == DDS_FILTER_LANCZOS4 ? 4.0f :
+			filter == DDS_FILTER_KAISER ? 3.0f :
+			2.0f); // Mitchell
+}
+
+
+static void GetBlock(const crnlib::image_u8 &img, crnlib::uint bx, crnlib::uint by, crnlib::color_quad_u8 *pixels)
+{
+	using namespace crnlib;
+	
+	for(uint y=0; y < 4; y++)
+	{
+		const uint row = math::minimum<uint>(by * 4 + y, img.get_height() - 1);
+		
+		for(uint x=0; x < 4; x++)
+		{
+			const uint col = math::minimum<uint>(bx * 4 + x, img.get_width() - 1);
+			
+			pixels[y * 4 + x] = img(col, row);
+		}
+	}
+}
+
+
+// compare only the channels the format stores
+static bool BlockMatches(const crnlib::color_quad_u8 *a, const crnlib::color_quad_u8 *b, crnlib::pixel_format fmt)
+{
+	using namespace crnlib;
+	
+	const bool red = (fmt != PIXEL_FMT_DXT5A);
+	const bool green = (fmt != PIXEL_FMT_DXT5A);
+	const bool blue = (fmt != PIXEL_FMT_DXT5A && fmt != PIXEL_FMT_3DC && fmt != PIXEL_FMT_DXN);
+	const bool alpha = (fmt != PIXEL_FMT_DXT1 && fmt != PIXEL_FMT_3DC && fmt != PIXEL_FMT_DXN);
+
+	for(int i=0; i < 16; i++)
+	{
+		if( (red && a[i].r != b[i].r) ||
+			(green && a[i].g != b[i].g) ||
+			(blue && a[i].b != b[i].b) ||
+			(alpha && a[i].a != b[i].a) )
+		{
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+
+// sum of squared differences in the channels the format stores
+static crnlib::uint BlockError(const crnlib::color_quad_u8 *a, const crnlib::color_quad_u8 *b, crnlib::pixel_format fmt)
+{
+	using namespace crnlib;
+	
+	const bool alpha = (fmt != PIXEL_FMT_DXT1);
+	
+	uint error = 0;
+	
+	for(int i=0; i < 16; i++)
+	{
+		for(int c=0; c < (alpha ? 4 : 3); c++)
+		{
+			const int diff = (int)a[i][c] - (int)b[i][c];
+			
+			error += diff * diff;
+		}
+	}
+	
+	return error;
+}
+
+
+// Palette entries of a color or DXT5 alpha element, found by pointing every
+// selector at one entry and letting crnlib decode it, so we match its
+// rounding exactly.  Leaves the selectors pointing at the last entry.
+static void ElementPalette(crnlib::dxt_image &dxt, crnlib::uint bx, crnlib::uint by, crnlib::uint e, bool alpha,
+							crnlib::color_quad_u8 *palette)
+{
+	using namespace crnlib;
+	
+	uint8 *bytes = dxt.get_element(bx, by, e).m_bytes;
+	
+	color_quad_u8 pixels[16];
+	
+	const uint entries = (alpha ? 8 : 4);
+	
+	for(uint k=0; k < entries; k++)
+	{
+		if(alpha)
+		{
+			uint64 selectors = 0;
+			
+			for(uint i=0; i < 16; i++)
+				selectors |= (uint64)k << (i * 3);
+			
+			for(uint i=0; i < 6; i++)
+				bytes[2 + i] = (uint8)(selectors >> (i * 8));
+		}
+		else
+			memset(&bytes[4], k * 0x55, 4);
+		
+		dxt.get_block_pixels(bx, by, pixels);
+		
+		palette[k] = pixels[0];
+	}
+}
+
+
+// Try the reference block's endpoints on the new pixels, with just the
+// selectors picked again.  Keeps the result if it's no further from the new
+// pixels than the reference block was from its own source, otherwise puts
+// the block back and returns false.  DXT1-5 only.
+static bool SeedBlock(crnlib::dxt_image &dxt, crnlib::uint bx, crnlib::uint by, crnlib::pixel_format fmt,
+						const crnlib::color_quad_u8 *pixels, const crnlib::color_quad_u8 *old_source)
+{
+	using namespace crnlib;
+	
+	const bool dxt1 = (fmt == PIXEL_FMT_DXT1 || fmt == PIXEL_FMT_DXT1A);
+	const bool dxt3 = (fmt == PIXEL_FMT_DXT2 || fmt == PIXEL_FMT_DXT3);
+	const bool dxt5 = (fmt == PIXEL_FMT_DXT4 || fmt == PIXEL_FMT_DXT5);
+	
+	if(!dxt1 && !dxt3 && !dxt5)
+		return false;
+	
+	const uint color_element = (dxt1 ? 0 : 1);
+	
+	dxt_image::element saved[2];
+	
+	for(uint e=0; e < dxt.get_elements_per_block(); e++)
+		saved[e] = dxt.get_element(bx, by, e);
+	
+	const uint8 *color = saved[color_element].m_bytes;
+	
+	// 3-color blocks have a transparent entry we'd have to get right
+	if(dxt1 && (color[0] | (color[1] << 8)) <= (color[2] | (color[3] << 8)))
+		return false;
+	
+	color_quad_u8 decoded[16];
+	
+	dxt.get_block_pixels(bx, by, decoded);
+	
+	const uint old_error = BlockError(old_source, decoded, fmt);
+	
+	color_quad_u8 palette[8];
+	
+	ElementPalette(dxt, bx, by, color_element, false, palette);
+	
+	uint8 *color_selectors = &dxt.get_element(bx, by, color_element).m_bytes[4];
+	
+	memset(color_selectors, 0, 4);
+	
+	for(uint i=0; i < 16; i++)
+	{
+		uint best = 0, best_error = UINT_MAX;
+		
+		for(uint k=0; k < 4; k++)
+		{
+			uint error = 0;
+			
+			for(int c=0; c < 3; c++)
+			{
+				const int diff = (int)pixels[i][c] - (int)palette[k][c];
+				
+				error += diff * diff;
+			}
+			
+			if(error < best_error)
+			{
+				best = k;
+				best_error = error;
+			}
+		}
+		
+		color_selectors[i / 4] |= best << ((i % 4) * 2);
+	}
+	
+	if(dxt3)
+	{
+		uint8 *alpha = dxt.get_element(bx, by, 0).m_bytes;
+		
+		memset(alpha, 0, 8);
+		
+		for(uint i=0; i < 16; i++)
+			alpha[i / 2] |= ((pixels[i].a + 8) / 17) << ((i % 2) * 4);
+	}
+	else if(dxt5)
+	{
+		ElementPalette(dxt, bx, by, 0, true, palette);
+		
+		uint64 selectors = 0;
+		
+		for(uint i=0; i < 16; i++)
+		{
+			uint best = 0, best_error = UINT_MAX;
+			
+			for(uint k=0; k < 8; k++)
+			{
+				const uint error = abs((int)pixels[i].a - (int)palette[k].a);
+				
+				if(error < best_error)
+				{
+					best = k;
+					best_error = error;
+				}
+			}
+			
+			selectors |= (uint64)best << (i * 3);
+		}
+		
+		uint8 *alpha = dxt.get_element(bx, by, 0).m_bytes;
+		
+		for(uint i=0; i < 6; i++)
+			alpha[2 + i] = (uint8)(selectors >> (i * 8));
+	}
+	
+	dxt.get_block_pixels(bx, by, decoded);
+	
+	if(BlockError(pixels, decoded, fmt) <= old_error)
+		return true;
+	
+	for(uint e=0; e < dxt.get_elements_per_block(); e++)
+		dxt.get_element(bx, by, e) = saved[e];
+	
+	return false;
+}
+
+
+// Compress a level by starting from the reference's blocks and redoing
+// only the ones that changed.  For mip levels, a block whose footprint in
+// the level above was untouched keeps its old data.  Returns false (with
+// level unchanged) if so much is different that a normal pack would be
+// faster.  With the reference's source, blocks are compared against that,
+// and changed blocks first try the reference's endpoints.
+static bool ReencodeLevel(GPtr globals, crnlib::mip_level *level, const crnlib::dxt_image &reference,
+							const crnlib::image_u8 *reference_source,
+							crnlib::pixel_format fmt, const crnlib::dxt_image::pack_params &params,
+							const BlockMap *base, float support, BlockMap &dirty)
+{
+	using namespace crnlib;
+	
+	const image_u8 &img = *level->get_image();
+	
+	dirty.width = img.get_width();
+	dirty.height = img.get_height();
+	dirty.blocks_x = reference.get_blocks_x();
+	dirty.blocks_y = reference.get_blocks_y();
+	dirty.flags.resize(dirty.blocks_x * dirty.blocks_y);
+	
+	uint dirty_count = 0;
+	
+	color_quad_u8 new_pixels[16], old_pixels[16];
+	
+	// each mip level is filtered from the base level, the filter scaled up to match
+	const int64 base_width = (base != NULL ? base->width : 0);
+	const int64 base_height = (base != NULL ? base->height : 0);
+	
+	const int64 reach_x = (base != NULL ? (int64)(support * base_width / dirty.width) + 1 : 0);
+	const int64 reach_y = (base != NULL ? (int64)(support * base_height / dirty.height) + 1 : 0);
+	
+	for(uint by=0; by < dirty.blocks_y && !CheckAbort(globals); by++)
+	{
+		for(uint bx=0; bx < dirty.blocks_x; bx++)
+		{
+			bool changed = true;
+			
+			if(base != NULL)
+			{
+				// base level blocks the filter reads from for this block
+				const int64 x0 = math::maximum<int64>(0, bx * 4 * base_width / dirty.width - reach_x) / 4;
+				const int64 y0 = math::maximum<int64>(0, by * 4 * base_height / dirty.height - reach_y) / 4;
+				const int64 x1 = math::minimum<int64>(base->blocks_x - 1, ((bx * 4 + 4) * base_width / dirty.width + reach_x) / 4);
+				const int64 y1 = math::minimum<int64>(base->blocks_y - 1, ((by * 4 + 4) * base_height / dirty.height + reach_y) / 4);
+				
+				changed = AnyDirty(*base, (uint)x0, (uint)y0, (uint)x1, (uint)y1);
+			}
+			
+			if(changed)
+			{
+				GetBlock(img, bx, by, new_pixels);
+				
+				if(reference_source != NULL)
+					GetBlock(*reference_source, bx, by, old_pixels);
+				else
+					reference.get_block_pixels(bx, by, old_pixels);
+				
+				changed = !BlockMatches(new_pixels, old_pixels, fmt);
+			}
+			
+			dirty.flags[by * dirty.blocks_x + bx] = changed;
+			
+			if(changed)
+				dirty_count++;
+		}
+	}
+	
+	if(gResult != noErr || dirty_count > (dirty.blocks_x * dirty.blocks_y) / 2)
+		return false;
+	
+	dxt_image *dxt = crnlib_new<dxt_image>();
+	
+	*dxt = reference;
+	
+	uint done = 0;
+	
+	for(uint by=0; by < dirty.blocks_y && !CheckAbort(globals); by++)
+	{
+		for(uint bx=0; bx < dirty.blocks_x; bx++)
+		{
+			if(dirty.flags[by * dirty.blocks_x + bx])
+			{
+				GetBlock(img, bx, by, new_pixels);
+				
+				bool seeded = false;
+				
+				if(reference_source != NULL)
+				{
+					GetBlock(*reference_source, bx, by, old_pixels);
+					
+					seeded = SeedBlock(*dxt, bx, by, fmt, new_pixels, old_pixels);
+				}
+				
+				if(!seeded)
+					dxt->set_block_pixels(bx, by, new_pixels, params);
+				
+				done++;
+			}
+		}
+		
+		if(params.m_pProgress_callback != NULL && dirty_count > 0)
+		{
+			const uint percent = params.m_progress_start + (done * params.m_progress_range) / dirty_count;
+			
+			params.m_pProgress_callback(percent, params.m_pProgress_callback_user_data_ptr);
+		}
+	}
+	
+	if(gResult != noErr)
+	{
+		crnlib_delete(dxt);
+		
+		return false;
+	}
+	
+	level->assign(dxt, fmt);
+	
+	return true;
+}
+
+
+// Trivial blocks
+//   Before a level goes to crnlib, pick out the blocks that don't need an
+//   endpoint search.  A block of one color gets its endpoints from a table,
+//   a fully transparent block gets a fixed block, and a block that repeats
+//   an earlier one gets a copy of that one's result.  Only the blocks left
+//   over are packed, gathered into a smaller image.
+
+#define TRIVIAL_SOLID			0xFFFFFFFF
+#define TRIVIAL_CLEAR			0xFFFFFFFE
+#define TRIVIAL_MIN_PERCENT		10		// fewer than this and we just pack the whole level
+#define TRIVIAL_ROW_BLOCKS		256		// width of the image of leftover blocks
+
+// best 5- or 6-bit endpoints for each 8-bit value, with every pixel on
+// palette entry 2, so a block of one color comes out as close as it can
+typedef struct {
+	crnlib::uint8	match5[256][2];
+	crnlib::uint8	match6[256][2];
+} SingleColorTable;
+
+static crnlib::mutex sSingleColorMutex;
+static SingleColorTable sSingleColorTable;
+static bool sSingleColorReady = false;
+
+static void BuildSingleColorTable(crnlib::uint8 (*table)[2], crnlib::uint bits)
+{
+	using namespace crnlib;
+	
+	const uint values = 1 << bits;
+	
+	for(int v=0; v < 256; v++)
+	{
+		int best = INT_MAX;
+		
+		for(uint hi=0; hi < values; hi++)
+		{
+			for(uint lo=0; lo < values; lo++)
+			{
+				const int h = (bits == 5 ? (hi << 3) | (hi >> 2) : (hi << 2) | (hi >> 4));
+				const int l = (bits == 5 ? (lo << 3) | (lo >> 2) : (lo << 2) | (lo >> 4));
+				
+				// entry 2 is 2/3 color0 + 1/3 color1; closer endpoints break ties
+				const int error = abs((2 * h + l) / 3 - v) * 100 + abs(h - l) * 3;
+				
+				if(error < best)
+				{
+					best = error;
+					
+					table[v][0] = hi;
+					table[v][1] = lo;
+				}
+			}
+		}
+	}
+}
+
+static const SingleColorTable & GetSingleColorTable()
+{
+	crnlib::scoped_mutex lock(sSingleColorMutex);
+	
+	if(!sSingleColorReady)
+	{
+		BuildSingleColorTable(sSingleColorTable.match5, 5);
+		BuildSingleColorTable(sSingleColorTable.match6, 6);
+		
+		sSingleColorReady = true;
+	}
+	
+	return sSingleColorTable;
+}
+
+
+static void SolidColorElement(const SingleColorTable &table, const crnlib::color_quad_u8 &color, crnlib::uint8 *bytes)
+{
+	using namespace crnlib;
+	
+	uint color0 = (table.match5[color.r][0] << 11) | (table.match6[color.g][0] << 5) | table.match5[color.b][0];
+	uint color1 = (table.match5[color.r][1] << 11) | (table.match6[color.g][1] << 5) | table.match5[color.b][1];
+	
+	uint8 selectors = 0xAA; // entry 2
+	
+	// color0 has to be the larger for a 4-color block, and then entry 3
+	// is the one that's 2/3 of the way to the other end.  If they're equal
+	// it's a 3-color block, where entry 2 is the same color anyway.
+	if(color0 < color1)
+	{
+		const uint larger = color1;
+		
+		color1 = color0;
+		color0 = larger;
+		
+		selectors = 0xFF;
+	}
+	
+	bytes[0] = color0 & 0xFF;
+	bytes[1] = color0 >> 8;
+	bytes[2] = color1 & 0xFF;
+	bytes[3] = color1 >> 8;
+	
+	memset(&bytes[4], selectors, 4);
+}
+
+
+static inline crnlib::uint64 BlockHash(const crnlib::color_quad_u8 *pixels)
+{
+	const crnlib::uint8 *p = (const crnlib::uint8 *)pixels;
+	
+	crnlib::uint64 acc = HASH_PRIME3;
+	
+	for(int i=0; i < 64; i += 8)
+		acc = HashRound(acc, HashLoad(p + i));
+	
+	return acc ^ (acc >> 29);
+}
+
+
+// The channel moves crnlib makes when it cooks the swizzled DXT5 normal map
+// formats, done here as each block is read rather than in a pass over the
+// whole level.  CCxY is a color space change, so crnlib still cooks that.
+static bool SwizzledFormat(crnlib::pixel_format fmt)
+{
+	using namespace crnlib;
+	
+	return (fmt == PIXEL_FMT_DXT5_xGxR || fmt == PIXEL_FMT_DXT5_xGBR || fmt == PIXEL_FMT_DXT5_AGBR);
+}
+
+
+static void LoadBlock(const crnlib::image_u8 &img, crnlib::uint bx, crnlib::uint by, crnlib::pixel_format fmt,
+						crnlib::color_quad_u8 *pixels)
+{
+	using namespace crnlib;
+	
+	GetBlock(img, bx, by, pixels);
+	
+	if(fmt == PIXEL_FMT_DXT5_xGxR)
+	{
+		for(int i=0; i < 16; i++)
+			pixels[i].set(0, pixels[i].g, 0, pixels[i].r);
+	}
+	else if(fmt == PIXEL_FMT_DXT5_xGBR)
+	{
+		for(int i=0; i < 16; i++)
+			pixels[i].set(0, pixels[i].g, pixels[i].b, pixels[i].r);
+	}
+	else if(fmt == PIXEL_FMT_DXT5_AGBR)
+	{
+		for(int i=0; i < 16; i++)
+			pixels[i].set(pixels[i].a, pixels[i].g, pixels[i].b, pixels[i].r);
+	}
+}
+
+
+// Pack a level the way level.convert() would.  False if crnlib fails.
+static bool PackLevel(crnlib::mip_level &level, crnlib::pixel_format fmt, const crnlib::dxt_image::pack_params &params)
+{
+	using namespace crnlib;
+	
+	const image_u8 &img = *level.get_image();
+	
+	const bool dxt1 = (fmt == PIXEL_FMT_DXT1 || fmt == PIXEL_FMT_DXT1A);
+	const bool dxt3 = (fmt == PIXEL_FMT_DXT2 || fmt == PIXEL_FMT_DXT3);
+	const bool swizzle = SwizzledFormat(fmt);
+	
+	// once swizzled, those are plain DXT5 blocks
+	const bool dxt5 = (fmt == PIXEL_FMT_DXT4 || fmt == PIXEL_FMT_DXT5 || swizzle);
+	
+	// the other formats get cooked or are one- and two-channel, so we
+	// only look for repeats there
+	const bool solid_ok = (dxt1 || dxt3 || dxt5);
+	
+	// under a 1-bit alpha the color is gone, and premultiplied color
+	// under zero alpha should be black
+	const bool clear_ok = (fmt == PIXEL_FMT_DXT1A || fmt == PIXEL_FMT_DXT2 || fmt == PIXEL_FMT_DXT4);
+	const uint clear_below = (fmt == PIXEL_FMT_DXT1A ? params.m_dxt1a_alpha_threshold : 1);
+	
+	const bool rgb_only = (fmt == PIXEL_FMT_DXT1);
+	
+	const uint blocks_x = (img.get_width() + 3) / 4;
+	const uint blocks_y = (img.get_height() + 3) / 4;
+	const uint total_blocks = blocks_x * blocks_y;
+	
+	// what each block gets: TRIVIAL_SOLID, TRIVIAL_CLEAR, or the index of the
+	// first block with the same pixels (its own index if it's the first)
+	vector<uint> source(total_blocks);
+	
+	uint table_size = 1;
+	
+	while(table_size < total_blocks * 2)
+		table_size *= 2;
+	
+	vector<uint> table(table_size); // block index + 1, 0 for empty
+	
+	uint trivial = 0;
+	
+	color_quad_u8 pixels[16], other[16];
+	
+	for(uint by=0; by < blocks_y; by++)
+	{
+		for(uint bx=0; bx < blocks_x; bx++)
+		{
+			const uint b = by * blocks_x + bx;
+			
+			LoadBlock(img, bx, by, fmt, pixels);
+			
+			uint below = 0, solid = 0;
+			
+			for(int i=0; i < 16; i++)
+			{
+				below += (pixels[i].a < clear_below);
+				
+				solid += (pixels[i].r == pixels[0].r && pixels[i].g == pixels[0].g && pixels[i].b == pixels[0].b &&
+							(rgb_only || pixels[i].a == pixels[0].a));
+			}
+			
+			if(clear_ok && below == 16)
+			{
+				source[b] = TRIVIAL_CLEAR;
+			}
+			else if(solid_ok && solid == 16 && (fmt != PIXEL_FMT_DXT1A || below == 0))
+			{
+				source[b] = TRIVIAL_SOLID;
+			}
+			else
+			{
+				uint slot = (uint)BlockHash(pixels) & (table_size - 1);
+				
+				source[b] = b;
+				
+				while(table[slot] != 0)
+				{
+					const uint first = table[slot] - 1;
+					
+					LoadBlock(img, first % blocks_x, first / blocks_x, fmt, other);
+					
+					if(memcmp(pixels, other, sizeof(pixels)) == 0)
+					{
+						source[b] = first;
+						break;
+					}
+					
+					slot = (slot + 1) & (table_size - 1);
+				}
+				
+				if(source[b] == b)
+					table[slot] = b + 1;
+				else
+					trivial++;
+				
+				continue;
+			}
+			
+			trivial++;
+		}
+	}
+	
+	table.clear();
+	
+	// swizzled formats always come this way, it's where the swizzle is
+	if(trivial * 100 < total_blocks * TRIVIAL_MIN_PERCENT && !swizzle)
+		return level.convert(fmt, true, params);
+	
+	// the blocks that need packing, side by side in rows
+	const uint leftover = total_blocks - trivial;
+	
+	dxt_image *dxt = crnlib_new<dxt_image>();
+	
+	if( !dxt->init(pixel_format_helpers::get_dxt_format(fmt), img.get_width(), img.get_height(), false) )
+	{
+		crnlib_delete(dxt);
+		
+		return false;
+	}
+	
+	if(leftover > 0)
+	{
+		const uint row_blocks = math::minimum<uint>(leftover, TRIVIAL_ROW_BLOCKS);
+		const uint rows = (leftover + row_blocks - 1) / row_blocks;
+		
+		image_u8 *packed_img = crnlib_new<image_u8>(row_blocks * 4, rows * 4);
+		
+		// a swizzled image has something in every channel, wherever it came from
+		packed_img->set_comp_flags(swizzle ? pixel_format_helpers::cDefaultCompFlags : img.get_comp_flags());
+		
+		uint k = 0;
+		
+		for(uint b=0; b < total_blocks; b++)
+		{
+			if(source[b] == b)
+			{
+				LoadBlock(img, b % blocks_x, b / blocks_x, fmt, pixels);
+				
+				for(int y=0; y < 4; y++)
+					memcpy(&(*packed_img)((k % row_blocks) * 4, (k / row_blocks) * 4 + y), &pixels[y * 4], 4 * sizeof(color_quad_u8));
+				
+				k++;
+			}
+		}
+		
+		// fill out the last row with copies of the last block
+		for(; k < row_blocks * rows; k++)
+			for(int y=0; y < 4; y++)
+				memcpy(&(*packed_img)((k % row_blocks) * 4, (k / row_blocks) * 4 + y), &pixels[y * 4], 4 * sizeof(color_quad_u8));
+		
+		mip_level packed_level;
+		
+		packed_level.assign(packed_img); // packed_level owns packed_img now
+		
+		if( !packed_level.convert(fmt, !swizzle, params) )
+		{
+			crnlib_delete(dxt);
+			
+			return false;
+		}
+		
+		const dxt_image &packed = *packed_level.get_dxt_image();
+		
+		k = 0;
+		
+		for(uint b=0; b < total_blocks; b++)
+		{
+			if(source[b] == b)
+			{
+				for(uint e=0; e < dxt->get_elements_per_block(); e++)
+					dxt->get_element(b % blocks_x, b / blocks_x, e) = packed.get_element(k % row_blocks, k / row_blocks, e);
+				
+				k++;
+			}
+		}
+	}
+	
+	const SingleColorTable *colors = (solid_ok ? &GetSingleColorTable() : NULL);
+	
+	const uint color_element = (dxt1 ? 0 : 1);
+	
+	for(uint b=0; b < total_blocks; b++)
+	{
+		const uint bx = b % blocks_x;
+		const uint by = b / blocks_x;
+		
+		if(source[b] == TRIVIAL_CLEAR)
+		{
+			for(uint e=0; e < dxt->get_elements_per_block(); e++)
+				memset(dxt->get_element(bx, by, e).m_bytes, 0, 8);
+			
+			// in a 3-color block, entry 3 is transparent black
+			if(fmt == PIXEL_FMT_DXT1A)
+				memset(&dxt->get_element(bx, by, 0).m_bytes[4], 0xFF, 4);
+		}
+		else if(source[b] == TRIVIAL_SOLID)
+		{
+			LoadBlock(img, bx, by, fmt, pixels);
+			
+			const color_quad_u8 &color = pixels[0];
+			
+			SolidColorElement(*colors, color, dxt->get_element(bx, by, color_element).m_bytes);
+			
+			uint8 *alpha = dxt->get_element(bx, by, 0).m_bytes;
+			
+			if(dxt3)
+			{
+				memset(alpha, ((color.a + 8) / 17) * 0x11, 8);
+			}
+			else if(dxt5)
+			{
+				alpha[0] = alpha[1] = color.a;
+				
+				memset(&alpha[2], 0, 6);
+			}
+		}
+		else if(source[b] != b)
+		{
+			for(uint e=0; e < dxt->get_elements_per_block(); e++)
+				dxt->get_element(bx, by, e) = dxt->get_element(source[b] % blocks_x, source[b] / blocks_x, e);
+		}
+	}
+	
+	level.assign(dxt, fmt);
+	
+	return true;
+}
+
+
+// with keep_source, a copy of every level before it's packed goes there,
+// and with a writer each level goes to the file as soon as it's packed
+// Same as mipmapped_texture::convert(), but one level of one face at a time
+// so we can trace and cancel in between.
+static void PackTexture(GPtr globals, crnlib::mipmapped_texture &dds_file, crnlib::pixel_format fmt,
+						const crnlib::dxt_image::pack_params &params,
+						const ReferenceTexture *reference = NULL,
+						crnlib::mipmapped_texture *keep_source = NULL,
+						LevelWriter *writer = NULL)
+{
+	using namespace crnlib;
+	
+	const int64 total_pixels = TexturePixels(dds_file);
+	int64 pixels_done = 0;
+	
+	face_vec faces;
+	
+	TakeLevels(dds_file, faces);
+	
+	face_vec source_faces(keep_source != NULL ? faces.size() : 0);
+	
+	// where each level will land in the file, faces one after the other
+	vector<uint64> offsets;
+	uint level_index = 0;
+	
+	if(writer != NULL)
+	{
+		uint64 offset = DDS_HEADER_SIZE;
+		
+		for(uint f = 0; f < faces.size(); f++)
+		{
+			for(uint l = 0; l < faces[f].size(); l++)
+			{
+				offsets.push_back(offset);
+				
+				offset += (uint64)((faces[f][l]->get_width() + 3) / 4) * ((faces[f][l]->get_height() + 3) / 4) *
+							pixel_format_helpers::get_dxt_bytes_per_block(fmt);
+			}
+		}
+		
+		writer->set_size(offset); // so the file system can allocate it all at once
+	}
+
+	// mipmaps made the same way only change near a change in the base level
+	const float support = FilterSupport(gOptions.filter);
+	
+	const bool same_filter = (reference != NULL && gOptions.mipmap && reference->filter == gOptions.filter);
+	
+	for(uint f = 0; f < faces.size() && gResult == noErr; f++)
+	{
+		BlockMap base, level_dirty;
+		bool have_base = false;
+		
+		for(uint l = 0; l < faces[f].size() && !CheckAbort(globals); l++, level_index++)
+		{
+			TraceSpan span("pack", f, l);
+			
+			mip_level *level = faces[f][l];
+			
+			const uint progress_start = (uint)((pixels_done * params.m_progress_range) / total_pixels);
+			
+			pixels_done += level->get_total_pixels();
+			
+			const uint progress_end = (uint)((pixels_done * params.m_progress_range) / total_pixels);
+			
+			dxt_image::pack_params level_params(params);
+			
+			level_params.m_progress_start = params.m_progress_start + progress_start;
+			level_params.m_progress_range = progress_end - progress_start;
+			
+			if(keep_source != NULL)
+			{
+				mip_level *source_level = crnlib_new<mip_level>();
+				
+				source_level->assign(crnlib_new<image_u8>(*level->get_image()));
+				
+				source_faces[f].push_back(source_level);
+			}
+			
+			const mip_level *ref_level = (reference != NULL && l < reference->packed.get_num_levels() ?
+											reference->packed.get_level(f, l) : NULL);
+			
+			const mip_level *ref_source = (reference != NULL && l < reference->source.get_num_levels() ?
+											reference->source.get_level(f, l) : NULL);
+			
+			const bool reuse = (ref_level != NULL && ref_level->is_packed() &&
+								ref_level->get_width() == level->get_width() &&
+								ref_level->get_height() == level->get_height());
+			
+			const bool have_source = (ref_source != NULL && !ref_source->is_packed() &&
+										ref_source->get_width() == level->get_width() &&
+										ref_source->get_height() == level->get_height());
+			
+			const bool reused = (reuse && ReencodeLevel(globals, level, *ref_level->get_dxt_image(),
+													(have_source ? ref_source->get_image() : NULL), fmt, level_params,
+													(l > 0 && have_base && same_filter ? &base : NULL), support,
+													(l == 0 ? base : level_dirty)));
+			
+			if(l == 0 && reused)
+			{
+				SumBlockMap(base);
+				
+				have_base = true;
+			}
+			
+			if(!reused && gResult == noErr)
+			{
+				if( !PackLevel(*level, fmt, level_params) )
+					HandleError(globals, "Failed to compress image");
+			}
+			
+			if(writer != NULL && gResult == noErr && level->is_packed())
+			{
+				const dxt_image *dxt = level->get_dxt_image();
+				
+				writer->write(offsets[level_index], dxt->get_element_ptr(), dxt->get_size_in_bytes());
+			}
+		}
+	}
+	
+	if(writer != NULL && gResult != noErr)
+		writer->finish(); // before the levels go away
+	
+	if(gResult == noErr)
+	{
+		dds_file.assign(faces);
+		
+		if(keep_source != NULL)
+			keep_source->assign(source_faces);
+	}
+	else
+	{
+		// levels might be in different formats now, just toss them
+		for(uint f = 0; f < faces.size(); f++)
+			for(uint l = 0; l < faces[f].size(); l++)
+				crnlib_delete(faces[f][l]);
+		
+		for(uint f = 0; f < source_faces.size(); f++)
+			for(uint l = 0; l < source_faces[f].size(); l++)
+				crnlib_delete(source_faces[f][l]);
+		
+		dds_file.clear();
+	}
+}
+
+
+static const char * MipmapFilter(GPtr globals)
+{
+	return (gOptions.filter == DDS_FILTER_BOX ? "box" :
+			gOptions.filter == DDS_FILTER_TENT ? "tent" :
+			gOptions.filter == DDS_FILTER_LANCZOS4 ? "lanczos4" :
+			gOptions.filter == DDS_FILTER_MITCHELL ? "mitchell" :
+			gOptions.filter == DDS_FILTER_KAISER ? "kaiser" :
+			"mitchell" );
+}
+
+
+static crnlib::dxt_image::pack_params PackParams(GPtr globals)
+{
+	crnlib::dxt_image::pack_params pack_p;
+
+	pack_p.m_num_helper_threads = GetNumCPUs();
+	pack_p.m_pProgress_callback = crunch_progress;
+	pack_p.m_pProgress_callback_user_data_ptr = globals;
+	
+	return pack_p;
+}
+
+
+// The whole file for one of the formats we pack ourselves, put together in
+// memory the way write_dds() would have.
+static bool PackUncompressed(const crnlib::mipmapped_texture &dds_file, int layout, bool dither, crnlib::data_stream &file)
+{
+	using namespace crnlib;
+	
+	uint8 header[DDS_HEADER_SIZE];
+	
+	MakePackedHeader(dds_file.get_width(), dds_file.get_height(), dds_file.get_num_levels(),
+						(dds_file.get_num_faces() == 6), layout, header);
+	
+	if(file.write(header, DDS_HEADER_SIZE) != DDS_HEADER_SIZE)
+		return false;
+	
+	vector<uint8> pixels;
+	
+	for(uint f = 0; f < dds_file.get_num_faces(); f++)
+	{
+		for(uint l = 0; l < dds_file.get_num_levels(); l++)
+		{
+			const image_u8 *img = dds_file.get_level(f, l)->get_image();
+			
+			if(img == NULL)
+				return false;
+			
+			pixels.resize(img->get_total_pixels() * LayoutBytes(layout));
+			
+			if( !PackPixels(layout, *img, dither, pixels.get_ptr()) ||
+				file.write(pixels.get_ptr(), pixels.size()) != pixels.size() )
+			{
+				return false;
+			}
+		}
+	}
+	
+	return true;
+}
+
+
+// cube map, mipmaps, compression and writing, everything after the fetch
+static void CompressAndWrite(GPtr globals, crnlib::mipmapped_texture &dds_file, crnlib::uint64 source_hash)
+{
+	crnlib::mipmapped_texture source; // what got packed, for the next save to compare with
+	
+	const crnlib::data_stream::attribs_t readwrite = crnlib::cDataStreamReadable |
+														crnlib::cDataStreamWritable |
+														crnlib::cDataStreamSeekable;
+
+	ps_data_stream ps_stream(gStuff->dataFork, readwrite, globals);
+	
+	LevelWriter *writer = NULL;
+	
+	const int packed_layout = PackedLayout(gOptions.format);
+	
+	bool written = false;
+	
+	if(gOptions.cubemap && gResult == noErr)
+	{
+		StageTimer timer(globals, DDS_STAGE_CUBEMAP);
+	
+		const int64 bytes_in = TextureBytes(dds_file);
+		
+		if(dds_file.is_vertical_cross())
+		{
+			const bool cubed = dds_file.vertical_cross_to_cubemap();
+			
+			if(!cubed && gStuff->hostSig != 'FXTC')
+				HandleError(globals, "Failed to convert vertical cross to cube map");
+		}
+		else if(gStuff->hostSig != 'FXTC')
+		{
+			HandleError(globals, "Image does not appear to be vertical cross, required for a cube map");
+		}
+		
+		timer.count(bytes_in, TextureBytes(dds_file), TexturePixels(dds_file));
+	}
+		
+	if(gResult == noErr && !CheckAbort(globals))
+	{
+		if(gOptions.mipmap)
+		{
+			StageTimer timer(globals, DDS_STAGE_MIPMAP);
+			
+			const int64 bytes_in = TextureBytes(dds_file);
+		
+			crnlib::mipmapped_texture::generate_mipmap_params mipmap_p;
+
+			mipmap_p.m_pFilter = MipmapFilter(globals);
+
+			GenerateMipmaps(globals, dds_file, mipmap_p);
+			
+			const int64 bytes_out = TextureBytes(dds_file);
+			
+			timer.count(bytes_in, bytes_out - bytes_in, TexturePixels(dds_file));
+		}
+		
+		if(packed_layout != DDS_LAYOUT_NONE && gResult == noErr)
+		{
+			// packed and written as we go, never the whole file in memory
+			StageTimer timer(globals, DDS_STAGE_PACK);
+			
+			ps_stream.set_size(DDS_HEADER_SIZE + (crnlib::uint64)TexturePixels(dds_file) * LayoutBytes(packed_layout));
+			
+			buffered_stream out(ps_stream);
+			
+			written = (PackUncompressed(dds_file, packed_layout, gOptions.dither, out) &&
+						StampSourceHash(out, source_hash) && out.flush());
+			
+			if(!written)
+				HandleError(globals, "Failed to write file");
+			
+			timer.count(TextureBytes(dds_file), out.get_ofs(), TexturePixels(dds_file));
+		}
+		else if(gOptions.format != DDS_FMT_UNCOMPRESSED && gResult == noErr)
+		{
+			StageTimer timer(globals, DDS_STAGE_PACK);
+			
+			const int64 bytes_in = TextureBytes(dds_file);
+			
+			const crnlib::dxt_image::pack_params pack_p = PackParams(globals);
+			
+			const crnlib::pixel_format fmt = Format_PS2Crunch(gOptions.format);
+			
+			const ReferenceTexture *reference = TakeReference(dds_file, fmt);
+			
+			// only After Effects saves one frame after another, and holding
+			// an extra RGBA copy of a huge texture isn't worth it
+			const bool keep_source = (gStuff->hostSig == 'FXTC' && CanReuseBlocks(fmt) &&
+										bytes_in <= (int64)REFERENCE_SOURCE_MAX_MB * 1024 * 1024);
+			
+			writer = crnlib::crnlib_new<LevelWriter>(ps_stream);
+			
+			PackTexture(globals, dds_file, fmt, pack_p, reference, (keep_source ? &source : NULL), writer);
+			
+			if(reference != NULL)
+				ReleaseReference(reference);
+			
+			timer.count(bytes_in, TextureBytes(dds_file), TexturePixels(dds_file));
+		}
+	}
+
+	if(gResult == noErr && writer != NULL)
+	{
+		StageTimer timer(globals, DDS_STAGE_WRITE);
+		
+		const bool levels_written = writer->finish();
+		
+		HeaderStream header_stream(writer->writes());
+		
+		crnlib::data_stream_serializer serializer(&header_stream);
+		
+		if( !dds_file.write_dds(serializer) )
+		{
+			HandleError(globals, dds_file);
+		}
+		else if(levels_written && header_stream.matches())
+		{
+			crnlib::uint8 header[DDS_HEADER_SIZE];
+			
+			memcpy(header, header_stream.header(), DDS_HEADER_SIZE);
+			
+			MakeHashStamp(source_hash, &header[HASH_STAMP_OFFSET]);
+			
+			written = ps_stream.write_at(0, header, DDS_HEADER_SIZE);
+			
+			if(written)
+				timer.count(TextureBytes(dds_file), header_stream.get_ofs(), TexturePixels(dds_file));
+		}
+	}
+	
+	if(writer != NULL)
+		crnlib::crnlib_delete(writer);
+
+	if(gResult == noErr)
+	{
+		StageTimer timer(globals, DDS_STAGE_WRITE);
+		
+		// Uncompressed, or the levels didn't make it out on their own.
+		// write_dds() makes a write for every field of the header, so that
+		// goes through a buffer on its way to the file.
+		if(!written)
+		{
+			ps_stream.seek(0, false);
+			
+			ps_stream.set_size(DDS_HEADER_SIZE + TextureBytes(dds_file)); // so the file system can allocate it all at once
+			
+			buffered_stream out(ps_stream);
+			
+			crnlib::data_stream_serializer serializer(&out);
+
+			if( !dds_file.write_dds(serializer) )
+				HandleError(globals, dds_file);
+			else if( !StampSourceHash(out, source_hash) || !out.flush() || !ps_stream.set_size(out.get_ofs()) )
+				HandleError(globals, "Failed to write file");
+			else
+				timer.count(TextureBytes(dds_file), out.get_ofs(), TexturePixels(dds_file));
+		}
+		
+		// the cache gets a copy of what's in the file now
+		if(gResult == noErr && CachePath() != NULL)
+			AddToCache(ps_stream, source_hash);
+		
+		if(gResult == noErr)
+			KeepReference(dds_file, false, (gOptions.mipmap ? gOptions.filter : -1), &source); // next save can start from this one
+	}
+}
+
+
+// the save options go into the hash ahead of the pixels
+static void HashSettings(GPtr globals, SourceHash &hash, bool use_alpha, int width, int height)
+{
+	const crnlib::uint8 settings[] = { (crnlib::uint8)gOptions.format,
+										(crnlib::uint8)use_alpha,
+										(crnlib::uint8)gOptions.premultiply,
+										(crnlib::uint8)gOptions.mipmap,
+										(crnlib::uint8)gOptions.filter,
+										(crnlib::uint8)gOptions.cubemap,
+										(crnlib::uint8)(gOptions.dither && PackedLayout(gOptions.format) != DDS_LAYOUT_NONE),
+										(crnlib::uint8)(gStuff->imageMode == plugInModeGrayScale) };
+	
+	const crnlib::uint32 size[] = { (crnlib::uint32)width, (crnlib::uint32)height };
+	
+	hash.update(settings, sizeof(settings));
+	hash.update(size, sizeof(size));
+}
+
+
+// Fetching
+//   The image comes from the host in bands so a cancel doesn't wait for the
+//   whole thing, with the composite and the alpha channel read band by band
+//   together.  A BandFinisher premultiplies each band and adds it to the
+//   source hash on a thread of ours while the host fetches the next one,
+//   and for the Auto format, gathers the ImageStats it picks a format with.
+
+// Saving a grayscale document without alpha as A8 or DXT5A, the gray is
+// what goes in the alpha.
+static bool GrayAsAlpha(GPtr globals, bool use_transparency, bool use_alpha_channel)
+{
+	return (gStuff->imageMode == plugInModeGrayScale && !use_transparency && !use_alpha_channel &&
+			(gOptions.format == DDS_FMT_A8 || gOptions.format == DDS_FMT_DXT5A));
+}
+
+
+// a grayscale document comes in as gray and transparency in the first two
+// bytes of each pixel, spread it out the way everything after expects
+static void ExpandGray(crnlib::color_quad_u8 *pixels, int width, int rows, crnlib::uint pitch,
+						bool transparency, bool gray_alpha)
+{
+	for(int row = 0; row < rows; row++)
+	{
+		crnlib::color_quad_u8 *p = pixels + (size_t)row * pitch;
+		
+		for(int x = 0; x < width; x++)
+		{
+			const crnlib::uint8 gray = p[x].r;
+			
+			p[x].a = (transparency ? p[x].g : gray_alpha ? gray : 255);
+			p[x].g = gray;
+			p[x].b = gray;
+		}
+	}
+}
+
+
+static void FetchBand(GPtr globals, int y, crnlib::color_quad_u8 *pixels, int width, int rows, crnlib::uint pitch,
+						bool use_alpha_channel)
+{
+	const int band_bottom = y + rows;
+	const int64 band_pixels = (int64)width * rows;
+	
+	gStuff->rowBytes = gStuff->colBytes * pitch;
+	
+	{
+		StageTimer timer(globals, DDS_STAGE_FETCH);
+		
+		gStuff->theRect.top = gStuff->theRect32.top = y;
+		gStuff->theRect.bottom = gStuff->theRect32.bottom = band_bottom;
+		
+		gStuff->data = pixels;
+		
+		{
+			TraceSpan span("AdvanceState");
+			
+			gResult = AdvanceState();
+		}
+		
+		if(gResult == noErr && gStuff->imageMode == plugInModeGrayScale)
+		{
+			const bool transparency = (gStuff->hiPlane > 0);
+			
+			ExpandGray(pixels, width, rows, pitch, transparency, GrayAsAlpha(globals, transparency, use_alpha_channel));
+		}
+		
+		if(gResult == noErr)
+			timer.count(band_pixels * (gStuff->hiPlane + 1), band_pixels * gStuff->colBytes, band_pixels);
+	}
+	
+	if(use_alpha_channel && gResult == noErr)
+	{
+		StageTimer timer(globals, DDS_STAGE_ALPHA);
+	
+		ReadPixelsProc ReadProc = gStuff->channelPortProcs->readPixelsProc;
+		
+		ReadChannelDesc *alpha_channel = gStuff->documentInfo->alphaChannels;
+		
+		VRect wroteRect;
+		VRect writeRect = { y, 0, band_bottom, width };
+		PSScaling scaling; scaling.sourceRect = scaling.destinationRect = writeRect;
+		PixelMemoryDesc memDesc = { (char *)pixels, gStuff->rowBytes * 8, gStuff->colBytes * 8, 3 * 8, gStuff->depth };
+	
+		{
+			TraceSpan span("ReadProc");
+			
+			gResult = ReadProc(alpha_channel->port, &scaling, &writeRect, &memDesc, &wroteRect);
+		}
+		
+		if(gResult == noErr)
+			timer.count(band_pixels, band_pixels, band_pixels);
+	}
+}
+
+
+typedef struct {
+	crnlib::color_quad_u8	*pixels;
+	crnlib::uint			width;
+	crnlib::uint			rows;
+	crnlib::uint			pitch;
+} FetchedBand;
+
+
+typedef struct {
+	crnlib::uint			alpha_min;
+	crnlib::uint			alpha_partial;	// non-zero if any alpha is neither 0 nor 255
+	crnlib::uint			not_gray;		// non-zero if any pixel has R, G and B different
+	crnlib::uint			not_white;		// non-zero if any pixel's RGB isn't white
+	int64					normals;		// pixels that could be a unit vector facing out
+	crnlib::uint			x_min;			// range of red and green, the normals' X and Y
+	crnlib::uint			x_max;
+	crnlib::uint			y_min;
+	crnlib::uint			y_max;
+	int64					pixels;
+} ImageStats;
+
+static const ImageStats kEmptyStats = { 255, 0, 0, 0, 0, 255, 0, 255, 0, 0 };
+
+// a unit vector stored in RGB is 127.5 long, these allow about 5% either way
+#define NORMAL_LENGTH_MIN	(242 * 242)		// squared, in units of 1/2
+#define NORMAL_LENGTH_MAX	(268 * 268)
+
+// a flat color that happens to be the right length isn't a normal map,
+// the normals have to point more than one way
+#define NORMAL_SPREAD_MIN	32
+
+#define AUTO_NORMAL_PERCENT	99
+
+
+// Kept to simple operations on plain ints with no branches, so the
+// compiler can vectorize the loop.
+static void GatherStats(const FetchedBand &band, ImageStats &stats)
+{
+	for(crnlib::uint row = 0; row < band.rows; row++)
+	{
+		const crnlib::color_quad_u8 *pix = band.pixels + row * band.pitch;
+		
+		crnlib::uint alpha_min = stats.alpha_min;
+		crnlib::uint alpha_partial = 0, not_gray = 0, not_white = 0;
+		int normals = 0;
+		int x_min = stats.x_min, x_max = stats.x_max, y_min = stats.y_min, y_max = stats.y_max;
+		
+		for(crnlib::uint x = 0; x < band.width; x++)
+		{
+			const int r = pix[x].r;
+			const int g = pix[x].g;
+			const int b = pix[x].b;
+			const crnlib::uint a = pix[x].a;
+			
+			alpha_min = (a < alpha_min ? a : alpha_min);
+			alpha_partial |= (a + 1) & 0xfe; // zero for 0 and 255 only
+			not_gray |= (r ^ g) | (g ^ b);
+			not_white |= (r & g & b) ^ 0xff;
+			
+			const int nx = 2 * r - 255;
+			const int ny = 2 * g - 255;
+			const int nz = 2 * b - 255;
+			const int length = (nx * nx) + (ny * ny) + (nz * nz);
+			
+			normals += (length >= NORMAL_LENGTH_MIN) & (length <= NORMAL_LENGTH_MAX) & (nz > 0);
+			
+			x_min = (r < x_min ? r : x_min);
+			x_max = (r > x_max ? r : x_max);
+			y_min = (g < y_min ? g : y_min);
+			y_max = (g > y_max ? g : y_max);
+		}
+		
+		stats.alpha_min = alpha_min;
+		stats.alpha_partial |= alpha_partial;
+		stats.not_gray |= not_gray;
+		stats.not_white |= not_white;
+		stats.normals += normals;
+		stats.x_min = x_min;
+		stats.x_max = x_max;
+		stats.y_min = y_min;
+		stats.y_max = y_max;
+		stats.pixels += band.width;
+	}
 }
 
 
-static void DoEstimateStart(GPtr globals)
+// the smallest format that holds what's in the image
+static DDS_Format ChooseFormat(const ImageStats &stats, bool use_alpha, bool premultiply)
 {
-	if(gStuff->HostSupports32BitCoordinates && gStuff->imageSize32.h && gStuff->imageSize32.v)
-		gStuff->PluginUsing32BitCoordinates = TRUE;
+	const bool alpha = (use_alpha && stats.alpha_min < 255);
+	
+	const bool spread = (stats.x_max >= stats.x_min + NORMAL_SPREAD_MIN || stats.y_max >= stats.y_min + NORMAL_SPREAD_MIN);
+	
+	const bool normal_map = (stats.not_gray && spread && stats.normals * 100 >= stats.pixels * AUTO_NORMAL_PERCENT);
+	
+	if(!alpha)
+		return (normal_map ? DDS_FMT_3DC : DDS_FMT_DXT1);
+	else if(!stats.not_white)
+		return DDS_FMT_DXT5A; // it's all in the alpha
+	else if(!stats.alpha_partial)
+		return DDS_FMT_DXT1A;
+	else
+		return (premultiply ? DDS_FMT_DXT4 : DDS_FMT_DXT5);
+}
+
+
+// everything a band needs after the host is done with it, hash and stats can be NULL
+static void FinishBand(GPtr globals, const FetchedBand &band, SourceHash *hash, bool premultiply,
+						ImageStats *stats = NULL, bool track_memory = true)
+{
+	const int64 band_pixels = (int64)band.width * band.rows;
+	
+	if(premultiply)
+	{
+		StageTimer timer(globals, DDS_STAGE_PREMULTIPLY, track_memory);
 		
-	int width = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.h : gStuff->imageSize.h);
-	int height = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.v : gStuff->imageSize.v);
+		for(crnlib::uint row = 0; row < band.rows; row++)
+			Premultiply((RGBApixel8 *)(band.pixels + row * band.pitch), band.width);
+		
+		timer.count(band_pixels * sizeof(RGBApixel8), band_pixels * sizeof(RGBApixel8), band_pixels);
+	}
 	
-	int64 dataBytes = (int64)width * (int64)height * (int64)gStuff->planes * (int64)(gStuff->depth >> 3);
-					  
+	if(hash != NULL)
+	{
+		TraceSpan span("hash");
 		
-#ifndef MIN
-#define MIN(A,B)			( (A) < (B) ? (A) : (B))
+		for(crnlib::uint row = 0; row < band.rows; row++)
+			hash->update(band.pixels + row * band.pitch, band.width * sizeof(crnlib::color_quad_u8));
+		
+		span.set_bytes(band_pixels * sizeof(crnlib::color_quad_u8));
+	}
+	
+	if(stats != NULL)
+	{
+		TraceSpan span("stats");
+		
+		GatherStats(band, *stats);
+		
+		span.set_bytes(band_pixels * sizeof(crnlib::color_quad_u8));
+	}
+}
+
+
+#define BAND_FINISHER_MAX_BANDS	((1 << 20) / ADVANCE_BAND_HEIGHT) // a million rows
+
+class BandFinisher : public WorkerQueue<FetchedBand>
+{
+public:
+	BandFinisher(GPtr globals, SourceHash &hash, bool premultiply, ImageStats *stats = NULL);
+	virtual ~BandFinisher() { finish(); }
+	
+	// pixels have to stay put until finish()
+	void add(crnlib::color_quad_u8 *pixels, crnlib::uint width, crnlib::uint rows, crnlib::uint pitch);
+
+protected:
+	virtual void work(const FetchedBand &band);
+
+private:
+	GPtr _globals;
+	SourceHash &_hash;
+	const bool _premultiply;
+	ImageStats *_stats;
+};
+
+
+BandFinisher::BandFinisher(GPtr globals, SourceHash &hash, bool premultiply, ImageStats *stats) :
+	WorkerQueue<FetchedBand>(BAND_FINISHER_MAX_BANDS),
+	_globals(globals),
+	_hash(hash),
+	_premultiply(premultiply),
+	_stats(stats)
+{
+
+}
+
+
+void
+BandFinisher::add(crnlib::color_quad_u8 *pixels, crnlib::uint width, crnlib::uint rows, crnlib::uint pitch)
+{
+	FetchedBand band = { pixels, width, rows, pitch };
+	
+	queue(band);
+}
+
+
+void
+BandFinisher::work(const FetchedBand &band)
+{
+	// the fetch is timing memory on the calling thread meanwhile
+	FinishBand(_globals, band, &_hash, _premultiply, _stats, false);
+}
+
+
+#pragma mark-
+
+// Tiled save
+//   For textures bigger than IN_MEMORY_MAX_SIZE.  The top level is fetched,
+//   packed and written one band at a time, and box-filtered into the next
+//   level on the way through.  If that level would still be over
+//   TILED_LEVEL_BUDGET it goes to a temp file and gets the same treatment,
+//   otherwise it's kept in memory and the rest of the mip chain is made and
+//   packed the usual way.  Nothing is kept for the cache or the next save.
+
+#define TILED_LEVEL_BUDGET		((crnlib::uint64)IN_MEMORY_MAX_SIZE * IN_MEMORY_MAX_SIZE * sizeof(crnlib::color_quad_u8))
+
+static FILE * OpenSpillFile()
+{
+#ifdef __PIMac__
+	return tmpfile();
+#else
+	// tmpfile() puts it in the root of the drive, where we might not be allowed
+	char dir[MAX_PATH], path[MAX_PATH];
+	
+	if(GetTempPathA(MAX_PATH, dir) == 0 || GetTempFileNameA(dir, "DDS", 0, path) == 0)
+		return NULL;
+	
+	return fopen(path, "w+bD"); // D: deleted when it's closed
 #endif
+}
+
+
+// the header write_dds() would make, for levels it never saw
+static void MakeTiledHeader(crnlib::uint width, crnlib::uint height, crnlib::uint levels, DDS_Format fmt,
+							crnlib::uint8 *header)
+{
+	memset(header, 0, DDS_HEADER_SIZE);
+	
+	memcpy(header, "DDS ", 4);
+	
+	crnlib::uint8 *desc = header + 4;
+	
+	const crnlib::uint32 level_size = ((width + 3) / 4) * ((height + 3) / 4) * BlockBytes(fmt);
+	
+	WriteLE32(desc + 0, 124);
+	WriteLE32(desc + 4, 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (levels > 1 ? 0x20000 : 0)); // CAPS, HEIGHT, WIDTH, PIXELFORMAT, LINEARSIZE, MIPMAPCOUNT
+	WriteLE32(desc + 8, height);
+	WriteLE32(desc + 12, width);
+	WriteLE32(desc + 16, level_size);
+	WriteLE32(desc + 24, levels);
+	
+	WriteLE32(desc + 72, 32);
+	WriteLE32(desc + 76, 0x4); // DDPF_FOURCC
+	WriteLE32(desc + 80, TiledFourCC(fmt));
+	
+	WriteLE32(desc + 104, 0x1000 | (levels > 1 ? 0x400000 | 0x8 : 0)); // TEXTURE, MIPMAP, COMPLEX
+}
+
+
+// 2x2 box filter from a band into the next level down, which is either
+// in memory or getting appended to a spill file
+static bool ReduceBand(const crnlib::image_u8 &band, crnlib::uint y, crnlib::uint height,
+						crnlib::image_u8 *next_img, FILE *next_spill)
+{
+	using namespace crnlib;
+	
+	const uint width = band.get_width();
+	const uint next_width = LevelDimension(width, 1);
+	const uint next_height = LevelDimension(height, 1);
+	
+	vector<color_quad_u8> spill_row(next_spill != NULL ? next_width : 0);
+	
+	for(uint next_y = y / 2; next_y < next_height && next_y * 2 < y + band.get_height(); next_y++)
+	{
+		const color_quad_u8 *row0 = band.get_scanline(next_y * 2 - y);
+		const color_quad_u8 *row1 = band.get_scanline(math::minimum(next_y * 2 + 1, height - 1) - y);
 		
-	gStuff->minDataBytes = MIN(dataBytes / 2, INT_MAX);
-	gStuff->maxDataBytes = MIN(dataBytes, INT_MAX);
+		color_quad_u8 *out = (next_img != NULL ? next_img->get_scanline(next_y) : spill_row.get_ptr());
+		
+		for(uint x = 0; x < next_width; x++)
+		{
+			const uint x0 = x * 2;
+			const uint x1 = math::minimum(x * 2 + 1, width - 1);
+			
+			for(uint c = 0; c < 4; c++)
+				out[x][c] = (row0[x0][c] + row0[x1][c] + row1[x0][c] + row1[x1][c] + 2) >> 2;
+		}
+		
+		if(next_spill != NULL && fwrite(out, sizeof(color_quad_u8), next_width, next_spill) != next_width)
+			return false;
+	}
 	
-	gStuff->data = NULL;
+	return true;
 }
 
 
-static void DoEstimateContinue(GPtr globals)
+// Fetch (or read back from the spill file), pack and write one level band by
+// band, and feed the next level down.  Only the top level is premultiplied
+// and goes into the hash.
+static void PackTiledLevel(GPtr globals, ps_data_stream &ps_stream, crnlib::uint64 offset,
+							crnlib::uint width, crnlib::uint height, FILE *spill,
+							bool use_alpha, bool use_alpha_channel, bool premultiply,
+							const crnlib::dxt_image::pack_params &params, int64 &pixels_done, int64 total_pixels,
+							crnlib::image_u8 *next_img, FILE *next_spill, SourceHash *hash)
+{
+	using namespace crnlib;
+	
+	const pixel_format fmt = Format_PS2Crunch(gOptions.format);
+	
+	const uint64 block_row_bytes = (uint64)((width + 3) / 4) * BlockBytes(gOptions.format);
+	
+	const bool have_next = (next_img != NULL || next_spill != NULL);
+	
+	for(uint y = 0; y < height && gResult == noErr && !CheckAbort(globals); y += ADVANCE_BAND_HEIGHT)
+	{
+		const uint rows = math::minimum<uint>(height - y, ADVANCE_BAND_HEIGHT);
+		
+		image_u8 *band = crnlib_new<image_u8>(width, rows);
+		
+		if(!use_alpha)
+		{
+			using namespace pixel_format_helpers;
+
+			band->set_comp_flags( static_cast<component_flags>(cCompFlagRValid | cCompFlagGValid | cCompFlagBValid) );
+		}
+		
+		mip_level band_level;
+		
+		band_level.assign(band); // band_level owns band now
+		
+		if(spill == NULL)
+		{
+			FetchBand(globals, y, band->get_pixels(), width, rows, band->get_pitch(), use_alpha_channel);
+		}
+		else
+		{
+			StageTimer timer(globals, DDS_STAGE_FETCH);
+			
+			for(uint row = 0; row < rows && gResult == noErr; row++)
+			{
+				if(fread(band->get_scanline(row), sizeof(color_quad_u8), width, spill) != width)
+					HandleError(globals, "Failed to read temporary file");
+			}
+			
+			timer.count((int64)width * rows * sizeof(color_quad_u8), (int64)width * rows * sizeof(color_quad_u8), (int64)width * rows);
+		}
+		
+		if(gResult == noErr)
+		{
+			const FetchedBand fetched = { band->get_pixels(), width, rows, band->get_pitch() };
+			
+			FinishBand(globals, fetched, hash, (premultiply && spill == NULL));
+		}
+		
+		if(have_next && gResult == noErr)
+		{
+			StageTimer timer(globals, DDS_STAGE_MIPMAP);
+			
+			if( !ReduceBand(*band, y, height, next_img, next_spill) )
+				HandleError(globals, "Failed to write temporary file");
+			
+			timer.count((int64)width * rows * sizeof(color_quad_u8), (int64)width * rows, (int64)width * rows / 4);
+		}
+		
+		if(gResult == noErr)
+		{
+			StageTimer timer(globals, DDS_STAGE_PACK);
+			
+			dxt_image::pack_params band_params(params);
+			
+			band_params.m_progress_start = (uint)((pixels_done * params.m_progress_range) / total_pixels);
+			
+			pixels_done += (int64)width * rows;
+			
+			band_params.m_progress_range = (uint)((pixels_done * params.m_progress_range) / total_pixels) - band_params.m_progress_start;
+			band_params.m_progress_start += params.m_progress_start;
+			
+			if( !PackLevel(band_level, fmt, band_params) )
+				HandleError(globals, "Failed to compress image");
+			else
+				timer.count((int64)width * rows * sizeof(color_quad_u8), band_level.get_dxt_image()->get_size_in_bytes(), (int64)width * rows);
+		}
+		
+		if(gResult == noErr)
+		{
+			StageTimer timer(globals, DDS_STAGE_WRITE);
+			
+			const dxt_image *dxt = band_level.get_dxt_image();
+			
+			if( !ps_stream.write_at(offset + (y / 4) * block_row_bytes, dxt->get_element_ptr(), dxt->get_size_in_bytes()) )
+				HandleError(globals, "Failed to write file");
+			else
+				timer.count(dxt->get_size_in_bytes(), dxt->get_size_in_bytes(), (int64)width * rows);
+		}
+	}
+}
+
+
+static void WriteTiled(GPtr globals, int width, int height, bool use_transparency, bool use_alpha_channel)
 {
+	using namespace crnlib;
+	
+	const DDS_Format format = (DDS_Format)gOptions.format;
+	
+	const bool use_alpha = (use_transparency || use_alpha_channel || GrayAsAlpha(globals, use_transparency, use_alpha_channel));
+	const bool premultiply = ((use_transparency || use_alpha_channel) && gOptions.premultiply && gStuff->hostSig != 'FXTC');
+	
+	uint levels = 1;
+	
+	if(gOptions.mipmap)
+	{
+		while((width >> levels) > 0 || (height >> levels) > 0)
+			levels++;
+	}
+	
+	// where each level goes in the file
+	vector<uint64> offsets(levels);
+	
+	uint64 offset = DDS_HEADER_SIZE;
+	int64 total_pixels = 0;
+	
+	for(uint l = 0; l < levels; l++)
+	{
+		const uint w = LevelDimension(width, l);
+		const uint h = LevelDimension(height, l);
+		
+		offsets[l] = offset;
+		
+		offset += (uint64)((w + 3) / 4) * ((h + 3) / 4) * BlockBytes(format);
+		total_pixels += (int64)w * h;
+	}
+	
+	assert(offset == DDSFileSize(width, height, format, gOptions.mipmap, false));
+	
+	
+	const data_stream::attribs_t readwrite = cDataStreamReadable | cDataStreamWritable | cDataStreamSeekable;
+
+	ps_data_stream ps_stream(gStuff->dataFork, readwrite, globals);
+	
+	ps_stream.set_size(offset); // so the file system can allocate it all at once
+	
+	const dxt_image::pack_params pack_p = PackParams(globals);
+	
+	int64 pixels_done = 0;
+	
+	SourceHash hash;
+	
+	HashSettings(globals, hash, use_alpha, width, height);
+	
+	
+	FILE *spill = NULL; // where the level we're on comes from, NULL for the host
+	image_u8 *next_img = NULL;
+	uint level = 0;
+	
+	for(; level < levels && gResult == noErr; level++)
+	{
+		const uint w = LevelDimension(width, level);
+		const uint h = LevelDimension(height, level);
+		
+		FILE *next_spill = NULL;
+		
+		if(level + 1 < levels)
+		{
+			const uint next_w = LevelDimension(width, level + 1);
+			const uint next_h = LevelDimension(height, level + 1);
+			
+			if((uint64)next_w * next_h * sizeof(color_quad_u8) > TILED_LEVEL_BUDGET)
+			{
+				next_spill = OpenSpillFile();
+				
+				if(next_spill == NULL)
+					HandleError(globals, "Could not create temporary file");
+			}
+			else
+			{
+				next_img = crnlib_new<image_u8>(next_w, next_h);
+				
+				if(!use_alpha)
+				{
+					using namespace pixel_format_helpers;
 
+					next_img->set_comp_flags( static_cast<component_flags>(cCompFlagRValid | cCompFlagGValid | cCompFlagBValid) );
+				}
+			}
+		}
+		
+		if(gResult == noErr)
+		{
+			PackTiledLevel(globals, ps_stream, offsets[level], w, h, spill,
+							use_alpha, use_alpha_channel, premultiply,
+							pack_p, pixels_done, total_pixels,
+							next_img, next_spill, (level == 0 ? &hash : NULL));
+		}
+		
+		if(spill != NULL)
+			fclose(spill);
+		
+		spill = next_spill;
+		
+		if(spill != NULL)
+			rewind(spill);
+		else
+			break; // the rest are done in memory, if there are any
+	}
+	
+	if(spill != NULL)
+		fclose(spill);
+	
+	
+	if(next_img != NULL && gResult == noErr && !CheckAbort(globals))
+	{
+		mipmapped_texture tail;
+		
+		tail.assign(next_img); // tail owns next_img now
+		
+		next_img = NULL;
+		
+		{
+			StageTimer timer(globals, DDS_STAGE_MIPMAP);
+			
+			const int64 bytes_in = TextureBytes(tail);
+			
+			mipmapped_texture::generate_mipmap_params mipmap_p;
+			
+			mipmap_p.m_pFilter = MipmapFilter(globals);
+			
+			GenerateMipmaps(globals, tail, mipmap_p);
+			
+			timer.count(bytes_in, TextureBytes(tail) - bytes_in, TexturePixels(tail));
+		}
+		
+		if(gResult == noErr && !CheckAbort(globals))
+		{
+			StageTimer timer(globals, DDS_STAGE_PACK);
+			
+			const int64 bytes_in = TextureBytes(tail);
+			
+			dxt_image::pack_params tail_p(pack_p);
+			
+			tail_p.m_progress_start = (uint)((pixels_done * pack_p.m_progress_range) / total_pixels);
+			tail_p.m_progress_range = pack_p.m_progress_range - tail_p.m_progress_start;
+			tail_p.m_progress_start += pack_p.m_progress_start;
+			
+			PackTexture(globals, tail, Format_PS2Crunch(format), tail_p);
+			
+			timer.count(bytes_in, TextureBytes(tail), TexturePixels(tail));
+		}
+		
+		if(gResult == noErr && tail.get_num_levels() != levels - level - 1)
+			HandleError(globals, "Failed to generate mipmaps");
+		
+		for(uint l = 0; l < tail.get_num_levels() && gResult == noErr; l++)
+		{
+			StageTimer timer(globals, DDS_STAGE_WRITE);
+			
+			const dxt_image *dxt = tail.get_level(0, l)->get_dxt_image();
+			
+			if( !ps_stream.write_at(offsets[level + 1 + l], dxt->get_element_ptr(), dxt->get_size_in_bytes()) )
+				HandleError(globals, "Failed to write file");
+			else
+				timer.count(dxt->get_size_in_bytes(), dxt->get_size_in_bytes(), tail.get_level(0, l)->get_total_pixels());
+		}
+	}
+	
+	if(next_img != NULL)
+		crnlib_delete(next_img);
+	
+	
+	if(gResult == noErr && !CheckAbort(globals))
+	{
+		StageTimer timer(globals, DDS_STAGE_WRITE);
+		
+		uint8 header[DDS_HEADER_SIZE];
+		
+		MakeTiledHeader(width, height, levels, format, header);
+		
+		MakeHashStamp(hash.finish(), &header[HASH_STAMP_OFFSET]);
+		
+		if( !ps_stream.write_at(0, header, DDS_HEADER_SIZE) )
+			HandleError(globals, "Failed to write file");
+		else
+			timer.count(DDS_HEADER_SIZE, DDS_HEADER_SIZE, 0);
+	}
 }
 
 
-static void DoEstimateFinish(GPtr globals)
-{
-
-}
-
 #pragma mark-
 
-static void DoWritePrepare(GPtr globals)
-{
-	gStuff->maxData = 0;
-}
-
-typedef struct {
-	unsigned8	r;
-	unsigned8	g;
-	unsigned8	b;
-	unsigned8	a;
-} RGBApixel8;
-
-static void Premultiply(RGBApixel8 *buf, int64 len)
+// L8, A8L8 and A8 from a grayscale document are the document's own bytes,
+// fetched right where they go in the file.  A8 takes the transparency,
+// the alpha channel or else the gray, A8L8's alpha is opaque without one.
+// L8 has no alpha to fill, and A8 with the alpha channel needs no gray.
+static void WriteGrayDirect(GPtr globals, int width, int height, int layout, bool use_transparency, bool use_alpha_channel)
 {
-	while(len--)
+	using namespace crnlib;
+	
+	const uint bytes = LayoutBytes(layout);
+	const int alpha_offset = (layout == DDS_LAYOUT_A8L8 ? 1 : 0);
+	const bool opaque = (layout == DDS_LAYOUT_A8L8 && !use_transparency && !use_alpha_channel);
+	
+	const bool read_alpha = (use_alpha_channel && layout != DDS_LAYOUT_L8);
+	const bool fetch_gray = !(layout == DDS_LAYOUT_A8 && use_alpha_channel);
+	
+	const uint64 file_bytes = DDS_HEADER_SIZE + (uint64)width * height * bytes;
+	
+	if(file_bytes > IN_MEMORY_MAX_BYTES)
 	{
-		if(buf->a != 255)
-		{	
-			const float mult = (float)buf->a / 255.f;
+		HandleError(globals, "Image is too large to save in this format");
+		
+		return;
+	}
+	
+	vector<uint8> file(static_cast<uint>(file_bytes));
+	
+	MakePackedHeader(width, height, 1, false, layout, file.get_ptr());
+	
+	uint8 *pixels = file.get_ptr() + DDS_HEADER_SIZE;
+	
+	gStuff->planeBytes = 1;
+	gStuff->colBytes = bytes;
+	gStuff->rowBytes = bytes * width;
+	
+	gStuff->loPlane = (layout == DDS_LAYOUT_A8 && use_transparency ? 1 : 0);
+	gStuff->hiPlane = (layout == DDS_LAYOUT_A8L8 && use_transparency ? 1 : gStuff->loPlane);
+	
+	gStuff->theRect.left = gStuff->theRect32.left = 0;
+	gStuff->theRect.right = gStuff->theRect32.right = width;
+	
+	SourceHash hash;
+	
+	HashSettings(globals, hash, (use_transparency || use_alpha_channel), width, height);
+	
+	for(int y = 0; y < height && gResult == noErr; y += ADVANCE_BAND_HEIGHT)
+	{
+		const int band_bottom = math::minimum<int>(height, y + ADVANCE_BAND_HEIGHT);
+		const int64 band_pixels = (int64)width * (band_bottom - y);
+		
+		uint8 *band = pixels + (size_t)y * gStuff->rowBytes;
+		
+		if(fetch_gray)
+		{
+			StageTimer timer(globals, DDS_STAGE_FETCH);
 			
-			buf->r = ((float)buf->r * mult) + 0.5f;
-			buf->g = ((float)buf->g * mult) + 0.5f;
-			buf->b = ((float)buf->b * mult) + 0.5f;
+			gStuff->theRect.top = gStuff->theRect32.top = y;
+			gStuff->theRect.bottom = gStuff->theRect32.bottom = band_bottom;
+			
+			gStuff->data = band;
+			
+			{
+				TraceSpan span("AdvanceState");
+				
+				gResult = AdvanceState();
+			}
+			
+			if(gResult == noErr && opaque)
+			{
+				for(int64 i = 0; i < band_pixels; i++)
+					band[i * 2 + 1] = 255;
+			}
+			
+			if(gResult == noErr)
+				timer.count(band_pixels * (gStuff->hiPlane - gStuff->loPlane + 1), band_pixels * bytes, band_pixels);
 		}
 		
-		buf++;
+		if(read_alpha && gResult == noErr)
+		{
+			StageTimer timer(globals, DDS_STAGE_ALPHA);
+			
+			ReadPixelsProc ReadProc = gStuff->channelPortProcs->readPixelsProc;
+			
+			ReadChannelDesc *alpha_channel = gStuff->documentInfo->alphaChannels;
+			
+			VRect wroteRect;
+			VRect writeRect = { y, 0, band_bottom, width };
+			PSScaling scaling; scaling.sourceRect = scaling.destinationRect = writeRect;
+			PixelMemoryDesc memDesc = { (char *)band, gStuff->rowBytes * 8, gStuff->colBytes * 8, alpha_offset * 8, gStuff->depth };
+			
+			{
+				TraceSpan span("ReadProc");
+				
+				gResult = ReadProc(alpha_channel->port, &scaling, &writeRect, &memDesc, &wroteRect);
+			}
+			
+			if(gResult == noErr)
+				timer.count(band_pixels, band_pixels, band_pixels);
+		}
+		
+		if(gResult == noErr)
+		{
+			hash.update(band, (size_t)band_pixels * bytes);
+			
+			CheckAbort(globals);
+		}
 	}
-}
-
-
-static inline crnlib::pixel_format
-Format_PS2Crunch(DDS_Format fmt)
-{
-	using namespace crnlib;
-
-	return (fmt == DDS_FMT_DXT1 ? PIXEL_FMT_DXT1 :
-			fmt == DDS_FMT_DXT1A ? PIXEL_FMT_DXT1A :
-			fmt == DDS_FMT_DXT2 ? PIXEL_FMT_DXT2 :
-			fmt == DDS_FMT_DXT3 ? PIXEL_FMT_DXT3 :
-			fmt == DDS_FMT_DXT4 ? PIXEL_FMT_DXT4 :
-			fmt == DDS_FMT_DXT5 ? PIXEL_FMT_DXT5 :
-			fmt == DDS_FMT_DXT5A ? PIXEL_FMT_DXT5A :
-			fmt == DDS_FMT_3DC ? PIXEL_FMT_3DC :
-			fmt == DDS_FMT_DXN ? PIXEL_FMT_DXN :
-			fmt == DDS_FMT_DXT5_CCxY ? PIXEL_FMT_DXT5_CCxY :
-			fmt == DDS_FMT_DXT5_xGxR ? PIXEL_FMT_DXT5_xGxR :
-			fmt == DDS_FMT_DXT5_xGBR ? PIXEL_FMT_DXT5_xGBR :
-			fmt == DDS_FMT_DXT5_AGBR ? PIXEL_FMT_DXT5_AGBR :
-			PIXEL_FMT_DXT5);
-}
-
-static bool crunch_progress(crnlib::uint percentage_complete, void* pUser_data_ptr)
-{
-	GPtr globals = static_cast<GPtr>(pUser_data_ptr);
-
-	PIUpdateProgress(percentage_complete, 100);
-
-	gResult = TestAbort();
-
-	return (gResult == noErr);
-}
-
-static unsigned int GetNumCPUs()
-{
-	static unsigned int cpus = 0;
-
-	if(cpus == 0)
+	
+	if(gResult == noErr)
 	{
-#ifdef __PIMac__
-		// get number of CPUs using Mach calls
-		host_basic_info_data_t hostInfo;
-		mach_msg_type_number_t infoCount;
+		StageTimer timer(globals, DDS_STAGE_WRITE);
 		
-		infoCount = HOST_BASIC_INFO_COUNT;
-		host_info(mach_host_self(), HOST_BASIC_INFO, 
-				  (host_info_t)&hostInfo, &infoCount);
+		const uint64 source_hash = hash.finish();
 		
-		cpus = hostInfo.max_cpus;
-#else // WIN_ENV
-		SYSTEM_INFO systemInfo;
-		GetSystemInfo(&systemInfo);
-
-		cpus = systemInfo.dwNumberOfProcessors;
-#endif
-
-		if(cpus == 0)
-			cpus = 1;
+		MakeHashStamp(source_hash, &file[HASH_STAMP_OFFSET]);
+		
+		const data_stream::attribs_t readwrite = cDataStreamReadable | cDataStreamWritable | cDataStreamSeekable;
+		
+		ps_data_stream ps_stream(gStuff->dataFork, readwrite, globals);
+		
+		ps_stream.set_size(file.size());
+		
+		if( !ps_stream.write_at(0, file.get_ptr(), file.size()) )
+			HandleError(globals, "Failed to write file");
+		else
+			timer.count(file.size() - DDS_HEADER_SIZE, file.size(), (int64)width * height);
+		
+		if(gResult == noErr && CachePath() != NULL)
+			AddToCache(ps_stream, source_hash);
 	}
-
-	return cpus;
 }
 
+
 static void DoWriteStart(GPtr globals)
 {
 	ReadParams(globals, &gOptions);
 	ReadScriptParamsOnWrite(globals);
+	
+	StartAbortChecks(globals);
+	StartStats(globals, DDS_SESSION_WRITE);
 
-	assert(gStuff->imageMode == plugInModeRGBColor);
+	const bool gray = (gStuff->imageMode == plugInModeGrayScale);
+	
+	assert(gStuff->imageMode == plugInModeRGBColor || gray);
 	assert(gStuff->depth == 8);
-	assert(gStuff->planes >= 3);
+	assert(gStuff->planes >= (gray ? 1 : 3));
 	
+	const int color_planes = (gray ? 1 : 3);
 	
-	const bool have_transparency = (gStuff->planes >= 4);
+	const bool have_transparency = (gStuff->planes > color_planes);
 	const bool have_alpha_channel = (gStuff->channelPortProcs && gStuff->documentInfo && gStuff->documentInfo->alphaChannels);
 
 	const bool use_transparency = (have_transparency && gOptions.alpha == DDS_ALPHA_TRANSPARENCY);
 	const bool use_alpha_channel = (have_alpha_channel && gOptions.alpha == DDS_ALPHA_CHANNEL);
 	
-	const bool use_alpha = (use_transparency || use_alpha_channel);
+	const bool use_alpha = (use_transparency || use_alpha_channel || GrayAsAlpha(globals, use_transparency, use_alpha_channel));
+	
+	const bool premultiply = ((use_transparency || use_alpha_channel) && gOptions.premultiply && gStuff->hostSig != 'FXTC');
 	
 
 	const int width = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.h : gStuff->imageSize.h);
 	const int height = (gStuff->PluginUsing32BitCoordinates ? gStuff->imageSize32.v : gStuff->imageSize.v);
 	
-
-	crnlib::image_u8 *img = new crnlib::image_u8(width, height);
-
-	if(!use_alpha)
+	// Auto is settled once we've seen the image, then put back for the next save
+	const DDS_Format requested_format = gOptions.format;
+	
+	// a tiled save compresses as it fetches, so Auto goes by the document
+	if(gOptions.format == DDS_FMT_AUTO && TiledSave(width, height, DDS_FMT_DXT5, gOptions.cubemap))
+		gOptions.format = (use_alpha ? DDS_FMT_DXT5 : DDS_FMT_DXT1);
+	
+	if(gray && GrayLayout(PackedLayout(gOptions.format)) && !gOptions.mipmap && !gOptions.cubemap && !premultiply)
 	{
-		using namespace crnlib::pixel_format_helpers;
-
-		const component_flags rgb_only =
-						static_cast<component_flags>(cCompFlagRValid | cCompFlagGValid | cCompFlagBValid);
-
-		img->set_comp_flags(rgb_only);
+		WriteGrayDirect(globals, width, height, PackedLayout(gOptions.format), use_transparency, use_alpha_channel);
+		
+		gOptions.format = requested_format;
+		
+		FinishAbortChecks(globals);
+		FinishStats(globals);
+		WriteTrace();
+		
+		gStuff->data = NULL;
+		
+		return;
 	}
-
+	
+	
+	MemoryPoolSession pool_session(gStuff->hostSig == 'FXTC');
+	
 
 	gStuff->loPlane = 0;
-	gStuff->hiPlane = (use_transparency ? 3 : 2);
+	gStuff->hiPlane = (use_transparency ? color_planes : color_planes - 1);
 	gStuff->colBytes = sizeof(unsigned char) * 4;
-	gStuff->rowBytes = gStuff->colBytes * img->get_pitch();
 	gStuff->planeBytes = sizeof(unsigned char);
 	
 	gStuff->theRect.left = gStuff->theRect32.left = 0;
 	gStuff->theRect.right = gStuff->theRect32.right = width;
-	gStuff->theRect.top = gStuff->theRect32.top = 0;
-	gStuff->theRect.bottom = gStuff->theRect32.bottom = height;
-
-	gStuff->data = img->get_pixels();
-
-	gResult = AdvanceState();
-
-
-	if(use_alpha && gOptions.alpha == DDS_ALPHA_CHANNEL && gResult == noErr &&
-		gStuff->channelPortProcs && gStuff->documentInfo && gStuff->documentInfo->alphaChannels)
+	
+	if( TiledSave(width, height, (DDS_Format)gOptions.format, gOptions.cubemap) )
 	{
-		ReadPixelsProc ReadProc = gStuff->channelPortProcs->readPixelsProc;
+		WriteTiled(globals, width, height, use_transparency, use_alpha_channel);
 		
-		ReadChannelDesc *alpha_channel = gStuff->documentInfo->alphaChannels;
-
-		VRect wroteRect;
-		VRect writeRect = { 0, 0, height, width };
-		PSScaling scaling; scaling.sourceRect = scaling.destinationRect = writeRect;
-		PixelMemoryDesc memDesc = { (char *)gStuff->data, gStuff->rowBytes * 8, gStuff->colBytes * 8, 3 * 8, gStuff->depth };					
+		gOptions.format = requested_format;
+		
+		FinishAbortChecks(globals);
+		FinishStats(globals);
+		WriteTrace();
+		
+		gStuff->data = NULL;
+		
+		return;
+	}
 	
-		gResult = ReadProc(alpha_channel->port, &scaling, &writeRect, &memDesc, &wroteRect);
+	// Everything else holds the whole image.  Uncompressed and cube map
+	// saves aren't tiled, so past 4 GB they're just too big.
+	if((crnlib::uint64)width * height * sizeof(crnlib::color_quad_u8) > IN_MEMORY_MAX_BYTES)
+	{
+		HandleError(globals, "Image is too large to save in this format");
+		
+		gOptions.format = requested_format;
+		
+		FinishAbortChecks(globals);
+		FinishStats(globals);
+		WriteTrace();
+		
+		gStuff->data = NULL;
+		
+		return;
 	}
+	
+
+	crnlib::image_u8 *img = new crnlib::image_u8(width, height);
 
-	if(use_alpha && gOptions.premultiply && (gStuff->hostSig != 'FXTC') && gResult == noErr)
+	if(!use_alpha)
 	{
-		RGBApixel8 *row = (RGBApixel8 *)img->get_pixels();
+		using namespace crnlib::pixel_format_helpers;
 
-		for(int y=0; y < height; y++)
-		{
-			Premultiply(row, width);
+		const component_flags rgb_only =
+						static_cast<component_flags>(cCompFlagRValid | cCompFlagGValid | cCompFlagBValid);
 
-			row += img->get_pitch();
-		}
+		img->set_comp_flags(rgb_only);
 	}
 	
-
-	crnlib::mipmapped_texture dds_file;
-
-	if(gResult == noErr)
+	crnlib::uint64 source_hash = 0;
+	
 	{
-		dds_file.assign(img);
+		SourceHash hash;
+		
+		HashSettings(globals, hash, use_alpha, width, height);
 		
-		if(gOptions.cubemap)
+		ImageStats stats = kEmptyStats;
+		
+		BandFinisher finisher(globals, hash, premultiply, (gOptions.format == DDS_FMT_AUTO ? &stats : NULL));
+	
+		for(int y = 0; y < height && gResult == noErr; y += ADVANCE_BAND_HEIGHT)
 		{
-			if(dds_file.is_vertical_cross())
+			const int band_bottom = crnlib::math::minimum<int>(height, y + ADVANCE_BAND_HEIGHT);
+			
+			FetchBand(globals, y, img->get_scanline(y), width, band_bottom - y, img->get_pitch(), use_alpha_channel);
+			
+			if(gResult == noErr)
 			{
-				const bool cubed = dds_file.vertical_cross_to_cubemap();
+				finisher.add(img->get_scanline(y), width, band_bottom - y, img->get_pitch());
 				
-				if(!cubed && gStuff->hostSig != 'FXTC')
-					HandleError(globals, "Failed to convert vertical cross to cube map");
-			}
-			else if(gStuff->hostSig != 'FXTC')
-			{
-				HandleError(globals, "Image does not appear to be vertical cross, required for a cube map");
+				CheckAbort(globals);
 			}
 		}
-	}
 		
-	if(gResult == noErr)
-	{
-		if(gOptions.mipmap)
-		{
-			crnlib::mipmapped_texture::generate_mipmap_params mipmap_p;
-
-			mipmap_p.m_pFilter = (	gOptions.filter == DDS_FILTER_BOX ? "box" :
-									gOptions.filter == DDS_FILTER_TENT ? "tent" :
-									gOptions.filter == DDS_FILTER_LANCZOS4 ? "lanczos4" :
-									gOptions.filter == DDS_FILTER_MITCHELL ? "mitchell" :
-									gOptions.filter == DDS_FILTER_KAISER ? "kaiser" :
-									"mitchell" );
-
-			dds_file.generate_mipmaps(mipmap_p, false);
-		}
+		finisher.finish();
 		
-		if(gOptions.format != DDS_FMT_UNCOMPRESSED)
-		{
-			crnlib::dxt_image::pack_params pack_p;
-
-			pack_p.m_num_helper_threads = GetNumCPUs();
-			pack_p.m_pProgress_callback = crunch_progress;
-			pack_p.m_pProgress_callback_user_data_ptr = globals;
-			
-			dds_file.convert(Format_PS2Crunch(gOptions.format), pack_p);
-		}
+		source_hash = hash.finish();
+		
+		if(gOptions.format == DDS_FMT_AUTO)
+			gOptions.format = ChooseFormat(stats, use_alpha, premultiply);
 	}
-
-	if(gResult == noErr)
+	
+	bool cache_hit = false;
+	
+	if(gResult == noErr && CachePath() != NULL)
 	{
+		StageTimer timer(globals, DDS_STAGE_WRITE);
+		
 		const crnlib::data_stream::attribs_t readwrite = crnlib::cDataStreamReadable |
 															crnlib::cDataStreamWritable |
 															crnlib::cDataStreamSeekable;
 
-		ps_data_stream ps_stream(gStuff->dataFork, readwrite);
+		ps_data_stream ps_stream(gStuff->dataFork, readwrite, globals);
+		
+		cache_hit = WriteCachedFile(globals, source_hash, ps_stream);
+		
+		if(cache_hit)
+			timer.count(0, ps_stream.get_ofs(), (int64)width * height);
+	}
+	
 
-		crnlib::data_stream_serializer serializer(&ps_stream);
+	const bool behind = (gResult == noErr && !cache_hit && QueueWriteBehind(globals, img, source_hash));
+	
+	if(!behind)
+	{
+		crnlib::mipmapped_texture dds_file;
 
-		if( !dds_file.write_dds(serializer) )
-		{
-			HandleError(globals, dds_file);
-		}
+		dds_file.assign(img); // dds_file owns img now
+		
+		if(gResult == noErr && !cache_hit)
+			CompressAndWrite(globals, dds_file, source_hash);
+	}
+	
+	gOptions.format = requested_format;
+	
+	FinishAbortChecks(globals);
+	
+	if(!behind) // otherwise the write-behind thread does this when it's done
+	{
+		FinishStats(globals);
+		WriteTrace();
 	}
 	
 	// muy importante
@@ -975,6 +8031,11 @@ static void DoWriteContinue(GPtr globals)
 
 static void DoWriteFinish(GPtr globals)
 {
+	// this frame may still be in the queue, but an earlier one that failed
+	// is reported now, and this one carries on regardless
+	if(gResult == noErr && WriteBehindFrames() > 0)
+		ReportWriteBehindError(globals, NULL);
+	
 	if(gStuff->hostSig != 'FXTC')
 		WriteScriptParamsOnWrite(globals);
 }
@@ -983,6 +8044,32 @@ static void DoWriteFinish(GPtr globals)
 #pragma mark-
 
 
+// After Effects can call us from several render threads at once.  Each call
+// gets its own copy of the globals to work with, and the process-wide bits
+// are set up under a lock.
+
+static crnlib::mutex sProcessMutex;
+static crnlib::mutex sGlobalsMutex;
+
+
+static void StartProcess(SPBasicSuite *basicSuite)
+{
+	crnlib::scoped_mutex lock(sProcessMutex);
+	
+	if(sSPBasic != basicSuite)
+		sSPBasic = basicSuite;  //thanks Tom
+	
+	InstallMemoryTracking();
+	
+	// first calls initialize function statics, which older compilers don't do thread-safely
+	TracePath();
+	CachePath();
+	DecodeCacheMegabytes();
+	WriteBehindFrames();
+	GetNumCPUs();
+}
+
+
 DLLExport MACPASCAL void PluginMain(const short selector,
 						             FormatRecord *formatParamBlock,
 						             intptr_t *data,
@@ -996,7 +8083,7 @@ DLLExport MACPASCAL void PluginMain(const short selector,
 	}
 	else
 	{
-		sSPBasic = formatParamBlock->sSPBasic;  //thanks Tom
+		StartProcess(formatParamBlock->sSPBasic);
 				
 	 	static const FProc routineForSelector [] =
 		{
@@ -1029,6 +8116,8 @@ DLLExport MACPASCAL void PluginMain(const short selector,
 		GPtr globals = NULL; 		// actual globals
 
 		
+		sGlobalsMutex.lock();
+		
 		if(formatParamBlock->handleProcs)
 		{
 			bool must_init = false;
@@ -1049,6 +8138,8 @@ DLLExport MACPASCAL void PluginMain(const short selector,
 			}
 			else
 			{
+				sGlobalsMutex.unlock();
+				
 				*result = memFullErr;
 				return;
 			}
@@ -1073,6 +8164,8 @@ DLLExport MACPASCAL void PluginMain(const short selector,
 			  // Fortunately, everything's already been cleaned up,
 			  // so all we have to do is report an error.
 			  
+			  sGlobalsMutex.unlock();
+			  
 			  *result = memFullErr;
 			  return;
 			}
@@ -1081,6 +8174,18 @@ DLLExport MACPASCAL void PluginMain(const short selector,
 			// data we've returned:
 			globals = (GPtr)globalPtr;
 		}
+		
+		Globals context = *globals;
+		
+		sGlobalsMutex.unlock();
+		
+		context.result = result;
+		context.formatParamBlock = formatParamBlock;
+		context.call_thread = CurrentThreadID();
+		context.abort_flag = 0;
+		context.progress = -1;
+		
+		globals = &context;
 
 
 		// Dispatch selector
@@ -1090,6 +8195,11 @@ DLLExport MACPASCAL void PluginMain(const short selector,
 			gResult = formatBadParameters;
 		
 		
+		crnlib::scoped_mutex lock(sGlobalsMutex);
+		
+		// options and stats carry over to the next selector
+		*(GPtr)globalPtr = context;
+		
 		if((Handle)*data != NULL)
 		{
 			if(formatParamBlock->handleProcs)
@@ -47,6 +47,9 @@
 #include "PIUtilities.h"
 #include "PIProperties.h"
 
+#include "crn_core.h"
+#include "crn_atomics.h"
+
 
 enum {
 	DDS_FMT_DXT1 = 0,
@@ -62,7 +65,14 @@ enum {
 	DDS_FMT_DXT5_CCxY,
 	DDS_FMT_DXT5_xGxR,
 	DDS_FMT_DXT5_xGBR,
-	DDS_FMT_DXT5_AGBR
+	DDS_FMT_DXT5_AGBR,
+	DDS_FMT_AUTO,		// picked to suit the image at save time
+	DDS_FMT_R5G6B5,		// uncompressed, packed to fewer bits
+	DDS_FMT_A1R5G5B5,
+	DDS_FMT_A4R4G4B4,
+	DDS_FMT_L8,
+	DDS_FMT_A8,
+	DDS_FMT_A8L8
 };
 typedef uint8 DDS_Format;
 
@@ -85,11 +95,51 @@ enum{
 typedef uint8 DDS_Filter;
 
 
+// stages timed by DoWriteStart and DoReadContinue
+enum {
+	DDS_STAGE_FETCH = 0,
+	DDS_STAGE_ALPHA,
+	DDS_STAGE_PREMULTIPLY,
+	DDS_STAGE_CUBEMAP,
+	DDS_STAGE_MIPMAP,
+	DDS_STAGE_PACK,
+	DDS_STAGE_WRITE,
+	DDS_STAGE_READ,
+	DDS_STAGE_DECODE,
+	DDS_STAGE_HANDOFF,
+	DDS_NUM_STAGES
+};
+typedef uint8 DDS_Stage;
+
+
+enum {
+	DDS_SESSION_NONE = 0,
+	DDS_SESSION_READ,
+	DDS_SESSION_WRITE
+};
+typedef uint8 DDS_Session;
+
+
+typedef struct {
+	double		wall_time;		// seconds
+	double		cpu_time;		// seconds, summed over all threads
+	int64		bytes_in;
+	int64		bytes_out;
+	int64		pixels;
+	int64		memory_peak;	// most bytes allocated at once during the stage
+	int64		memory_change;	// allocated at the end minus at the start
+	int64		allocations;
+} DDS_StageStats;
+
+
 typedef struct {
 	char		sig[4];
 	uint8		version;
 	DDS_Alpha	alpha;
-	uint8		reserved[26];
+	uint8		scale;		// read at 1/scale size, 0 or 1 for full size
+	uint8		reserved1;
+	uint16		preview;	// if set, read no bigger than preview x preview instead
+	uint8		reserved[22];
 	
 } DDS_inData;
 
@@ -103,7 +153,8 @@ typedef struct {
 	Boolean			mipmap;
 	DDS_Filter		filter;
 	Boolean			cubemap;
-	uint8			reserved[245];
+	Boolean			dither;		// ordered dither when packing to fewer bits
+	uint8			reserved[244];
 	
 } DDS_outData;
 
@@ -119,6 +170,17 @@ typedef struct Globals
 	DDS_inData			in_options;
 	DDS_outData			options;
 	
+	double				abort_poll_time;	// when we last asked the host about cancel
+	double				abort_max_latency;	// worst gap between those asks this session
+	crnlib::atomic32_t	abort_flag;			// the host said cancel, for threads that can't ask it
+	crnlib::atomic32_t	progress;			// percent from a helper thread, -1 once the host has it
+	
+	DDS_Session			stats_session;		// what the stats below were measuring
+	DDS_StageStats		stats[DDS_NUM_STAGES];
+	int64				memory_peak;		// most bytes allocated at once, whole session
+	
+	uint32				call_thread;		// thread that called PluginMain, only one that may call the host
+	
 } Globals, *GPtr, **GHdl;				// *GPtr = global pointer; **GHdl = global handle
 
 
@@ -154,6 +216,7 @@ DLLExport MACPASCAL void PluginMain (const short selector,
 						             short *result);
 
 // Scripting functions
+Boolean ReadScriptParamsOnRead (GPtr globals);	// Read any scripting params.
 Boolean ReadScriptParamsOnWrite (GPtr globals);	// Read any scripting params.
 OSErr WriteScriptParamsOnWrite (GPtr globals);	// Write any scripting params.
 
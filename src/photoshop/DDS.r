@@ -122,14 +122,14 @@ resource 'PiPL' (ResourceID, plugInName " PiPL", purgeable)
 		
 		SupportedModes
 		{
-			noBitmap, noGrayScale,
+			noBitmap, doesSupportGrayScale,
 			noIndexedColor, doesSupportRGBColor,
 			noCMYKColor, noHSLColor,
 			noHSBColor, noMultichannel,
 			noDuotone, noLABColor
 		},
 			
-		EnableInfo { "in (PSHOP_ImageMode, RGBMode, RGBColorMode)" },
+		EnableInfo { "in (PSHOP_ImageMode, GrayScaleMode, RGBMode, RGBColorMode)" },
 	
 		FmtFileType { 'DDS ', '8BIM' },
 		ReadTypes { { 'DDS ', '    ' } },
@@ -142,9 +142,9 @@ resource 'PiPL' (ResourceID, plugInName " PiPL", purgeable)
 					  fmtCanWriteIfRead, 
 					  fmtCanWriteTransparency,
 					  fmtCannotCreateThumbnail },
-		PlugInMaxSize { 8192, 8192 },
-		FormatMaxSize { { 8192, 8192 } },
-		FormatMaxChannels { {   0, 0, 0, 5, 0, 0, 
+		PlugInMaxSize { 32767, 32767 },
+		FormatMaxSize { { 32767, 32767 } },
+		FormatMaxChannels { {   0, 3, 0, 5, 0, 0, 
 							   0, 0, 0, 0, 0, 0 } },
 		//FormatICCFlags { 	iccCanEmbedGray,
 		//					iccCanEmbedIndexed,
@@ -251,9 +251,135 @@ resource 'aete' (ResourceID, plugInName " dictionary", purgeable)
 				typeBoolean,
 				"Convert vertical cross to cube map",
 				flagsSingleProperty,
+
+				"Dither",
+				keyDDSdither,
+				typeBoolean,
+				"Ordered dither when packing to 16 bits",
+				flagsSingleProperty,
+
+				"Read Scale",
+				keyDDSreadScale,
+				typeInteger,
+				"Read at 1/n size",
+				flagsSingleProperty,
+				
+				"Preview Size",
+				keyDDSpreviewSize,
+				typeInteger,
+				"Read no bigger than n x n",
+				flagsSingleProperty,
+				
+				"Cancel Latency",
+				keyDDScancelLatency,
+				typeFloat,
+				"Last save, longest wait to notice a cancel in seconds",
+				flagsSingleProperty,
+				
+				"Memory Peak",
+				keyDDSmemoryPeak,
+				typeFloat,
+				"Last save, most bytes allocated at once",
+				flagsSingleProperty,
+				
+				"Fetch Stats",
+				keyDDSstatFetch,
+				classDDSstage,
+				"Last save, fetching the image",
+				flagsSingleProperty,
+				
+				"Alpha Stats",
+				keyDDSstatAlpha,
+				classDDSstage,
+				"Last save, reading the alpha channel",
+				flagsSingleProperty,
+				
+				"Premultiply Stats",
+				keyDDSstatPremultiply,
+				classDDSstage,
+				"Last save, premultiplying",
+				flagsSingleProperty,
+				
+				"Cube Map Stats",
+				keyDDSstatCubemap,
+				classDDSstage,
+				"Last save, making the cube map",
+				flagsSingleProperty,
+				
+				"Mipmap Stats",
+				keyDDSstatMipmap,
+				classDDSstage,
+				"Last save, making mipmaps",
+				flagsSingleProperty,
+				
+				"Pack Stats",
+				keyDDSstatPack,
+				classDDSstage,
+				"Last save, compressing",
+				flagsSingleProperty,
+				
+				"Write Stats",
+				keyDDSstatWrite,
+				classDDSstage,
+				"Last save, writing the file",
+				flagsSingleProperty,
 			},
 			{}, /* elements (not supported) */
 			/* class descriptions */
+			
+			"DDS stage",
+			classDDSstage,
+			"Statistics for one stage of the last save",
+			{
+				"Wall Time",
+				keyDDSwallTime,
+				typeFloat,
+				"Seconds",
+				flagsSingleProperty,
+				
+				"CPU Time",
+				keyDDScpuTime,
+				typeFloat,
+				"Seconds of CPU time",
+				flagsSingleProperty,
+				
+				"Bytes In",
+				keyDDSbytesIn,
+				typeFloat,
+				"Bytes the stage read",
+				flagsSingleProperty,
+				
+				"Bytes Out",
+				keyDDSbytesOut,
+				typeFloat,
+				"Bytes the stage produced",
+				flagsSingleProperty,
+				
+				"Megapixels Per Second",
+				keyDDSmegapixelsPerSec,
+				typeFloat,
+				"Throughput",
+				flagsSingleProperty,
+				
+				"Stage Memory Peak",
+				keyDDSmemoryPeakStage,
+				typeFloat,
+				"Most bytes allocated at once during the stage",
+				flagsSingleProperty,
+				
+				"Memory Change",
+				keyDDSmemoryChange,
+				typeFloat,
+				"Net change in bytes allocated over the stage",
+				flagsSingleProperty,
+				
+				"Allocations",
+				keyDDSallocations,
+				typeFloat,
+				"Number of allocations",
+				flagsSingleProperty,
+			},
+			{}, /* elements (not supported) */
 		},
 		{}, /* comparison ops (not supported) */
 		{	/* any enumerations */
@@ -298,6 +424,50 @@ resource 'aete' (ResourceID, plugInName " dictionary", purgeable)
                 "Uncompressed",
                 formatUncompressed,
                 "Uncompressed format",
+
+                "Auto",
+                formatAuto,
+                "Format chosen to suit the image",
+
+                "R5G6B5",
+                formatR5G6B5,
+                "16-bit uncompressed RGB",
+
+                "A1R5G5B5",
+                formatA1R5G5B5,
+                "16-bit uncompressed RGB with 1-bit alpha",
+
+                "A4R4G4B4",
+                formatA4R4G4B4,
+                "16-bit uncompressed RGBA",
+
+                "L8",
+                formatL8,
+                "8-bit uncompressed luminance",
+
+                "A8",
+                formatA8,
+                "8-bit uncompressed alpha",
+
+                "A8L8",
+                formatA8L8,
+                "16-bit uncompressed luminance and alpha",
+
+                "DXT5 CCxY",
+                formatDXT5_CCxY,
+                "DXT5 with YCoCg color",
+
+                "DXT5 xGxR",
+                formatDXT5_xGxR,
+                "DXT5 normal map, red in alpha",
+
+                "DXT5 xGBR",
+                formatDXT5_xGBR,
+                "DXT5 with red in alpha",
+
+                "DXT5 AGBR",
+                formatDXT5_AGBR,
+                "DXT5 with red and alpha swapped",
 			},
 			typeAlphaChannel,
 			{
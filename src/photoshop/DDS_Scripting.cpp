@@ -55,6 +55,17 @@ static DDS_Format KeyToFormat(OSType key)
 			(key == format3DC)			?	DDS_FMT_3DC :
 			(key == formatDXN)			?	DDS_FMT_DXN :
 			(key == formatUncompressed)	?	DDS_FMT_UNCOMPRESSED :
+			(key == formatAuto)			?	DDS_FMT_AUTO :
+			(key == formatR5G6B5)		?	DDS_FMT_R5G6B5 :
+			(key == formatA1R5G5B5)		?	DDS_FMT_A1R5G5B5 :
+			(key == formatA4R4G4B4)		?	DDS_FMT_A4R4G4B4 :
+			(key == formatL8)			?	DDS_FMT_L8 :
+			(key == formatA8)			?	DDS_FMT_A8 :
+			(key == formatA8L8)			?	DDS_FMT_A8L8 :
+			(key == formatDXT5_CCxY)	?	DDS_FMT_DXT5_CCxY :
+			(key == formatDXT5_xGxR)	?	DDS_FMT_DXT5_xGxR :
+			(key == formatDXT5_xGBR)	?	DDS_FMT_DXT5_xGBR :
+			(key == formatDXT5_AGBR)	?	DDS_FMT_DXT5_AGBR :
 			DDS_FMT_DXT5;
 }
 
@@ -76,6 +87,50 @@ static DDS_Filter KeyToFilter(OSType key)
 			DDS_FILTER_MITCHELL);
 }
 
+Boolean ReadScriptParamsOnRead(GPtr globals)
+{
+	PIReadDescriptor			token = NULL;
+	DescriptorKeyID				key = 0;
+	DescriptorTypeID			type = 0;
+	DescriptorKeyIDArray		array = { NULLID };
+	int32						flags = 0;
+	OSErr						stickyError = noErr;
+	Boolean						returnValue = true;
+	int32						storeValue;
+	
+	if (DescriptorAvailable(NULL))
+	{
+		token = OpenReader(array);
+		if (token)
+		{
+			while (PIGetKey(token, &key, &type, &flags))
+			{
+				switch (key)
+				{
+					case keyDDSreadScale:
+							PIGetInt(token, &storeValue);
+							gInOptions.scale = (storeValue < 1 ? 1 : storeValue > 255 ? 255 : storeValue);
+							break;
+
+					case keyDDSpreviewSize:
+							PIGetInt(token, &storeValue);
+							gInOptions.preview = (storeValue < 0 ? 0 : storeValue > 65535 ? 65535 : storeValue);
+							break;
+				}
+			}
+
+			stickyError = CloseReader(&token); // closes & disposes.
+				
+			if (stickyError && stickyError != errMissingParameter)
+				gResult = stickyError;
+		}
+		
+		returnValue = PlayDialog();
+	}
+	
+	return returnValue;
+}
+
 Boolean ReadScriptParamsOnWrite(GPtr globals)
 {
 	PIReadDescriptor			token = NULL;
@@ -128,6 +183,11 @@ Boolean ReadScriptParamsOnWrite(GPtr globals)
 							PIGetBool(token, &boolStoreValue);
 							gOptions.cubemap = boolStoreValue;
 							break;
+
+					case keyDDSdither:
+							PIGetBool(token, &boolStoreValue);
+							gOptions.dither = boolStoreValue;
+							break;
 				}
 			}
 
@@ -164,6 +224,17 @@ static OSType FormatToKey(DDS_Format fmt)
 			(fmt == DDS_FMT_3DC)			? format3DC :
 			(fmt == DDS_FMT_DXN)			? formatDXN :
 			(fmt == DDS_FMT_UNCOMPRESSED)	? formatUncompressed :
+			(fmt == DDS_FMT_AUTO)			? formatAuto :
+			(fmt == DDS_FMT_R5G6B5)			? formatR5G6B5 :
+			(fmt == DDS_FMT_A1R5G5B5)		? formatA1R5G5B5 :
+			(fmt == DDS_FMT_A4R4G4B4)		? formatA4R4G4B4 :
+			(fmt == DDS_FMT_L8)				? formatL8 :
+			(fmt == DDS_FMT_A8)				? formatA8 :
+			(fmt == DDS_FMT_A8L8)			? formatA8L8 :
+			(fmt == DDS_FMT_DXT5_CCxY)		? formatDXT5_CCxY :
+			(fmt == DDS_FMT_DXT5_xGxR)		? formatDXT5_xGxR :
+			(fmt == DDS_FMT_DXT5_xGBR)		? formatDXT5_xGBR :
+			(fmt == DDS_FMT_DXT5_AGBR)		? formatDXT5_AGBR :
 			formatDXT5;
 }
 
@@ -185,6 +256,70 @@ static OSType FilterToKey(DDS_Filter filter)
 			filterMitchell);
 }
 
+static OSErr PutStageStats(GPtr globals, PIWriteDescriptor token, DescriptorKeyID key, const DDS_StageStats &stats)
+{
+	WriteDescriptorProcs *writeProcs = gStuff->descriptorParameters->writeDescriptorProcs;
+
+	PIWriteDescriptor stage_token = OpenWriter();
+	
+	if(stage_token == NULL)
+		return noErr;
+	
+	const double bytes_in = (double)stats.bytes_in;
+	const double bytes_out = (double)stats.bytes_out;
+	const double mpps = (stats.wall_time > 0.0 ? (double)stats.pixels / stats.wall_time / 1000000.0 : 0.0);
+	
+	PIPutFloat(stage_token, keyDDSwallTime, &stats.wall_time);
+	PIPutFloat(stage_token, keyDDScpuTime, &stats.cpu_time);
+	PIPutFloat(stage_token, keyDDSbytesIn, &bytes_in);
+	PIPutFloat(stage_token, keyDDSbytesOut, &bytes_out);
+	PIPutFloat(stage_token, keyDDSmegapixelsPerSec, &mpps);
+	
+	const double memory_peak = (double)stats.memory_peak;
+	const double memory_change = (double)stats.memory_change;
+	const double allocations = (double)stats.allocations;
+	
+	PIPutFloat(stage_token, keyDDSmemoryPeakStage, &memory_peak);
+	PIPutFloat(stage_token, keyDDSmemoryChange, &memory_change);
+	PIPutFloat(stage_token, keyDDSallocations, &allocations);
+	
+	PIDescriptorHandle stage_desc = NULL;
+	
+	OSErr err = writeProcs->closeWriteDescriptorProc(stage_token, &stage_desc);
+	
+	if(err == noErr && stage_desc != NULL)
+	{
+		err = writeProcs->putObjectProc(token, key, classDDSstage, stage_desc);
+		
+		PIDisposeHandle((Handle)stage_desc);
+	}
+	
+	return err;
+}
+
+static void PutStats(GPtr globals, PIWriteDescriptor token)
+{
+	PIPutFloat(token, keyDDScancelLatency, &globals->abort_max_latency);
+	
+	const double memory_peak = (double)globals->memory_peak;
+	
+	PIPutFloat(token, keyDDSmemoryPeak, &memory_peak);
+
+	const DescriptorKeyID stage_keys[] = {	keyDDSstatFetch,
+											keyDDSstatAlpha,
+											keyDDSstatPremultiply,
+											keyDDSstatCubemap,
+											keyDDSstatMipmap,
+											keyDDSstatPack,
+											keyDDSstatWrite };
+	
+	for(int i = DDS_STAGE_FETCH; i <= DDS_STAGE_WRITE; i++)
+	{
+		if(globals->stats[i].wall_time > 0.0)
+			PutStageStats(globals, token, stage_keys[i], globals->stats[i]);
+	}
+}
+
 OSErr WriteScriptParamsOnWrite(GPtr globals)
 {
 	PIWriteDescriptor			token = nil;
@@ -209,6 +344,11 @@ OSErr WriteScriptParamsOnWrite(GPtr globals)
 				PIPutEnum(token, keyDDSfilter, typeFilter, FilterToKey(gOptions.filter));
 			
 			PIPutBool(token, keyDDScubemap, gOptions.cubemap);
+			
+			PIPutBool(token, keyDDSdither, gOptions.dither);
+			
+			if(globals->stats_session == DDS_SESSION_WRITE)
+				PutStats(globals, token);
 				
 			gotErr = CloseWriter(&token); /* closes and sets dialog optional */
 			/* done.  Now pass handle on to Photoshop */
@@ -54,6 +54,33 @@
 #define keyDDSmipmap			'DDSm'
 #define keyDDSfilter			'DDSq'
 #define keyDDScubemap			'DDSc'
+#define keyDDSdither			'DDSd'
+
+#define keyDDSreadScale			'DDSr'
+#define keyDDSpreviewSize		'DDSv'
+
+// statistics from the last save, written but never read
+#define keyDDScancelLatency		'DDSl'
+#define keyDDSmemoryPeak		'DDSM'
+
+#define keyDDSstatFetch			'Sfch'
+#define keyDDSstatAlpha			'Salf'
+#define keyDDSstatPremultiply	'Spre'
+#define keyDDSstatCubemap		'Scub'
+#define keyDDSstatMipmap		'Smip'
+#define keyDDSstatPack			'Spak'
+#define keyDDSstatWrite			'Swri'
+
+#define classDDSstage			'DDSs'
+
+#define keyDDSwallTime			'Wall'
+#define keyDDScpuTime			'CPUt'
+#define keyDDSbytesIn			'BytI'
+#define keyDDSbytesOut			'BytO'
+#define keyDDSmegapixelsPerSec	'MPps'
+#define keyDDSmemoryPeakStage	'MemP'
+#define keyDDSmemoryChange		'MemC'
+#define keyDDSallocations		'Allc'
 
 #define typeDDSformat			'DXTn'
 
@@ -67,6 +94,17 @@
 #define format3DC				'D3Dc'
 #define formatDXN				'DXNc'
 #define formatUncompressed		'DXun'
+#define formatAuto				'DXau'
+#define formatR5G6B5			'D565'
+#define formatA1R5G5B5			'D555'
+#define formatA4R4G4B4			'D444'
+#define formatL8				'DXl8'
+#define formatA8				'DXa8'
+#define formatA8L8				'DXal'
+#define formatDXT5_CCxY			'D5cy'
+#define formatDXT5_xGxR			'D5gr'
+#define formatDXT5_xGBR			'D5br'
+#define formatDXT5_AGBR			'D5ar'
 
 #define typeAlphaChannel		'alfT'
 
@@ -50,7 +50,18 @@ typedef enum {
 	DIALOG_FMT_DXT5A,
 	DIALOG_FMT_3DC,
 	DIALOG_FMT_DXN,
-	DIALOG_FMT_UNCOMPRESSED
+	DIALOG_FMT_UNCOMPRESSED,
+	DIALOG_FMT_AUTO,
+	DIALOG_FMT_R5G6B5,
+	DIALOG_FMT_A1R5G5B5,
+	DIALOG_FMT_A4R4G4B4,
+	DIALOG_FMT_L8,
+	DIALOG_FMT_A8,
+	DIALOG_FMT_A8L8,
+	DIALOG_FMT_DXT5_CCxY,
+	DIALOG_FMT_DXT5_xGxR,
+	DIALOG_FMT_DXT5_xGBR,
+	DIALOG_FMT_DXT5_AGBR
 } DialogFormat;
 
 typedef enum {
@@ -85,6 +96,7 @@ typedef struct {
 // return true if user hit OK
 // if user hit OK, params block will have been modified
 //
+// allow_dialog is false when a script has turned dialogs off
 // plugHndl is bundle identifier string on Mac, hInstance on win
 // mwnd is the main window for Windows
 
@@ -92,6 +104,7 @@ bool
 DDS_InUI(
 	DDS_InUI_Data		*params,
 	bool				has_alpha,
+	bool				allow_dialog,
 	const void			*plugHndl,
 	const void			*mwnd);
 
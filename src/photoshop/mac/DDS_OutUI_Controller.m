@@ -59,7 +59,9 @@
 	
 	
 	[formatPulldown addItemsWithTitles:
-	 [NSArray arrayWithObjects:@"DXT1", @"DXT1A", @"DXT2", @"DXT3", @"DXT4", @"DXT5", @"DXT5A", @"3Dc", @"DXN", @"Uncompressed", nil]];
+	 [NSArray arrayWithObjects:@"DXT1", @"DXT1A", @"DXT2", @"DXT3", @"DXT4", @"DXT5", @"DXT5A", @"3Dc", @"DXN", @"Uncompressed", @"Auto",
+	  @"R5G6B5", @"A1R5G5B5", @"A4R4G4B4", @"L8", @"A8", @"A8L8",
+	  @"DXT5 CCxY", @"DXT5 xGxR", @"DXT5 xGBR", @"DXT5 AGBR", nil]];
 	[formatPulldown selectItem:[formatPulldown itemAtIndex:format]];
 	
 	
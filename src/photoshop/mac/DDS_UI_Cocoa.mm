@@ -57,6 +57,7 @@ bool
 DDS_InUI(
 	DDS_InUI_Data		*params,
 	bool				has_alpha,
+	bool				allow_dialog,
 	const void			*plugHndl,
 	const void			*mwnd)
 {
@@ -94,7 +95,7 @@ DDS_InUI(
 	const NSUInteger flags = [[NSApp currentEvent] modifierFlags];
 	const bool shift_key = ( (flags & NSShiftKeyMask) || (flags & NSAlternateKeyMask) );
 
-	if((has_alpha && auto_dialog) || shift_key)
+	if(allow_dialog && ((has_alpha && auto_dialog) || shift_key))
 	{
 		// do the dialog (or maybe not (but we still load the object to get the prefs)
 		NSString *bundle_id = [NSString stringWithUTF8String:(const char *)plugHndl];
@@ -180,6 +180,7 @@ bool
 DDS_InUI(
 	DDS_InUI_Data		*params,
 	bool				has_alpha,
+	bool				allow_dialog,
 	const void			*plugHndl,
 	const void			*mwnd)
 {
@@ -193,7 +194,7 @@ DDS_InUI(
 	// check for that shift key
 	bool shift_key = ( KeyIsDown(VK_LSHIFT) || KeyIsDown(VK_RSHIFT) || KeyIsDown(VK_LMENU) || KeyIsDown(VK_RMENU) );
 
-	if((g_autoD && has_alpha) || shift_key)
+	if(allow_dialog && ((g_autoD && has_alpha) || shift_key))
 	{
 		int status = DialogBox((HINSTANCE)plugHndl, (LPSTR)"IN_DIALOG", (HWND)mwnd, (DLGPROC)DialogProc);
 
@@ -122,11 +122,22 @@ static BOOL CALLBACK DialogProc(HWND hwndDlg, UINT message, WPARAM wParam, LPARA
 										"DXT5A",
 										"3Dc",
 										"DXN",
-										"Uncompressed" };
+										"Uncompressed",
+										"Auto",
+										"R5G6B5",
+										"A1R5G5B5",
+										"A4R4G4B4",
+										"L8",
+										"A8",
+										"A8L8",
+										"DXT5 CCxY",
+										"DXT5 xGxR",
+										"DXT5 xGBR",
+										"DXT5 AGBR" };
 
 				HWND menu = GetDlgItem(hwndDlg, OUT_Format_Menu);
 
-				for(int i=DIALOG_FMT_DXT1; i <= DIALOG_FMT_UNCOMPRESSED; i++)
+				for(int i=DIALOG_FMT_DXT1; i <= DIALOG_FMT_DXT5_AGBR; i++)
 				{
 					SendMessage(menu, (UINT)CB_ADDSTRING, (WPARAM)wParam, (LPARAM)(LPCTSTR)opts[i] );
 					SendMessage(menu, (UINT)CB_SETITEMDATA, (WPARAM)i, (LPARAM)(DWORD)i); // this is the compresion number